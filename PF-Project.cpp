@@ -2,8 +2,55 @@
 #include <fstream>
 #include <string>
 #include <iomanip>
+#include <sstream>
 #include <limits>
 #include <cstdlib>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <ctime>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <unordered_set>
+#include <memory>
+#include <atomic>
+#include <coroutine>
+#include <future>
+#include <deque>
+#include <memory_resource>
+#include <charconv>
+#include <bit>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 using namespace std;
 
 // Structure to hold user credentials
@@ -22,38 +69,1547 @@ struct User {
 struct BillingRecord {
     string username;
     string meterSerial;
-    string month;
+    int period;   // year * 12 + month, see makePeriod
     int previousReading;
     int currentReading;
     int unitsConsumed;
     double totalBill;
 };
 
+// Bloom filter over strings with about 10 bits and 7 probes per key, which gives
+// roughly 1% false positives. The bits are 64-bit words so they can be stored in
+// a file header and loaded back as they are.
+class BloomFilter {
+public:
+    BloomFilter() {}
+    void reset(size_t expectedKeys);
+    void add(string_view key);
+    bool mightContain(string_view key) const;
+    const vector<uint64_t>& words() const { return bits; }
+    void assign(const uint64_t* words, size_t count) { bits.assign(words, words + count); }
+
+private:
+    vector<uint64_t> bits;
+};
+
+// Header of users.bloom: filters over the usernames and meter serials in the
+// first coveredBytes of users.txt, followed by the words of both filters
+struct UserFilterHeader {
+    char magic[4];          // "PFUF"
+    uint32_t version;
+    uint64_t coveredBytes;
+    uint64_t capacity;      // keys each filter was sized for
+    uint64_t nameCount;
+    uint64_t serialCount;
+    uint64_t nameWords;
+    uint64_t serialWords;
+    uint64_t fingerprint;   // prefixFingerprint() of users.txt over coveredBytes
+};
+
+// Hash and equality over string_view, so maps keyed by arena strings can be
+// searched with a std::string or a view without building a key
+struct TextHash {
+    typedef void is_transparent;
+    size_t operator()(string_view text) const { return hash<string_view>()(text); }
+};
+
+struct TextEqual {
+    typedef void is_transparent;
+    bool operator()(string_view a, string_view b) const { return a == b; }
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+    bool open(const string& fileName);
+    void close();
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+    
+    const char* bytes;
+    size_t length;
+};
+
+// Splits a buffer in memory into lines. Newlines are found 64 bytes at a time
+// and handed out from a bit mask, so a short line costs a few instructions
+// instead of a memchr call. The mask comes from SSE2 compares on x86; elsewhere,
+// and for the last partial window, memchr fills it. A last line without '\n' counts.
+class NewlineSplitter {
+public:
+    NewlineSplitter(const char* data, size_t size);
+    bool next(string_view& line);
+
+private:
+    void scan();
+    
+    const char* data;
+    size_t size;
+    size_t cursor;          // start of the next line
+    size_t base;            // window the mask covers
+    uint64_t mask;          // newlines in the window not handed out yet
+};
+
+// One user block as views into the mapped users.txt, or into a User added since.
+// Making a view only finds the line boundaries; the meter count is parsed and
+// strings are copied only when asked for.
+struct UserView {
+    string_view username;
+    string_view password;
+    string_view fullName;
+    string_view streetNumber;
+    string_view residentialArea;
+    string_view meters;
+    string_view meter1Serial;
+    string_view meter2Serial;
+    
+    int numberOfMeters() const;
+    User toUser() const;
+};
+
+// Slot of UserStore's open-addressing tables: a username or serial, found by
+// where it sits in its block of users.txt. Keys are hashed with hashBytes, which
+// does not change between builds, since the tables are saved to users.idx. A key more than 64 KB into its block
+// has keyOffset LONG_USER_KEY and keyLength saying which key (0 name, 1 or 2 serial).
+struct UserSlot {
+    uint64_t block;         // block offset in users.txt plus 1; 0 for an empty slot
+    uint32_t tag;           // top 32 bits of the key's hash
+    uint16_t keyOffset;     // the key's position within the block
+    uint16_t keyLength;
+};
+
+const uint16_t LONG_USER_KEY = 0xFFFF;
+
+// A table of UserSlots, built in memory or mapped from users.idx
+struct UserTable {
+    const UserSlot* slots;
+    size_t capacity;        // a power of two
+    vector<UserSlot> owned;
+};
+
+// Header of users.idx: both UserStore tables over the first coveredBytes of
+// users.txt, laid out as in memory so they are mapped rather than read
+struct UserIndexHeader {
+    char magic[4];          // "PFUI"
+    uint32_t version;
+    uint64_t coveredBytes;
+    uint64_t users;         // distinct names
+    uint64_t serials;       // distinct serials
+    uint64_t nameSlots;
+    uint64_t serialSlots;
+    uint64_t blocks;        // user blocks, counting superseded ones
+    uint64_t fingerprint;   // prefixFingerprint() of users.txt over coveredBytes
+};
+
+// Index of users.txt keyed by username and meter serial.
+// The file is mapped and split once into tables of block offsets, which takes no
+// copies of any field; find() decodes a User the first time it is asked for and
+// view() never does. The tables are saved to users.idx and mapped on the next
+// start, so only blocks appended since are split. Registrations are added
+// directly so the index never goes stale. A username's last block wins, so a
+// user is changed by appending a new block; a serial's first owner wins.
+// superseded() counts the blocks a later one replaced, so compactUsers() can
+// tell when users.txt is worth rewriting.
+// Until the index is needed, existence checks go to bloom filters kept in
+// users.bloom, so a name or serial that is not taken costs no read of the file.
+// Once loaded, view(), ownerOfSerial() and exists() only read, so threads may
+// share them as long as nobody calls add(); find() takes a lock to decode.
+class UserStore {
+public:
+    UserStore(string fileName);
+    bool exists(const string& username);
+    bool serialInUse(const string& meterSerial);
+    bool mightExist(const string& username);
+    bool mightUseSerial(const string& meterSerial);
+    const User* find(const string& username);
+    bool view(string_view username, UserView& user);
+    void add(const User& user);
+    string_view ownerOfSerial(string_view meterSerial);
+    size_t size();
+    size_t superseded() const { return supersededBlocks; }
+    bool indexLoaded() const { return loaded; }
+    bool persistFilters();
+    void removeSidecars();
+    void reload();
+
+private:
+    void load();
+    bool mapIndex();
+    void buildIndex();
+    bool saveIndex();
+    void overlay(const User& user);
+    UserSlot slotFor(uint64_t block, string_view key, uint16_t which, uint64_t& hash) const;
+    void buildTable(const vector<UserSlot>& keys, const vector<uint64_t>& hashes, UserTable& table,
+                    size_t& count, bool replace);
+    const UserSlot* probe(const UserTable& table, string_view key) const;
+    string_view keyOf(const UserSlot& slot) const;
+    bool viewAt(uint64_t block, UserView& user) const;
+    void loadFilters();
+    void rebuildFilters();
+    void addToFilters(const User& user);
+    bool saveFilters(uint64_t coveredBytes);
+    
+    string fileName;
+    string filterFile;
+    string indexFile;
+    bool loaded;
+    uint64_t loadedBytes;
+    MappedFile mapping;
+    MappedFile indexMapping;
+    UserTable nameTable;
+    UserTable serialTable;
+    size_t mappedUsers;
+    size_t mappedSerials;
+    size_t extraUsers;                  // added users whose name is not in the mapping
+    size_t supersededBlocks;
+    unordered_map<string, User, TextHash, TextEqual> added;
+    unordered_map<string, string, TextHash, TextEqual> addedSerials;
+    mutex decodeLock;
+    unordered_map<string, User> decoded;
+    
+    bool filtersLoaded;
+    uint64_t filterCapacity;
+    uint64_t nameCount;
+    uint64_t serialCount;
+    BloomFilter names;
+    BloomFilter serials;
+};
+
+// Monotonic arena for memory that lives as long as one scan or one generation of
+// an index. Allocation is a pointer bump inside large blocks; nothing is freed on
+// its own and release() hands every block back at once.
+class ScanArena {
+public:
+    ScanArena(size_t firstBlockBytes = 1 << 16);
+    pmr::memory_resource* resource() { return &arena; }
+    void release() { arena.release(); }
+    size_t blocks() const { return upstream.blocks; }
+    size_t reservedBytes() const { return upstream.bytes; }
+
+private:
+    // Where the arena gets its blocks from; counts them for the benchmarks
+    class BlockSource : public pmr::memory_resource {
+    public:
+        BlockSource() : blocks(0), bytes(0) {}
+        size_t blocks;
+        size_t bytes;
+    
+    private:
+        void* do_allocate(size_t size, size_t alignment);
+        void do_deallocate(void* block, size_t size, size_t alignment);
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept { return this == &other; }
+    };
+    
+    ScanArena(const ScanArena&);
+    ScanArena& operator=(const ScanArena&);
+    
+    BlockSource upstream;
+    pmr::monotonic_buffer_resource arena;
+};
+
+// String-keyed map whose nodes, keys and values all live in one arena
+template <class T>
+using ArenaMap = pmr::unordered_map<pmr::string, T, TextHash, TextEqual>;
+
+// The entry for key, added with a default value if missing; the key is only
+// copied into the arena when it is new
+template <class T>
+T& arenaEntry(ArenaMap<T>& map, string_view key) {
+    typename ArenaMap<T>::iterator it = map.find(key);
+    if (it == map.end()) {
+        it = map.emplace(piecewise_construct, forward_as_tuple(key), forward_as_tuple()).first;
+    }
+    return it->second;
+}
+
+class LedgerSegments;
+
+// Latest billing state of one meter
+struct MeterState {
+    int lastReading;
+    int32_t lastPeriod;   // -1 if the period was not recognised
+};
+
+// In-memory index of records.txt holding the latest record per (username, meterSerial).
+// It is rebuilt with a single pass on first use and updated by saveBillingRecord,
+// so the last reading and month of a meter are one hash lookup. Entries live in
+// the index's arena, which a reload releases in one go.
+// With sealed segments, a lookup only loads the unsealed tail of records.txt and
+// asks the segments for meters not billed there. size() always loads every meter,
+// for callers that read the index from several threads afterwards.
+class LedgerIndex {
+public:
+    LedgerIndex(string fileName, LedgerSegments* segments = NULL);
+    const MeterState* latest(const string& username, const string& meterSerial);
+    const MeterState* latestByKey(const string& meterKey);
+    void update(const BillingRecord& record);
+    void set(const string& meterKey, const MeterState& state);
+    void prepare();
+    size_t size();
+    static string key(string_view username, string_view meterSerial);
+    static void key(string_view username, string_view meterSerial, string& into);
+
+private:
+    void load(bool full);
+    
+    string fileName;
+    LedgerSegments* segments;
+    bool loaded;
+    bool complete;   // false while only the unsealed tail is loaded
+    ScanArena arena;
+    ArenaMap<MeterState> meters;
+};
+
+// Running totals over a set of billing records
+struct UsageAggregate {
+    long long count;
+    long long totalUnits;
+    int64_t totalPaisa;
+    int minUnits;
+    int maxUnits;
+    
+    UsageAggregate() : count(0), totalUnits(0), totalPaisa(0), minUnits(0), maxUnits(0) {}
+    void add(int units, int64_t paisa);
+    void merge(const UsageAggregate& other);
+    bool operator==(const UsageAggregate& other) const;
+};
+
+// Per-user and per-meter usage aggregates, kept up to date as records are appended
+// and saved to a sidecar file together with how much of records.txt they cover.
+// On startup only the records appended after that point are read; if the sidecar
+// is missing or does not match, the aggregates are rebuilt from the full ledger.
+class UsageStats {
+public:
+    UsageStats(string recordsFile, string statsFile);
+    const UsageAggregate* forUser(const string& username);
+    const UsageAggregate* forMeter(const string& username, const string& meterSerial);
+    void update(const BillingRecord& record, size_t lineBytes);
+    void refresh();
+    bool persist();
+    int verify();
+
+private:
+    void load();
+    bool loadSidecar();
+    void rebuild();
+    void clear();
+    void apply(const BillingRecord& record);
+    
+    string recordsFile;
+    string statsFile;
+    bool loaded;
+    bool dirty;
+    long long coveredBytes;
+    ScanArena arena;
+    ArenaMap<UsageAggregate> users;
+    ArenaMap<UsageAggregate> meters;
+    string meterKey;   // reused by apply() so building a key does not allocate
+};
+
+// Optional restrictions on the billing history; an empty serial or a period of -1 means any
+struct HistoryFilter {
+    string meterSerial;
+    int fromPeriod;
+    int toPeriod;
+};
+
+// A record from the history together with its position in the user's full history
+struct HistoryRow {
+    size_t number;
+    BillingRecord record;
+};
+
+// Assigns small integer ids to repeated strings such as usernames and meter serials.
+// Each distinct string is stored once, however many records refer to it; the
+// index keys are views of the stored names, which a deque never moves.
+class SymbolTable {
+public:
+    SymbolTable(pmr::memory_resource* memory = pmr::get_default_resource());
+    uint32_t intern(string_view text);
+    bool find(string_view text, uint32_t& id) const;
+    string_view name(uint32_t id) const;
+    size_t size() const;
+
+private:
+    pmr::unordered_map<string_view, uint32_t> ids;
+    pmr::deque<pmr::string> names;
+};
+
+// Hands out the lines of a file as views into a large read buffer, so a scan
+// does one read per block instead of an allocation per line. A line stays
+// valid until the next call to next().
+class LineScanner {
+public:
+    LineScanner(const string& fileName, uint64_t offset, size_t blockSize = 1 << 20);
+    ~LineScanner();
+    bool isOpen() const { return fd >= 0; }
+    bool next(string_view& line);
+    bool terminated() const { return lastTerminated; }   // the last line ended in '\n'
+    uint64_t offset() const { return position; }         // file offset after the last line
+
+private:
+    LineScanner(const LineScanner&);
+    LineScanner& operator=(const LineScanner&);
+    
+    int fd;
+    vector<char> buffer;
+    size_t begin;
+    size_t end;
+    uint64_t position;
+    bool lastTerminated;
+    bool atEnd;
+};
+
+// records.bin layout: header, CompactRecord rows, then the symbol table
+// (uint32 length + bytes per symbol). sourceBytes is how much of records.txt
+// the rows cover, so records appended later are still read from the text tail.
+struct BinaryLedgerHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t rowCount;
+    uint64_t symbolCount;
+    uint64_t symbolOffset;
+    uint64_t sourceBytes;
+};
+
+// A billing record in 24 bytes, used for the rows of records.bin. Username and
+// serial are SymbolTable ids, the period is year * 12 + month and the amount is
+// integer paisa; units are not stored since they are always current - previous.
+struct CompactRecord {
+    uint32_t userId;
+    uint32_t serialId;
+    int32_t previousReading;
+    int32_t currentReading;
+    int64_t amountPaisa : 40;
+    int64_t period : 24;
+    
+    int unitsConsumed() const { return currentReading - previousReading; }
+};
+
+static_assert(sizeof(CompactRecord) == 24, "compact records must stay 24 bytes");
+
+// Zero-copy reader over a mapped records.bin; rows and symbols point into the mapping
+class BinaryLedger {
+public:
+    bool open(const string& fileName);
+    const CompactRecord* begin() const { return rows; }
+    const CompactRecord* end() const { return rows + count; }
+    size_t rowCount() const { return count; }
+    uint64_t sourceBytes() const { return coveredBytes; }
+    string_view symbol(uint32_t id) const { return symbols[id]; }
+    bool findSymbol(const string& text, uint32_t& id) const;
+    void toRecord(const CompactRecord& row, BillingRecord& record) const;
+
+private:
+    MappedFile file;
+    const CompactRecord* rows;
+    size_t count;
+    uint64_t coveredBytes;
+    vector<string_view> symbols;
+    unordered_map<string_view, uint32_t> symbolIds;
+};
+
+// Columns of records.col, in file order
+enum ColumnId {
+    COLUMN_PERIOD = 0,   // uint32 year * 12 + month, ascending
+    COLUMN_AREA = 1,     // uint16 id into the area dictionary
+    COLUMN_METER = 2,    // uint32 id into the meter dictionary
+    COLUMN_UNITS = 3,    // int32
+    COLUMN_AMOUNT = 4,   // int64 paisa
+    COLUMN_COUNT = 5
+};
+
+const size_t COLUMN_WIDTHS[COLUMN_COUNT] = {4, 2, 4, 4, 8};
+
+// records.col layout: header, one 64-byte aligned array per column, then the meter
+// and area dictionaries (uint32 length + bytes per name). Like records.bin it
+// covers a prefix of records.txt, sourceBytes long. Rows are ordered by period,
+// and by ledger position within a period.
+struct ColumnStoreHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t rowCount;
+    uint64_t sourceBytes;
+    uint64_t columnOffset[COLUMN_COUNT];
+    uint64_t meterCount;
+    uint64_t areaCount;
+    uint64_t dictionaryOffset;
+};
+
+// One run of column rows in period order: the mapped rows of records.col, or the
+// rows parsed from the text records.txt gained after it was built
+struct ColumnRows {
+    const uint32_t* periods;
+    const uint16_t* areas;
+    const uint32_t* meters;
+    const int32_t* units;
+    const int64_t* amounts;
+    size_t count;
+    
+    void periodRows(int fromPeriod, int toPeriod, size_t& begin, size_t& end) const;
+};
+
+// Zero-copy reader over a mapped records.col. A report only touches the
+// columns it aggregates, so an area/period rollup reads 18 bytes per record.
+// Records appended to the ledger since the build are held as a second, small
+// run of rows whose new meters and areas extend the dictionaries.
+class ColumnStore {
+public:
+    static const int PART_COUNT = 2;   // the mapped rows, then the tail's
+    
+    bool open(const string& fileName);
+    bool catchUp(const string& textFile, uint64_t maxBytes);
+    size_t rowCount() const { return parts[0].count + parts[1].count; }
+    uint64_t sourceBytes() const { return coveredBytes; }
+    const ColumnRows& part(int p) const { return parts[p]; }
+    void periodsPresent(vector<uint32_t>& periods) const;
+    size_t meterCount() const { return meterNames.size(); }
+    size_t areaCount() const { return areaNames.size(); }
+    string_view meterName(uint32_t id) const { return meterNames[id]; }
+    string_view areaName(uint32_t id) const { return areaNames[id]; }
+
+private:
+    bool validRows() const;
+    
+    MappedFile file;
+    ColumnRows parts[PART_COUNT];
+    uint64_t coveredBytes;
+    vector<string_view> meterNames;
+    vector<string_view> areaNames;
+    deque<string> tailNames;   // meters and areas first seen in the tail
+    vector<uint32_t> tailPeriods;
+    vector<uint16_t> tailAreas;
+    vector<uint32_t> tailMeters;
+    vector<int32_t> tailUnits;
+    vector<int64_t> tailAmounts;
+};
+
+// What a columnar report groups the records by
+enum GroupBy {
+    GROUP_AREA_PERIOD,   // area id * periods present + index of the period
+    GROUP_METER,
+    GROUP_PERIOD         // index of the period among those present
+};
+
+// Sums over one group of a report
+struct GroupTotals {
+    long long records;
+    long long units;
+    int64_t paisa;
+};
+
+// Header of a ledger segment file: header, bloom filter words, rows, then the
+// symbol table (uint32 length + bytes per name). The rows are CompactRecords, or
+// varint-encoded in an archive, and hold the byte range of records.txt given by
+// sourceOffset and sourceBytes, with the first and last billing period in them.
+struct SegmentHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceOffset;
+    uint64_t sourceBytes;
+    uint64_t recordCount;
+    uint64_t symbolCount;
+    uint64_t bloomWords;    // bloom filter of username<tab>serial meter keys
+    uint64_t rowBytes;
+    uint32_t minPeriod;
+    uint32_t maxPeriod;
+    uint8_t archived;
+    uint8_t reserved[7];
+};
+
+// records.txt split into sealed segments under a directory, one billing period
+// per segment. A meter lookup skips every segment whose bloom filter rules the
+// meter out and stops at the newest one that holds it. compact() merges older
+// segments into varint-encoded archives of one calendar year each. records.txt stays
+// the append-only ledger; segments are sealed from it and never change after.
+class LedgerSegments {
+public:
+    LedgerSegments(string textFile, string directory);
+    ~LedgerSegments();
+    bool seal(size_t periodRecords, bool sealOpenPeriod);
+    bool compact(size_t keepRecent);
+    bool latest(const string& username, const string& meterSerial, MeterState& state, size_t* opened);
+    uint64_t sealedBytes();
+    void list();
+    void clear();
+    void startCompaction(int intervalSeconds, size_t periodRecords, size_t keepRecent);
+
+private:
+    struct Segment {
+        string fileName;
+        SegmentHeader header;
+        BloomFilter meters;
+    };
+    
+    void load();
+    bool openSegment(const Segment& segment, MappedFile& file, const char*& rows, vector<string_view>& symbols);
+    bool readRows(const Segment& segment, vector<CompactRecord>& rows, vector<string>& symbols);
+    bool findLatest(const Segment& segment, string_view username, string_view meterSerial, MeterState& state);
+    bool writeSegment(const vector<CompactRecord>& rows, const SymbolTable& symbols,
+                      uint64_t sourceOffset, uint64_t sourceBytes, bool archive);
+    
+    string textFile;
+    string directory;
+    bool loaded;
+    vector<Segment> segments;   // in ledger order
+    mutex lock;
+    mutex sealing;              // held across seal() and compact(), which write files
+    thread compactor;
+    condition_variable wake;
+    bool stopping;
+};
+
+const string MONTH_NAMES[12] = {"January", "February", "March", "April", "May", "June",
+                                "July", "August", "September", "October", "November", "December"};
+
+// January 2025, where the synthetic ledgers of the benchmarks and the generator start
+const int SAMPLE_FIRST_PERIOD = 2025 * 12;
+
+// One slab of a tariff: units above the previous slab's limit, up to upTo, cost rate each
+struct TariffSlab {
+    int upTo;
+    double rate;
+};
+
+// Built-in slabs: Rs. 5 up to 100 units, Rs. 8 up to 300, Rs. 10 above that
+constexpr TariffSlab DEFAULT_SLABS[] = {{100, 5.0}, {300, 8.0}, {INT_MAX, 10.0}};
+
+// Compile-time version of a tariff without fixed charges or tax. The slab table and
+// the charge accumulated at each slab start are built by the compiler, so the
+// built-in tariff costs a couple of compares and one multiply-add per bill.
+template <size_t N>
+struct StaticTariff {
+    int start[N];
+    int upTo[N];
+    double rate[N];
+    double cumulative[N];
+    
+    constexpr StaticTariff(const TariffSlab (&slabs)[N]) : start(), upTo(), rate(), cumulative() {
+        for (size_t i = 0; i < N; i++) {
+            start[i] = (i == 0) ? 0 : slabs[i - 1].upTo;
+            upTo[i] = slabs[i].upTo;
+            rate[i] = slabs[i].rate;
+            cumulative[i] = (i == 0) ? 0.0 : cumulative[i - 1] + (start[i] - start[i - 1]) * rate[i - 1];
+        }
+    }
+    
+    constexpr double bill(int units) const {
+        size_t slab = 0;
+        while (slab + 1 < N && units > upTo[slab]) {
+            slab++;
+        }
+        return cumulative[slab] + (units - start[slab]) * rate[slab];
+    }
+};
+
+constexpr StaticTariff<3> DEFAULT_TARIFF(DEFAULT_SLABS);
+static_assert(DEFAULT_TARIFF.bill(100) == 500.0 && DEFAULT_TARIFF.bill(300) == 2100.0 &&
+              DEFAULT_TARIFF.bill(350) == 2600.0, "built-in tariff changed");
+
+const size_t SLAB_COUNT = sizeof(DEFAULT_SLABS) / sizeof(DEFAULT_SLABS[0]);
+
+// Ledger-wide totals with a histogram over the built-in tariff's slabs: how many
+// bills fall in each slab and how many units were charged at each slab's rate
+struct FleetAggregate {
+    UsageAggregate totals;
+    long long slabBills[SLAB_COUNT];
+    long long slabUnits[SLAB_COUNT];
+    long long rejected;   // lines that are not billing records
+    
+    FleetAggregate();
+    void add(int units, int64_t paisa);
+    void merge(const FleetAggregate& other);
+    bool operator==(const FleetAggregate& other) const;
+};
+
+// Runtime tariff: any number of slabs plus a fixed charge and a tax percentage.
+// Slab starts and the charge accumulated below each start are precomputed, so a
+// bill is a binary search over the slab limits and one multiply-add.
+class Tariff {
+public:
+    Tariff();
+    Tariff(const vector<TariffSlab>& slabs, double fixedCharge, double taxPercent);
+    double energyCharge(int units) const;
+    double bill(int units) const;
+    void printBreakdown(ostream& out, int units) const;
+    bool isDefault() const { return builtIn; }
+
+private:
+    vector<int> limits;
+    vector<int> starts;
+    vector<double> rates;
+    vector<double> cumulative;
+    double fixedCharge;
+    double taxPercent;
+    bool builtIn;
+};
+
+// Tariffs per residential area, read from tariffs.txt when it exists. Each line is
+//   area|fixed charge|tax percent|upTo:rate upTo:rate ... -:rate
+// with "*" as the area of the fallback tariff. Without the file every area uses
+// the built-in tariff.
+class TariffBook {
+public:
+    TariffBook(string fileName);
+    const Tariff& forArea(string_view residentialArea);
+
+private:
+    void load();
+    
+    string fileName;
+    bool loaded;
+    Tariff fallback;
+    unordered_map<string, Tariff, TextHash, TextEqual> areas;
+};
+
+// One billed meter of a bill run; the strings point into the run's own storage
+struct BillRunItem {
+    const Tariff* tariff;
+    string_view username;
+    const string* meterSerial;
+    int period;
+    int previousReading;
+    int currentReading;
+    int unitsConsumed;
+    double totalBill;
+};
+
+// One parsed line of a readings file
+struct BillRunRow {
+    string meterSerial;
+    int currentReading;
+    bool valid;
+};
+
+// Time spent in each stage of a bill run. parse, process and merge are wall-clock
+// times of the parallel stages; resolve, calculate and format add up the time
+// every worker spent in that pass.
+struct BillRunTimings {
+    double loadMs;
+    double readMs;
+    double parseMs;
+    double processMs;
+    double resolveMs;
+    double calculateMs;
+    double formatMs;
+    double mergeMs;
+    double writeMs;
+};
+
+struct BillRunOptions {
+    string readingsFile;
+    string firstPeriod;
+    int threads;
+    bool appendToLedger;
+    bool verbose;
+};
+
+struct BillRunReport {
+    size_t billed;
+    size_t rejected;
+    size_t bytes;
+    uint64_t outputHash;
+    double totalMs;
+    BillRunTimings timings;
+};
+
+// Fixed set of worker threads. run() hands the same job to every worker, with the
+// calling thread acting as worker 0, and returns once all of them have finished.
+class WorkerPool {
+public:
+    WorkerPool(int threads);
+    ~WorkerPool();
+    int size() const { return workers; }
+    void run(const function<void(int worker)>& job);
+
+private:
+    void work(int worker);
+    
+    int workers;
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+    const function<void(int)>* job;
+    unsigned long generation;
+    int pending;
+    bool stopping;
+};
+
+// Where each of a user's records starts in records.txt, with the serial and period
+// kept alongside so filters never have to read the file
+struct HistoryEntry {
+    uint64_t offset;
+    uint32_t serialId;
+    int32_t period;
+};
+
+// Per-user offset lists into records.txt. A page of history is found in memory
+// and only the rows on that page are read, by seeking straight to them.
+// refresh() picks up appended records; page() only reads, so pages can be
+// served concurrently between refreshes.
+class HistoryIndex {
+public:
+    HistoryIndex(string fileName);
+    vector<HistoryRow> page(const string& username, const HistoryFilter& filter,
+                            size_t pageNumber, size_t perPage, size_t& total) const;
+    void refresh();
+
+private:
+    bool matches(const HistoryEntry& entry, const HistoryFilter& filter, uint32_t serialId) const;
+    
+    // Everything allocated from the arena; destroyed before the arena is released
+    struct Tables {
+        Tables(pmr::memory_resource* memory) : serials(memory), users(memory) {}
+        SymbolTable serials;
+        ArenaMap<pmr::vector<HistoryEntry> > users;
+    };
+    
+    string fileName;
+    long long coveredBytes;
+    ScanArena arena;
+    unique_ptr<Tables> tables;
+};
+
+// Append-only data files covered by the write-ahead log
+enum WalTarget {
+    WAL_USERS = 0,
+    WAL_RECORDS = 1,
+    WAL_TARGETS = 2
+};
+
+// wal.log entry header; the checksum (CRC-32C) covers target, offset and payload
+struct WalEntryHeader {
+    uint32_t length;
+    uint32_t checksum;
+    uint8_t target;
+    uint8_t reserved[7];
+    uint64_t offset;
+};
+
+static_assert(sizeof(WalEntryHeader) == 24, "wal.log entry headers must stay 24 bytes");
+
+struct WalRecoveryReport {
+    uint64_t entries;
+    uint64_t bytesScanned;
+    uint64_t replayedEntries;
+    uint64_t replayedBytes;
+    uint64_t tornBytes;
+    double milliseconds;
+};
+
+// Write-ahead log for users.txt and records.txt. Each append is first written to
+// wal.log as one checksummed, length-prefixed entry holding the target file and
+// the offset the data belongs at, and only then written to the target, so a
+// multi-line user block or a batch of records is never half applied. recover()
+// runs at startup: it replays entries whose data is missing or torn in the target,
+// cuts a torn last entry off the log and then empties it. The log is also emptied
+// (checkpointed) once it grows past checkpointBytes.
+//
+// Several processes may append to the same files (a server and the console, say),
+// so each append holds an exclusive flock on wal.log and takes the target's offset
+// from fstat under it. Recovery takes the same lock, so it never runs while another
+// process is part-way through an append.
+class WriteAheadLog {
+public:
+    WriteAheadLog(string logFile, string usersFile, string recordsFile);
+    ~WriteAheadLog();
+    bool append(WalTarget target, const char* data, size_t length, bool sync);
+    bool recover(WalRecoveryReport& report);
+    bool rewrite(WalTarget target, const function<bool(string_view, string&)>& edit);
+    void close();
+
+private:
+    bool open();
+    bool reopenIfReplaced(WalTarget target);
+    bool rewriteLocked(WalTarget target, const function<bool(string_view, string&)>& edit);
+    bool appendLocked(WalTarget target, const char* data, size_t length, bool sync);
+    bool recoverLocked(int logLockFd, WalRecoveryReport& report);
+    bool checkpoint();
+    
+    string logFile;
+    string targetFiles[WAL_TARGETS];
+    int logFd;
+    int targetFds[WAL_TARGETS];
+    uint64_t checkpointBytes;
+    mutex lock;
+};
+
+// How hard the ledger writer works to get records onto disk
+enum Durability {
+    DURABILITY_NONE,        // write() only; the OS decides when data reaches the disk
+    DURABILITY_PER_BATCH,   // fsync after each buffered batch is written
+    DURABILITY_PER_RECORD   // write and fsync every record before append returns
+};
+
+// Long-lived appender for records.txt. Records are collected in a buffer that is
+// committed through the write-ahead log when it reaches flushBytes or, from a
+// background thread, once the oldest buffered record is flushMillis old, so many
+// records share one log entry and one fsync. A record is only on disk once a
+// flush has returned, so anything that confirms a record flushes first; callers
+// that flush while a batch is being written wait for it and share the next one.
+class LedgerWriter {
+public:
+    LedgerWriter(WriteAheadLog& wal, WalTarget target, size_t flushBytes, int flushMillis, Durability durability);
+    ~LedgerWriter();
+    bool append(const string& data);
+    bool flush();
+    void close();
+    void setDurability(Durability level);
+    Durability durability() const { return level; }
+
+private:
+    void start();
+    bool writeBuffer(unique_lock<mutex>& guard);
+    void flushLoop();
+    
+    WriteAheadLog& wal;
+    WalTarget target;
+    size_t flushBytes;
+    int flushMillis;
+    Durability level;
+    bool started;
+    string buffer;
+    string batch;           // the records being written, while writing is set
+    bool writing;
+    chrono::steady_clock::time_point oldest;
+    mutex lock;
+    condition_variable wake;
+    condition_variable written;
+    thread flusher;
+    bool stopping;
+    bool failed;
+};
+
+// Incremental SHA-256
+class Sha256 {
+public:
+    Sha256();
+    void update(const unsigned char* data, size_t length);
+    void finish(unsigned char digest[32]);
+    void copyState(uint32_t out[8]) const { memcpy(out, state, sizeof(state)); }
+
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t used;
+    uint64_t total;
+};
+
+// Work for the password pool: hash a new password, or check one against its stored form
+struct PasswordJob {
+    string password;
+    string stored;
+    bool verify;
+};
+
+// ok is the outcome of a check. stored is the new stored form: always set for a
+// hash, and set for a check when the password was right but its stored form is
+// out of date (legacy shift or another cost). busy means the queue was full.
+struct PasswordResult {
+    bool ok;
+    bool busy;
+    string stored;
+};
+
+// Bounded pool for the slow password work, so whoever asks (the console, a
+// connection thread or an event loop) is never the one spending the CPU.
+// Workers start on the first job.
+class PasswordHasher {
+public:
+    PasswordHasher(size_t threads, size_t queueLimit);
+    ~PasswordHasher();
+    bool submit(const PasswordJob& job, const function<void(const PasswordResult&)>& done);
+    PasswordResult run(const PasswordJob& job);
+
+private:
+    void work();
+    
+    size_t threads;
+    size_t queueLimit;
+    deque<pair<PasswordJob, function<void(const PasswordResult&)> > > queue;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+};
+
+// Threads for blocking work handed off by the event loops, such as requests that
+// wait on locks, read files or flush the ledger. Started on first use.
+class TaskPool {
+public:
+    TaskPool(size_t threads);
+    ~TaskPool();
+    void submit(const function<void()>& task);
+
+private:
+    void work();
+    
+    size_t threads;
+    deque<function<void()> > queue;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+};
+
+// Recently issued login tokens, so a client can resume a session without the
+// password being hashed again. Tokens expire after ttlSeconds and the oldest
+// are dropped beyond maxEntries.
+class SessionCache {
+public:
+    SessionCache(size_t maxEntries, int ttlSeconds);
+    string issue(const string& username);
+    bool check(const string& token, string& username);
+
+private:
+    void evict(chrono::steady_clock::time_point now);
+    
+    struct Entry {
+        string username;
+        chrono::steady_clock::time_point expires;
+    };
+    size_t maxEntries;
+    int ttlSeconds;
+    unordered_map<string, Entry> tokens;
+    deque<string> order;
+    mutex lock;
+};
+
+// A fixed set of mutexes handed out by key hash, so that work on different
+// keys (meters, usernames) almost never waits on the same lock
+class StripedLocks {
+public:
+    StripedLocks(size_t stripes);
+    mutex& forKey(const string& key);
+
+private:
+    vector<mutex> locks;
+};
+
+// One client connection of the server; a login is remembered for the connection
+struct ServerSession {
+    int fd;
+    bool loggedIn;
+    User user;
+};
+
+// Multi-client server mode on a Unix socket, one thread per connection.
+// Requests are single lines of tab-separated fields and every reply starts
+// with OK or ERR. Each request goes through runCommand(), like --commands; the
+// shared indexes are preloaded so the library calls behind it only ever take
+// their locks.
+class BillingServer {
+public:
+    BillingServer(string socketPath);
+    int run();
+    void stop();
+    void preload();
+
+private:
+    void serve(int clientFd);
+    
+    string socketPath;
+    int listenFd;
+    mutex clientsLock;
+    condition_variable clientsDone;
+    unordered_set<int> clients;
+    bool stopping;
+};
+
+// Coroutine type for connection handlers: runs as soon as it is called and frees
+// its frame when it returns, so nobody has to own it
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return DetachedTask(); }
+        suspend_never initial_suspend() noexcept { return suspend_never(); }
+        suspend_never final_suspend() noexcept { return suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// A client of an event loop and the coroutine waiting for its next line
+struct AsyncConnection {
+    int fd;
+    string input;
+    string output;
+    bool closed;
+    bool finished;
+    bool writing;
+    coroutine_handle<> reader;
+    ServerSession session;
+};
+
+// One epoll loop of the async server. Every connection is a coroutine that
+// suspends while waiting for a request line or for the request pool to run its
+// request through runCommand(); the loop thread itself never waits on
+// a lock, a file or an fsync. Ledger flushes from the pool share writes through
+// the ledger writer. Several loops can share the listening socket, each on its
+// own thread.
+class EventLoop {
+public:
+    EventLoop(int listenFd);
+    ~EventLoop();
+    void run();
+    void stop();
+    
+    struct LineAwaiter {
+        AsyncConnection& connection;
+        string& line;
+        bool await_ready() const { return connection.closed || connection.input.find('\n') != string::npos; }
+        void await_suspend(coroutine_handle<> handle) { connection.reader = handle; }
+        bool await_resume();
+    };
+    struct PoolAwaiter {
+        EventLoop& loop;
+        function<void()> work;
+        bool await_ready() const { return false; }
+        void await_suspend(coroutine_handle<> handle);
+        void await_resume() const {}
+    };
+    void post(coroutine_handle<> handle);
+
+private:
+    DetachedTask handleConnection(AsyncConnection* connection);
+    void acceptClients();
+    void receive(AsyncConnection* connection);
+    void send(AsyncConnection* connection);
+    void closeConnection(AsyncConnection* connection);
+    void watchListener();
+    void resumePosted();
+    
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    atomic<bool> stopping;
+    bool acceptPaused;
+    chrono::steady_clock::time_point acceptResumes;
+    unordered_map<int, unique_ptr<AsyncConnection> > connections;
+    mutex postedLock;
+    vector<coroutine_handle<> > posted;
+    size_t pendingJobs;
+};
+
+// Latency and throughput measured by one load test
+struct LoadTestReport {
+    size_t requests;
+    long long errors;
+    double seconds;
+    double p50Ms;
+    double p99Ms;
+    double maxMs;
+};
+
+// Scale of a generated data set; one spec always produces the same files
+struct DatasetSpec {
+    size_t users;
+    int metersPerUser;      // 1 or 2, the most a user can have
+    int months;             // months of history per meter
+    uint64_t seed;
+};
+
+// Timings of one operation in the benchmark suite. Fast operations are timed in
+// batches, so their percentiles are over batch means.
+struct SuiteResult {
+    string name;
+    size_t operations;
+    double totalMs;
+    double meanUs;
+    double p50Us;
+    double p99Us;
+};
+
+// Results of the library calls (registerAccount and the rest). The calls print
+// nothing and never wait for input, so the console menus, --commands scripts and
+// other programs share them; error says what went wrong when ok is false.
+struct RegisterResult {
+    bool ok;
+    string error;
+};
+
+struct LoginResult {
+    bool ok;
+    string error;
+    User user;              // without the password
+};
+
+struct SubmitResult {
+    bool ok;
+    string error;
+    BillingRecord record;   // the saved bill
+};
+
+struct HistoryResult {
+    bool ok;
+    string error;
+    size_t total;           // matching records over all pages
+    vector<HistoryRow> rows;
+};
+
+struct StatsResult {
+    bool ok;
+    string error;
+    UsageAggregate total;
+    vector<pair<string, UsageAggregate> > meters;   // per meter serial, in registration order
+};
+
+// Instrumentation, compiled in with -DPF_METRICS. PF_TIMED(id) times the rest of
+// the enclosing scope, PF_TIMED_SAMPLED(id, n) counts every call but times one in
+// n (a power of two) for operations too cheap to time each call, and PF_COUNT
+// adds to a counter. Without PF_METRICS all of them expand to nothing.
+#ifdef PF_METRICS
+enum MetricId {
+    METRIC_VALIDATE_LOGIN,
+    METRIC_METER_LOOKUP,
+    METRIC_SAVE_RECORD,
+    METRIC_SAVE_USER,
+    METRIC_CALCULATE_BILL,
+    METRIC_LOAD_USERS,
+    METRIC_LOAD_LEDGER_INDEX,
+    METRIC_SCAN_RECORDS,
+    METRIC_REFRESH_STATS,
+    METRIC_PERSIST_STATS,
+    METRIC_REFRESH_HISTORY,
+    METRIC_HISTORY_PAGE,
+    METRIC_SEGMENT_LOOKUP,
+    METRIC_WAL_APPEND,
+    METRIC_WAL_CHECKPOINT,
+    METRIC_LEDGER_FLUSH,
+    METRIC_PASSWORD_JOB,
+    METRIC_SERVER_REQUEST,
+    METRIC_COUNT
+};
+
+enum CounterId {
+    COUNTER_WAL_BYTES,
+    COUNTER_LEDGER_BYTES_SCANNED,
+    COUNTER_RECORDS_SAVED,
+    COUNTER_PASSWORD_QUEUE_FULL,
+    COUNTER_COUNT
+};
+
+// Names in the exported snapshots, in the order of the enums
+const char* const METRIC_NAMES[METRIC_COUNT] = {
+    "validate_login", "meter_lookup", "save_billing_record", "save_user", "calculate_bill",
+    "load_users", "load_ledger_index", "scan_billing_records", "refresh_usage_stats",
+    "persist_usage_stats", "refresh_history", "history_page", "segment_lookup", "wal_append",
+    "wal_checkpoint", "ledger_flush", "password_job", "server_request"
+};
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "wal_bytes", "ledger_bytes_scanned", "records_saved", "password_queue_full"
+};
+
+// Bucket b holds latencies below 2^b nanoseconds
+const int METRIC_BUCKETS = 40;
+
+// One thread's numbers. Only the owning thread writes them, with a relaxed load
+// and store rather than a locked add, so recording costs a few plain
+// instructions; the atomics only keep a snapshot from seeing a torn value.
+struct ThreadMetrics {
+    ThreadMetrics();
+    ~ThreadMetrics();
+    atomic<uint64_t> calls[METRIC_COUNT];
+    atomic<uint64_t> timed[METRIC_COUNT];
+    atomic<uint64_t> nanos[METRIC_COUNT];
+    atomic<uint64_t> buckets[METRIC_COUNT][METRIC_BUCKETS];
+    atomic<uint64_t> counters[COUNTER_COUNT];
+};
+
+// Totals over every thread, live or finished
+struct MetricsSnapshot {
+    void add(const ThreadMetrics& metrics);
+    
+    uint64_t calls[METRIC_COUNT];
+    uint64_t timed[METRIC_COUNT];
+    uint64_t nanos[METRIC_COUNT];
+    uint64_t buckets[METRIC_COUNT][METRIC_BUCKETS];
+    uint64_t counters[COUNTER_COUNT];
+};
+
+// The live threads' metrics, and what finished threads left behind
+class MetricsRegistry {
+public:
+    MetricsRegistry();
+    void attach(ThreadMetrics* metrics);
+    void detach(ThreadMetrics* metrics);
+    void snapshot(MetricsSnapshot& out);
+
+private:
+    mutex lock;
+    vector<ThreadMetrics*> threads;
+    MetricsSnapshot retired;
+};
+
+class ScopedTimer {
+public:
+    ScopedTimer(MetricId id, uint64_t sampleMask);
+    ~ScopedTimer();
+
+private:
+    MetricId id;
+    bool timing;
+    chrono::steady_clock::time_point start;
+};
+
+// Writes snapshots to PF_METRICS_FILE every PF_METRICS_INTERVAL seconds and at
+// stop(), and answers each connection to the Unix socket PF_METRICS_SOCKET with
+// one snapshot. PF_METRICS_FORMAT=json selects JSON instead of Prometheus text.
+class MetricsExporter {
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+    void start();
+    void stop();
+
+private:
+    void run();
+    bool writeFile();
+    
+    string fileName;
+    string socketPath;
+    bool json;
+    int intervalSeconds;
+    int listenFd;
+    thread worker;
+    atomic<bool> stopping;
+};
+
+#define PF_METRIC_JOIN2(a, b) a##b
+#define PF_METRIC_JOIN(a, b) PF_METRIC_JOIN2(a, b)
+#define PF_TIMED(id) ScopedTimer PF_METRIC_JOIN(scopedTimer, __LINE__)(id, 0)
+#define PF_TIMED_SAMPLED(id, every) ScopedTimer PF_METRIC_JOIN(scopedTimer, __LINE__)(id, (every) - 1)
+#define PF_COUNT(id, n) countMetric(id, n)
+#define PF_METRICS_START() metricsExporter.start()
+#define PF_METRICS_STOP() metricsExporter.stop()
+#else
+#define PF_TIMED(id)
+#define PF_TIMED_SAMPLED(id, every)
+#define PF_COUNT(id, n)
+#define PF_METRICS_START()
+#define PF_METRICS_STOP()
+#endif
+
 // Function prototypes
 void clearScreen();
 void registerUser();
 void loginUser();
-bool checkUserExists(string username);
-bool validateLogin(string username, string password);
-void mainMenu(string username);
-void enterMeterReading(string username);
+bool checkUserExists(const string& username);
+string takenSerial(const User& user);
+bool validateLogin(const string& username, const string& password);
+void mainMenu(const string& username);
+void enterMeterReading(const string& username);
 double calculateBill(int units);
-void saveBillingRecord(BillingRecord record);
-void displayBillingHistory(string username);
-void displayStatistics(string username);
-string encryptPassword(string password);
-string decryptPassword(string encrypted);
-int getLastMeterReading(string username, string meterSerial);
-string getLastBillingMonth(string username, string meterSerial);
-int getValidInteger(string prompt);
-bool isPasswordValid(string password);
-string getNextMonth(string currentMonth);
-User getUserDetails(string username);
-
-int main() {
+double calculateBill(int units, const string& residentialArea);
+void calculateBills(const int* units, double* out, size_t n);
+void calculateBillsScalar(const int* units, double* out, size_t n);
+const char* billKernelName();
+void benchmarkBillKernel(size_t n);
+bool parseTariffLine(const string& line, string& area, Tariff& tariff);
+bool saveBillingRecord(const BillingRecord& record);
+bool saveBillingRecord(const BillingRecord& record, LedgerWriter& writer, LedgerIndex& index, UsageStats& stats,
+                       shared_mutex& lock);
+const MeterState* lookupMeter(LedgerIndex& index, const string& username, const string& meterSerial);
+void displayBillingHistory(const string& username);
+void displayStatistics(const string& username);
+string encryptPassword(const string& password);
+string decryptPassword(const string& encrypted);
+unsigned passwordIterations();
+string hashPassword(const string& password, unsigned iterations);
+bool verifyPassword(const string& stored, const string& password, bool& outdated);
+void pbkdf2Sha256(const string& password, const unsigned char* salt, size_t saltLength,
+                  unsigned iterations, unsigned char* out, size_t outLength);
+string toHex(const unsigned char* data, size_t length);
+bool saveUser(const User& user);
+bool compactUsers();
+void benchmarkLogins();
+size_t heapBytesInUse();
+void reportRecordMemory(size_t count);
+void benchmarkScans(size_t records);
+bool threadAllocationCounts(uint64_t& allocations, uint64_t& bytes);
+void writeSyntheticLedger(const string& fileName, size_t records);
+bool aggregateFleetSequential(const string& textFile, FleetAggregate& result);
+size_t nextLineStart(const char* data, size_t size, size_t pos);
+void putVarint(string& out, uint64_t value);
+bool getVarint(const char*& cursor, const char* limit, uint64_t& value);
+bool decodeArchiveRow(const char*& cursor, const char* limit, CompactRecord& row);
+void benchmarkSegments(size_t meters, int years);
+int importUsers(const string& csvFile, UserStore& store, WriteAheadLog& log);
+void benchmarkImport(size_t existingUsers, size_t rows);
+double runMetricsWorkload(const string& directory, size_t records);
+uint64_t splitMix64(uint64_t& state);
+bool generateDataset(const string& directory, const DatasetSpec& spec);
+int runBenchmarkSuite(const DatasetSpec& spec, const string& resultsFile);
+bool readSuiteResults(const string& fileName, vector<SuiteResult>& results);
+int compareSuiteResults(const string& baseFile, const string& currentFile, double thresholdPercent);
+void benchmarkMetrics(size_t records);
+RegisterResult registerAccount(const User& details);
+string registrationConflict(const User& user);
+LoginResult loginAccount(const string& username, const string& password);
+SubmitResult submitReading(const string& username, const string& meterSerial, int currentReading,
+                           int previousReading, int firstPeriod);
+HistoryResult billingHistory(const string& username, const HistoryFilter& filter, size_t page, size_t perPage);
+StatsResult usageStatistics(const string& username);
+bool runCommand(ServerSession& session, const vector<string>& fields, string& reply);
+int runCommands(int inputFd, int outputFd);
+#ifdef PF_METRICS
+ThreadMetrics& threadMetrics();
+MetricsRegistry& metricsRegistry();
+void countMetric(CounterId id, uint64_t amount);
+void formatMetrics(string& out, bool json);
+double metricPercentileUs(const uint64_t* buckets, uint64_t count, double fraction);
+#endif
+bool aggregateFleet(const string& textFile, WorkerPool& pool, FleetAggregate& result);
+void printFleetAggregate(const FleetAggregate& fleet);
+void benchmarkFleetAggregate(size_t records, int maxThreads);
+int getLastMeterReading(const string& username, const string& meterSerial);
+string getLastBillingPeriod(const string& username, const string& meterSerial);
+int getValidInteger(const string& prompt);
+bool isPasswordValid(const string& password);
+string passwordProblem(const string& password);
+int makePeriod(int year, int month);
+int currentPeriod();
+int nextPeriod(int period);
+bool plausibleFirstYear(int year);
+int parsePeriod(string_view text);
+int periodArgument(string_view text);
+char* formatPeriod(char* out, int period);
+string periodText(int period);
+string periodName(int period);
+bool migrateRecordPeriods(int anchorYear);
+bool recordsNeedPeriods(const string& textFile);
+User getUserDetails(const string& username);
+void writeUserBlock(ostream& out, const User& user);
+bool readUserBlock(istream& in, User& user);
+int runCommandLine(int argc, char* argv[]);
+User makeSyntheticUser(int id);
+void benchmarkUserStore();
+bool readBillingRecord(istream& in, BillingRecord& record);
+bool parseBillingRecord(string_view line, BillingRecord& record);
+size_t splitRecordFields(string_view line, string_view* fields, size_t maxFields);
+bool parseNumber(string_view text, int& value);
+bool parseNumber(string_view text, double& value);
+int64_t amountToPaisa(double amount);
+bool forEachBillingRecord(const string& textFile, const string& username,
+                          const function<void(const BillingRecord&)>& visit);
+string binaryLedgerName(const string& textFile);
+int monthIndex(string_view month);
+bool parseAmountPaisa(string_view text, int64_t& paisa);
+bool convertRecordsToBinary(const string& textFile, const string& binaryFile);
+int verifyBinaryLedger(const string& textFile, const string& binaryFile);
+string columnStoreName(const string& textFile);
+bool parseColumnRow(string_view line, string_view* fields, int& period, int& used, int64_t& paisa);
+bool buildColumnStore(const string& textFile, const string& columnFile);
+bool writeColumnStore(const string& columnFile, uint64_t rows, uint64_t sourceBytes,
+                      const SymbolTable& meters, const SymbolTable& areas,
+                      const function<bool(ColumnId, ostream&)>& writeColumn);
+bool openColumnStore(const string& textFile, ColumnStore& store);
+void groupColumns(const ColumnStore& store, GroupBy by, vector<GroupTotals>& groups, vector<uint32_t>& periods);
+int runColumnReport(const string& kind, size_t limit);
+int listPeriodBills(int fromPeriod, int toPeriod);
+int listMeterPeriods(const string& meterSerial, int periods);
+void benchmarkColumnStore(size_t millions);
+long long fileSize(const string& fileName);
+uint64_t prefixFingerprint(const string& fileName, uint64_t coveredBytes);
+string formatPaisa(int64_t paisa);
+int runBillRun(const BillRunOptions& options, BillRunReport& report);
+bool parseReadingLine(const char* line, size_t length, string& meterSerial, int& currentReading);
+void formatBillingRecord(string& out, const BillRunItem& item);
+void formatBillingRecord(string& out, const BillingRecord& record);
+const char* durabilityName(Durability level);
+void benchmarkLedgerWriter(size_t records);
+uint32_t crc32c(uint32_t crc, const char* data, size_t length);
+uint32_t walChecksum(const WalEntryHeader& header, const char* payload);
+bool writeFully(int fd, const char* data, size_t length, long long offset);
+bool lockFile(int fd, int operation);
+void printRecoveryReport(const WalRecoveryReport& report);
+void benchmarkWalRecovery(size_t megabytes);
+vector<string> splitFields(const string& line, char separator);
+int listenOnUnixSocket(const string& socketPath);
+void raiseFileLimit();
+int runAsyncServer(const string& socketPath, int loops);
+bool runLoadTest(const string& socketPath, int sessions, int requestsPerSession, LoadTestReport& report);
+void printLoadTestReport(const LoadTestReport& report, int sessions);
+void benchmarkServers(int sessions, int requestsPerSession, int loops);
+void printBillRunReport(const BillRunReport& report, int threads);
+uint64_t hashBytes(const char* data, size_t length, uint64_t hash);
+void benchmarkBillRun(int meters, int maxThreads);
+
+UserStore userStore("users.txt");
+LedgerSegments ledgerSegments("records.txt", "segments");
+LedgerIndex ledgerIndex("records.txt", &ledgerSegments);
+TariffBook tariffBook("tariffs.txt");
+UsageStats usageStats("records.txt", "stats.idx");
+HistoryIndex historyIndex("records.txt");
+WriteAheadLog wal("wal.log", "users.txt", "records.txt");
+LedgerWriter ledgerWriter(wal, WAL_RECORDS, 1 << 20, 100, DURABILITY_PER_BATCH);
+PasswordHasher passwordHasher(max(1u, thread::hardware_concurrency()), 1024);
+TaskPool requestPool(max(8u, 4 * thread::hardware_concurrency()));
+SessionCache sessionCache(10000, 900);
+
+// Locks of the library calls, which the servers run from many threads: reader/
+// writer locks over the user store, the ledger index with the usage statistics,
+// and the history index, and stripes that keep two registrations of one name or
+// serial, or two readings of one meter, apart
+shared_mutex usersLock;
+shared_mutex indexLock;
+shared_mutex historyLock;
+StripedLocks userLocks(256);
+StripedLocks meterLocks(1024);
+
+#ifdef PF_BENCH_ALLOC
+// Heap allocations made by the current thread, counted by operator new below
+thread_local uint64_t threadAllocations = 0;
+thread_local uint64_t threadAllocatedBytes = 0;
+#endif
+
+#ifdef PF_METRICS
+// PF_METRICS=0 in the environment switches recording off at run time
+atomic<bool> metricsEnabled(true);
+MetricsExporter metricsExporter;
+#endif
+
+int main(int argc, char* argv[]) {
     int choice;
     
-    while (true) {
+    // Finish or discard appends interrupted by a crash before anything reads the files
+    WalRecoveryReport recovery;
+    if (!wal.recover(recovery)) {
+        cout << "Error: unable to recover wal.log\n";
+        return 1;
+    }
+    if (recovery.replayedEntries > 0 || recovery.tornBytes > 0) {
+        printRecoveryReport(recovery);
+    }
+    
+    // A ledger from before billing periods had years is migrated once, ending in
+    // the current month unless --migrate-periods gives the year. Only the modes that
+    // append dated bills do it; the rest leave records.txt as it is
+    string mode = (argc > 1) ? argv[1] : "";
+    if (mode != "--migrate-periods" && recordsNeedPeriods("records.txt")) {
+        bool appends = (mode == "" || mode == "--serve" || mode == "--serve-async" ||
+                        mode == "--commands" || mode == "--bill-run");
+        if (!appends) {
+            cerr << "records.txt has months without a year; --migrate-periods [year] gives them one\n";
+        } else if (!migrateRecordPeriods(0)) {
+            cout << "Error: unable to migrate records.txt to billing periods\n";
+            return 1;
+        }
+    }
+    
+    PF_METRICS_START();
+    if (argc > 1) {
+        int status = runCommandLine(argc, argv);
+        PF_METRICS_STOP();
+        return status;
+    }
+    
+    while (true) {
         clearScreen();
         cout << "\n========================================\n";
         cout << "   ELECTRICITY BILLING SYSTEM\n";
@@ -64,690 +1620,8857 @@ int main() {
         cout << "\nEnter your choice: ";
         choice = getValidInteger("");
         
-        switch (choice) {
-            case 1:
-                registerUser();
-                break;
-            case 2:
-                loginUser();
-                break;
-            case 3:
-                clearScreen();
-                cout << "\nThank you for using the system!\n";
-                return 0;
-            default:
-                cout << "\nInvalid choice! Please enter 1, 2, or 3.\n";
-                cout << "Press Enter to continue...";
-                cin.ignore();
-                cin.get();
+        switch (choice) {
+            case 1:
+                registerUser();
+                break;
+            case 2:
+                loginUser();
+                break;
+            case 3:
+                clearScreen();
+                ledgerWriter.flush();
+                usageStats.persist();
+                PF_METRICS_STOP();
+                cout << "\nThank you for using the system!\n";
+                return 0;
+            default:
+                cout << "\nInvalid choice! Please enter 1, 2, or 3.\n";
+                cout << "Press Enter to continue...";
+                cin.ignore();
+                cin.get();
+        }
+    }
+    
+    return 0;
+}
+
+// ANSI clear and cursor home instead of running clear in a shell; nothing when
+// the output is not a terminal, so piped output stays free of escape codes
+void clearScreen() {
+    if (isatty(STDOUT_FILENO)) {
+        cout << "\033[2J\033[H" << flush;
+    }
+}
+
+// Function to get valid integer input
+int getValidInteger(const string& prompt) {
+    int value;
+    
+    while (true) {
+        if (!prompt.empty()) {
+            cout << prompt;
+        }
+        
+        if (cin >> value) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            return value;
+        } else {
+            cout << "\nInvalid input! Please enter a valid number.\n";
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+    }
+}
+
+// Password validation function
+bool isPasswordValid(const string& password) {
+    string problem = passwordProblem(password);
+    
+    if (!problem.empty()) {
+        cout << "\n" << problem << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Why a password is too weak, or "" when it is acceptable
+string passwordProblem(const string& password) {
+    if (password.length() < 8) {
+        return "Password must be at least 8 characters long!";
+    }
+    
+    bool hasCapital = false;
+    bool hasSpecial = false;
+    
+    for (int i = 0; i < password.length(); i++) {
+        if (password[i] >= 'A' && password[i] <= 'Z') {
+            hasCapital = true;
+        }
+        if (password[i] == '!' || password[i] == '@' || password[i] == '#' || 
+            password[i] == '$' || password[i] == '%' || password[i] == '&' || 
+            password[i] == '*') {
+            hasSpecial = true;
+        }
+    }
+    
+    if (!hasCapital) {
+        return "Password must contain at least one capital letter!";
+    }
+    
+    if (!hasSpecial) {
+        return "Password must contain at least one special character (!@#$%&*)!";
+    }
+    
+    return "";
+}
+
+// Simple encryption - shifts each character by 3.
+// Only kept to read passwords stored before hashing; see hashPassword.
+string encryptPassword(const string& password) {
+    string encrypted = "";
+    for (int i = 0; i < password.length(); i++) {
+        encrypted += char(password[i] + 3);
+    }
+    return encrypted;
+}
+
+// Simple decryption - shifts each character back by 3
+string decryptPassword(const string& encrypted) {
+    string decrypted = "";
+    for (int i = 0; i < encrypted.length(); i++) {
+        decrypted += char(encrypted[i] - 3);
+    }
+    return decrypted;
+}
+
+// Billing periods are year * 12 + month (0-11), so the period after December is
+// January of the next year with no special case, and the periods of a range of
+// months are a range of integers
+int makePeriod(int year, int month) {
+    return year * 12 + month;
+}
+
+// The period containing today
+int currentPeriod() {
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    return makePeriod(local.tm_year + 1900, local.tm_mon);
+}
+
+// Get next period; -1 (unknown) gives the current one
+int nextPeriod(int period) {
+    return (period < 0) ? currentPeriod() : period + 1;
+}
+
+// Check the year of a meter's first bill: at most 20 years back or 1 ahead
+bool plausibleFirstYear(int year) {
+    int thisYear = currentPeriod() / 12;
+    return year >= thisYear - 20 && year <= thisYear + 1;
+}
+
+// Get user details from the user index
+User getUserDetails(const string& username) {
+    User user = User();
+    const User* found = userStore.find(username);
+    
+    if (found != NULL) {
+        user = *found;
+        user.password = "";
+    }
+    
+    return user;
+}
+
+// Get last meter reading for a specific meter
+int getLastMeterReading(const string& username, const string& meterSerial) {
+    const MeterState* state = ledgerIndex.latest(username, meterSerial);
+    return (state == NULL) ? 0 : state->lastReading;
+}
+
+// Get last billing period for a specific meter
+string getLastBillingPeriod(const string& username, const string& meterSerial) {
+    const MeterState* state = ledgerIndex.latest(username, meterSerial);
+    return (state == NULL || state->lastPeriod < 0) ? "" : periodName(state->lastPeriod);
+}
+
+// Read one line of records.txt: username serial period previous current units bill
+bool readBillingRecord(istream& in, BillingRecord& record) {
+    string period;
+    if (!(in >> record.username >> record.meterSerial >> period
+             >> record.previousReading >> record.currentReading
+             >> record.unitsConsumed >> record.totalBill)) {
+        return false;
+    }
+    in.ignore(numeric_limits<streamsize>::max(), '\n');
+    record.period = parsePeriod(period);
+    return true;
+}
+
+void registerUser() {
+    User newUser;
+    
+    clearScreen();
+    cout << "\n========================================\n";
+    cout << "         USER REGISTRATION\n";
+    cout << "========================================\n\n";
+    
+    // Username input
+    cout << "Enter Username: ";
+    cin >> newUser.username;
+    cin.ignore();
+    
+    // Check if username already exists
+    if (checkUserExists(newUser.username)) {
+        cout << "\nUsername already exists! Please choose a different username.\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+        return;
+    }
+    
+    // Full Name input
+    cout << "Enter Full Name: ";
+    getline(cin, newUser.fullName);
+    
+    // Password input with validation
+    while (true) {
+        cout << "\nPassword Requirements:\n";
+        cout << "- At least 8 characters long\n";
+        cout << "- At least one capital letter (A-Z)\n";
+        cout << "- At least one special character (!@#$%&*)\n\n";
+        cout << "Enter Password: ";
+        getline(cin, newUser.password);
+        
+        if (isPasswordValid(newUser.password)) {
+            break;
+        }
+    }
+    
+    // Street Number
+    cout << "\nEnter Street Number: ";
+    getline(cin, newUser.streetNumber);
+    
+    // Residential Area
+    cout << "Enter Residential Area Name: ";
+    getline(cin, newUser.residentialArea);
+    
+    // Number of Meters
+    while (true) {
+        newUser.numberOfMeters = getValidInteger("\nHow many meters do you have? (Maximum 2): ");
+        
+        if (newUser.numberOfMeters >= 1 && newUser.numberOfMeters <= 2) {
+            break;
+        } else {
+            cout << "Invalid! Please enter 1 or 2 only.\n";
+        }
+    }
+    
+    // Meter Serial Numbers
+    cout << "\nEnter Serial Number for Meter 1: ";
+    getline(cin, newUser.meter1Serial);
+    
+    if (newUser.numberOfMeters == 2) {
+        cout << "Enter Serial Number for Meter 2: ";
+        getline(cin, newUser.meter2Serial);
+    }
+    
+    // Checked again, hashed and saved by registerAccount
+    cout << "\nSecuring password..." << flush;
+    RegisterResult result = registerAccount(newUser);
+    cout << "\n";
+    
+    if (result.ok) {
+        cout << "\n========================================\n";
+        cout << "Registration successful!\n";
+        cout << "Your password is hashed and stored securely.\n";
+        cout << "========================================\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+    } else {
+        cout << "\nError: " << result.error << "\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+}
+
+bool checkUserExists(const string& username) {
+    return userStore.exists(username);
+}
+
+// The first of a new user's meter serials that is already registered (or repeated), or ""
+string takenSerial(const User& user) {
+    if (userStore.serialInUse(user.meter1Serial)) {
+        return user.meter1Serial;
+    }
+    if (user.numberOfMeters == 2 &&
+        (user.meter2Serial == user.meter1Serial || userStore.serialInUse(user.meter2Serial))) {
+        return user.meter2Serial;
+    }
+    return "";
+}
+
+void loginUser() {
+    User loginUser;
+    
+    clearScreen();
+    cout << "\n========================================\n";
+    cout << "            USER LOGIN\n";
+    cout << "========================================\n\n";
+    
+    cout << "Enter Username: ";
+    cin >> loginUser.username;
+    cout << "Enter Password: ";
+    cin >> loginUser.password;
+    cout << "\nVerifying password..." << flush;
+    
+    if (validateLogin(loginUser.username, loginUser.password)) {
+        cout << "\nLogin successful! Welcome, " << loginUser.username << "!\n";
+        cout << "Press Enter to continue...";
+        cin.ignore();
+        cin.get();
+        mainMenu(loginUser.username);
+    } else {
+        cout << "\nInvalid username or password!\n";
+        cout << "Press Enter to continue...";
+        cin.ignore();
+        cin.get();
+    }
+}
+
+bool validateLogin(const string& username, const string& password) {
+    return loginAccount(username, password).ok;
+}
+
+void mainMenu(const string& username) {
+    int choice;
+    
+    while (true) {
+        clearScreen();
+        cout << "\n========================================\n";
+        cout << "         MAIN MENU - " << username << "\n";
+        cout << "========================================\n\n";
+        cout << "1. Enter Meter Reading\n";
+        cout << "2. View Billing History\n";
+        cout << "3. View Usage Statistics\n";
+        cout << "4. Logout\n";
+        cout << "\nEnter your choice: ";
+        choice = getValidInteger("");
+        
+        switch (choice) {
+            case 1:
+                enterMeterReading(username);
+                break;
+            case 2:
+                displayBillingHistory(username);
+                break;
+            case 3:
+                displayStatistics(username);
+                break;
+            case 4:
+                cout << "\nLogging out...\n";
+                return;
+            default:
+                cout << "\nInvalid choice! Please enter 1, 2, 3, or 4.\n";
+                cout << "Press Enter to continue...";
+                cin.get();
+        }
+    }
+}
+
+void enterMeterReading(const string& username) {
+    clearScreen();
+    
+    User user = getUserDetails(username);
+    
+    cout << "\n========================================\n";
+    cout << "       MONTHLY METER READING\n";
+    cout << "========================================\n";
+    cout << "User: " << user.fullName << "\n";
+    cout << "Address: " << user.streetNumber << ", " << user.residentialArea << "\n";
+    cout << "========================================\n\n";
+    
+    // Select which meter to enter reading for
+    int meterChoice;
+    string selectedMeter;
+    
+    if (user.numberOfMeters == 1) {
+        cout << "Meter Serial: " << user.meter1Serial << "\n\n";
+        selectedMeter = user.meter1Serial;
+    } else {
+        cout << "Select Meter:\n";
+        cout << "1. Meter 1 (Serial: " << user.meter1Serial << ")\n";
+        cout << "2. Meter 2 (Serial: " << user.meter2Serial << ")\n\n";
+        meterChoice = getValidInteger("Enter choice (1 or 2): ");
+        
+        if (meterChoice == 1) {
+            selectedMeter = user.meter1Serial;
+        } else if (meterChoice == 2) {
+            selectedMeter = user.meter2Serial;
+        } else {
+            cout << "\nInvalid choice!\n";
+            cout << "Press Enter to continue...";
+            cin.get();
+            return;
+        }
+    }
+    
+    BillingRecord record;
+    record.username = username;
+    record.meterSerial = selectedMeter;
+    
+    // Period and previous reading both come from the meter's latest record
+    const MeterState* state = lookupMeter(ledgerIndex, username, selectedMeter);
+    
+    if (state == NULL) {
+        // First time billing for this meter
+        cout << "\nAvailable months:\n";
+        string months[] = {"January", "February", "March", "April", "May", "June", 
+                          "July", "August", "September", "October", "November", "December"};
+        for (int i = 0; i < 12; i++) {
+            cout << (i + 1) << ". " << months[i] << "\n";
+        }
+        int monthChoice = getValidInteger("\nSelect month (1-12): ");
+        if (monthChoice < 1 || monthChoice > 12) {
+            monthChoice = 1;
+        }
+        // Every later bill follows this one, so a mistyped year is asked for again
+        int thisYear = currentPeriod() / 12;
+        int year = getValidInteger("Enter year (e.g. " + to_string(thisYear) + "): ");
+        while (!plausibleFirstYear(year)) {
+            cout << "\nError: Year must be between " << (thisYear - 20) << " and " << (thisYear + 1) << "!\n";
+            year = getValidInteger("Enter year (e.g. " + to_string(thisYear) + "): ");
+        }
+        record.period = makePeriod(year, monthChoice - 1);
+    } else {
+        // Auto-generate next period
+        record.period = nextPeriod(state->lastPeriod);
+        cout << "\nBilling Month (Auto-Generated): " << periodName(record.period) << "\n";
+    }
+    
+    // Auto-fetch previous reading
+    if (state != NULL) {
+        cout << "Previous Meter Reading (Auto-Fetched): " << state->lastReading << " units\n";
+        record.previousReading = state->lastReading;
+    } else {
+        cout << "No previous record found for this meter.\n";
+        record.previousReading = getValidInteger("Enter Previous Meter Reading: ");
+    }
+    
+    // Get current reading with validation
+    while (true) {
+        record.currentReading = getValidInteger("Enter Current Meter Reading: ");
+        
+        if (record.currentReading < record.previousReading) {
+            cout << "\nError: Current reading (" << record.currentReading 
+                 << ") cannot be less than previous reading (" 
+                 << record.previousReading << ")!\n";
+            cout << "Please enter current reading again.\n\n";
+        } else {
+            break;
+        }
+    }
+    
+    // Bill and save; the period and previous reading only count for a first bill
+    SubmitResult result = submitReading(username, selectedMeter, record.currentReading,
+                                        record.previousReading, record.period);
+    if (!result.ok) {
+        cout << "\nError: " << result.error << "\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+        return;
+    }
+    record = result.record;
+    const Tariff& tariff = tariffBook.forArea(user.residentialArea);
+    
+    // Display bill details with calculation
+    clearScreen();
+    cout << "\n========================================\n";
+    cout << "         BILL SUMMARY\n";
+    cout << "========================================\n";
+    cout << "User           : " << user.fullName << "\n";
+    cout << "Meter Serial   : " << record.meterSerial << "\n";
+    cout << "Billing Month  : " << periodName(record.period) << "\n";
+    cout << "========================================\n";
+    cout << fixed << setprecision(2);
+    cout << "Previous Reading : " << record.previousReading << " units\n";
+    cout << "Current Reading  : " << record.currentReading << " units\n";
+    cout << "Units Consumed   : " << record.unitsConsumed << " units\n";
+    cout << "========================================\n";
+    
+    // Show calculation breakdown
+    cout << "\nBill Calculation:\n";
+    cout << "----------------------------------------\n";
+    
+    tariff.printBreakdown(cout, record.unitsConsumed);
+    
+    cout << "========================================\n";
+    cout << "TOTAL BILL AMOUNT: Rs. " << record.totalBill << "\n";
+    cout << "========================================\n";
+    
+    cout << "\nBilling record saved successfully!\n";
+    cout << "Press Enter to continue...";
+    cin.get();
+}
+
+// Bill under the built-in tariff
+double calculateBill(int units) {
+    PF_TIMED_SAMPLED(METRIC_CALCULATE_BILL, 64);
+    return DEFAULT_TARIFF.bill(units);
+}
+
+// Bill under the tariff of a residential area
+double calculateBill(int units, const string& residentialArea) {
+    PF_TIMED_SAMPLED(METRIC_CALCULATE_BILL, 64);
+    return tariffBook.forArea(residentialArea).bill(units);
+}
+
+// calculateBill over an array, one value at a time
+void calculateBillsScalar(const int* units, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = calculateBill(units[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Branch-free built-in tariff: the slab start, rate and accumulated charge are
+// picked with compare masks, then combined exactly like StaticTariff::bill.
+// Units are whole numbers, so every step is exact and matches the scalar path.
+__attribute__((target("sse2")))
+void calculateBillsSSE2(const int* units, double* out, size_t n) {
+    const size_t slabs = sizeof(DEFAULT_SLABS) / sizeof(DEFAULT_SLABS[0]);
+    size_t i = 0;
+    
+    for (; i + 2 <= n; i += 2) {
+        __m128d value = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(units + i)));
+        __m128d start = _mm_setzero_pd();
+        __m128d rate = _mm_set1_pd(DEFAULT_TARIFF.rate[0]);
+        __m128d cumulative = _mm_setzero_pd();
+        
+        for (size_t slab = 1; slab < slabs; slab++) {
+            __m128d above = _mm_cmpgt_pd(value, _mm_set1_pd(DEFAULT_TARIFF.start[slab]));
+            start = _mm_or_pd(_mm_andnot_pd(above, start), _mm_and_pd(above, _mm_set1_pd(DEFAULT_TARIFF.start[slab])));
+            rate = _mm_or_pd(_mm_andnot_pd(above, rate), _mm_and_pd(above, _mm_set1_pd(DEFAULT_TARIFF.rate[slab])));
+            cumulative = _mm_or_pd(_mm_andnot_pd(above, cumulative),
+                                   _mm_and_pd(above, _mm_set1_pd(DEFAULT_TARIFF.cumulative[slab])));
+        }
+        _mm_storeu_pd(out + i, _mm_add_pd(cumulative, _mm_mul_pd(_mm_sub_pd(value, start), rate)));
+    }
+    calculateBillsScalar(units + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void calculateBillsAVX2(const int* units, double* out, size_t n) {
+    const size_t slabs = sizeof(DEFAULT_SLABS) / sizeof(DEFAULT_SLABS[0]);
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        __m256d value = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(units + i)));
+        __m256d start = _mm256_setzero_pd();
+        __m256d rate = _mm256_set1_pd(DEFAULT_TARIFF.rate[0]);
+        __m256d cumulative = _mm256_setzero_pd();
+        
+        for (size_t slab = 1; slab < slabs; slab++) {
+            __m256d above = _mm256_cmp_pd(value, _mm256_set1_pd(DEFAULT_TARIFF.start[slab]), _CMP_GT_OQ);
+            start = _mm256_blendv_pd(start, _mm256_set1_pd(DEFAULT_TARIFF.start[slab]), above);
+            rate = _mm256_blendv_pd(rate, _mm256_set1_pd(DEFAULT_TARIFF.rate[slab]), above);
+            cumulative = _mm256_blendv_pd(cumulative, _mm256_set1_pd(DEFAULT_TARIFF.cumulative[slab]), above);
+        }
+        _mm256_storeu_pd(out + i, _mm256_add_pd(cumulative, _mm256_mul_pd(_mm256_sub_pd(value, start), rate)));
+    }
+    calculateBillsScalar(units + i, out + i, n - i);
+}
+#endif
+
+// Name of the kernel calculateBills uses on this CPU
+const char* billKernelName() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+// Built-in tariff bills for n unit values, using the widest vector unit available.
+// Results are bit-for-bit the same as calling calculateBill on each value.
+void calculateBills(const int* units, double* out, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const string kernel = billKernelName();
+    if (kernel == "avx2") {
+        calculateBillsAVX2(units, out, n);
+        return;
+    }
+    if (kernel == "sse2") {
+        calculateBillsSSE2(units, out, n);
+        return;
+    }
+#endif
+    calculateBillsScalar(units, out, n);
+}
+
+// Queue a record on the ledger writer and update the in-memory indexes
+bool saveBillingRecord(const BillingRecord& record) {
+    return saveBillingRecord(record, ledgerWriter, ledgerIndex, usageStats, indexLock);
+}
+
+// The same over a writer and indexes of another ledger, as the benchmarks use.
+// lock is held for writing across the whole save: a record must be counted by
+// stats.update() before another thread's stats.refresh() can find it on file.
+bool saveBillingRecord(const BillingRecord& record, LedgerWriter& writer, LedgerIndex& index, UsageStats& stats,
+                       shared_mutex& lock) {
+    PF_TIMED_SAMPLED(METRIC_SAVE_RECORD, 16);
+    string line;
+    formatBillingRecord(line, record);
+    
+    // Load the indexes first so the new record, which may still be buffered, is counted once
+    unique_lock<shared_mutex> guard(lock);
+    index.prepare();
+    stats.refresh();
+    if (!writer.append(line)) {
+        return false;
+    }
+    index.update(record);
+    stats.update(record, line.length());
+    PF_COUNT(COUNTER_RECORDS_SAVED, 1);
+    return true;
+}
+
+// A meter's latest billing state. A lookup is a hash probe of a few hundred ns,
+// so meter_lookup times one call in 64, like calculate_bill.
+const MeterState* lookupMeter(LedgerIndex& index, const string& username, const string& meterSerial) {
+    PF_TIMED_SAMPLED(METRIC_METER_LOOKUP, 64);
+    return index.latest(username, meterSerial);
+}
+
+// Show the history newest first, one page at a time, optionally filtered
+void displayBillingHistory(const string& username) {
+    const size_t perPage = 5;
+    HistoryFilter filter = {"", -1, -1};
+    size_t page = 0;
+    
+    while (true) {
+        clearScreen();
+        cout << "\n========================================\n";
+        cout << "       BILLING HISTORY - " << username << "\n";
+        cout << "========================================\n\n";
+        
+        HistoryResult history = billingHistory(username, filter, page, perPage);
+        const vector<HistoryRow>& rows = history.rows;
+        size_t total = history.total;
+        size_t pages = (total + perPage - 1) / perPage;
+        
+        if (!filter.meterSerial.empty() || filter.fromPeriod >= 0 || filter.toPeriod >= 0) {
+            cout << "Filter: meter " << (filter.meterSerial.empty() ? "any" : filter.meterSerial)
+                 << ", months " << (filter.fromPeriod >= 0 ? periodName(filter.fromPeriod) : "any")
+                 << " to " << (filter.toPeriod >= 0 ? periodName(filter.toPeriod) : "any") << "\n\n";
+        }
+        
+        cout << fixed << setprecision(2);
+        for (size_t i = 0; i < rows.size(); i++) {
+            const BillingRecord& record = rows[i].record;
+            
+            cout << "Record #" << rows[i].number << "\n";
+            cout << "----------------------------------------\n";
+            cout << "Meter Serial     : " << record.meterSerial << "\n";
+            cout << "Month            : " << periodName(record.period) << "\n";
+            cout << "Previous Reading : " << record.previousReading << " units\n";
+            cout << "Current Reading  : " << record.currentReading << " units\n";
+            cout << "Units Consumed   : " << record.unitsConsumed << " units\n";
+            cout << "Total Bill       : Rs. " << record.totalBill << "\n";
+            cout << "----------------------------------------\n\n";
+        }
+        
+        if (total == 0) {
+            cout << "No billing records found for this user.\n";
+        } else {
+            cout << "Page " << (page + 1) << " of " << pages << " (" << total << " records, newest first)\n";
+        }
+        
+        cout << "\n1. Next Page\n";
+        cout << "2. Previous Page\n";
+        cout << "3. Filter by Meter or Month\n";
+        cout << "4. Clear Filter\n";
+        cout << "5. Back\n";
+        int choice = getValidInteger("\nEnter your choice: ");
+        
+        switch (choice) {
+            case 1:
+                if (page + 1 < pages) {
+                    page++;
+                }
+                break;
+            case 2:
+                if (page > 0) {
+                    page--;
+                }
+                break;
+            case 3: {
+                cout << "\nMeter Serial (leave empty for all meters): ";
+                getline(cin, filter.meterSerial);
+                // YYYY-MM, or a month of this year; anything else means any
+                string from, to;
+                cout << "From Month (YYYY-MM or 1-12, empty for any): ";
+                getline(cin, from);
+                cout << "To Month (YYYY-MM or 1-12, empty for any): ";
+                getline(cin, to);
+                filter.fromPeriod = periodArgument(from);
+                filter.toPeriod = periodArgument(to);
+                page = 0;
+                break;
+            }
+            case 4:
+                filter.meterSerial = "";
+                filter.fromPeriod = -1;
+                filter.toPeriod = -1;
+                page = 0;
+                break;
+            case 5:
+                return;
+            default:
+                cout << "\nInvalid choice! Please enter 1 to 5.\n";
+                cout << "Press Enter to continue...";
+                cin.get();
+        }
+    }
+}
+
+void displayStatistics(const string& username) {
+    clearScreen();
+    cout << "\n========================================\n";
+    cout << "   USAGE STATISTICS - " << username << "\n";
+    cout << "========================================\n\n";
+    
+    StatsResult result = usageStatistics(username);
+    const UsageAggregate* stats = &result.total;
+    
+    if (result.ok && stats->count > 0) {
+        double totalAmount = stats->totalPaisa / 100.0;
+        
+        cout << fixed << setprecision(2);
+        cout << "Total Bills Generated : " << stats->count << "\n";
+        cout << "Total Units Consumed  : " << stats->totalUnits << " units\n";
+        cout << "Total Amount Paid     : Rs. " << totalAmount << "\n";
+        cout << "Average Units/Month   : " << (stats->totalUnits / stats->count) << " units\n";
+        cout << "Average Bill/Month    : Rs. " << (totalAmount / stats->count) << "\n";
+        cout << "Highest Consumption   : " << stats->maxUnits << " units\n";
+        cout << "Lowest Consumption    : " << stats->minUnits << " units\n";
+        cout << "========================================\n";
+        
+        // Per-meter totals for users with more than one meter
+        if (result.meters.size() == 2) {
+            for (size_t i = 0; i < result.meters.size(); i++) {
+                const UsageAggregate& meter = result.meters[i].second;
+                cout << "Meter " << result.meters[i].first << ": " << meter.count << " bills, "
+                     << meter.totalUnits << " units, Rs. " << (meter.totalPaisa / 100.0) << "\n";
+            }
+            cout << "========================================\n";
+        }
+    } else {
+        cout << "No statistics available yet.\n";
+    }
+    
+    cout << "\nPress Enter to continue...";
+    cin.get();
+}
+
+// Write one user block in the users.txt layout
+void writeUserBlock(ostream& out, const User& user) {
+    out << user.username << " " << user.password << "\n";
+    out << user.fullName << "\n";
+    out << user.streetNumber << "\n";
+    out << user.residentialArea << "\n";
+    out << user.numberOfMeters << "\n";
+    out << user.meter1Serial << "\n";
+    if (user.numberOfMeters == 2) {
+        out << user.meter2Serial << "\n";
+    }
+    out.flush();
+}
+
+// Read one user block; the meter count decides whether a second serial line follows
+bool readUserBlock(istream& in, User& user) {
+    string line;
+    
+    do {
+        if (!getline(in, line)) {
+            return false;
+        }
+    } while (line.empty());
+    
+    size_t space = line.find(' ');
+    user.username = line.substr(0, space);
+    user.password = (space == string::npos) ? "" : line.substr(space + 1);
+    
+    string meters;
+    if (!getline(in, user.fullName) || !getline(in, user.streetNumber) ||
+        !getline(in, user.residentialArea) || !getline(in, meters) ||
+        !getline(in, user.meter1Serial)) {
+        return false;
+    }
+    
+    user.numberOfMeters = atoi(meters.c_str());
+    user.meter2Serial = "";
+    if (user.numberOfMeters == 2 && !getline(in, user.meter2Serial)) {
+        return false;
+    }
+    return true;
+}
+
+NewlineSplitter::NewlineSplitter(const char* data, size_t size)
+    : data(data), size(size), cursor(0), base(0), mask(0) {
+    scan();
+}
+
+void NewlineSplitter::scan() {
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+    if (base + 64 <= size) {
+        const __m128i newline = _mm_set1_epi8('\n');
+        uint64_t found = 0;
+        for (int i = 0; i < 4; i++) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(data + base + i * 16));
+            found |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (i * 16);
+        }
+        mask = found;
+        return;
+    }
+#endif
+    const char* end = data + min(size, base + 64);
+    const char* newline = data + base;
+    mask = 0;
+    while ((newline = (const char*)memchr(newline, '\n', end - newline)) != NULL) {
+        mask |= 1ULL << (newline - (data + base));
+        newline++;
+    }
+}
+
+bool NewlineSplitter::next(string_view& line) {
+    if (cursor >= size) {
+        return false;
+    }
+    while (mask == 0) {
+        base += 64;
+        if (base >= size) {
+            line = string_view(data + cursor, size - cursor);
+            cursor = size;
+            return true;
+        }
+        scan();
+    }
+    
+    size_t newline = base + countr_zero(mask);
+    mask &= mask - 1;
+    line = string_view(data + cursor, newline - cursor);
+    cursor = newline + 1;
+    return true;
+}
+
+// Same rules as readUserBlock, on views
+bool nextUserBlock(NewlineSplitter& lines, UserView& user) {
+    string_view line;
+    
+    do {
+        if (!lines.next(line)) {
+            return false;
+        }
+    } while (line.empty());
+    
+    size_t space = line.find(' ');
+    user.username = line.substr(0, space);
+    user.password = (space == string_view::npos) ? string_view() : line.substr(space + 1);
+    if (!lines.next(user.fullName) || !lines.next(user.streetNumber) || !lines.next(user.residentialArea) ||
+        !lines.next(user.meters) || !lines.next(user.meter1Serial)) {
+        return false;
+    }
+    user.meter2Serial = string_view();
+    return user.numberOfMeters() != 2 || lines.next(user.meter2Serial);
+}
+
+// Parsed like atoi: leading spaces, then digits
+int UserView::numberOfMeters() const {
+    size_t start = meters.find_first_not_of(' ');
+    int count = 0;
+    
+    if (start != string_view::npos) {
+        from_chars(meters.data() + start, meters.data() + meters.size(), count);
+    }
+    return count;
+}
+
+User UserView::toUser() const {
+    User user;
+    
+    user.username = username;
+    user.password = password;
+    user.fullName = fullName;
+    user.streetNumber = streetNumber;
+    user.residentialArea = residentialArea;
+    user.numberOfMeters = numberOfMeters();
+    user.meter1Serial = meter1Serial;
+    user.meter2Serial = (user.numberOfMeters == 2) ? string(meter2Serial) : "";
+    return user;
+}
+
+// Views of a User's own strings, valid while it is unchanged
+UserView viewOfUser(const User& user) {
+    UserView view;
+    
+    view.username = user.username;
+    view.password = user.password;
+    view.fullName = user.fullName;
+    view.streetNumber = user.streetNumber;
+    view.residentialArea = user.residentialArea;
+    view.meters = (user.numberOfMeters == 2) ? "2" : "1";
+    view.meter1Serial = user.meter1Serial;
+    view.meter2Serial = user.meter2Serial;
+    return view;
+}
+
+UserStore::UserStore(string fileName)
+    : fileName(fileName), loaded(false), loadedBytes(0), mappedUsers(0), mappedSerials(0), extraUsers(0),
+      supersededBlocks(0), filtersLoaded(false), filterCapacity(0), nameCount(0), serialCount(0) {
+    size_t extension = fileName.rfind(".txt");
+    filterFile = fileName.substr(0, (extension == string::npos) ? fileName.length() : extension) + ".bloom";
+    indexFile = filterFile.substr(0, filterFile.length() - 6) + ".idx";
+    nameTable.slots = serialTable.slots = NULL;
+    nameTable.capacity = serialTable.capacity = 0;
+}
+
+// Map the file and its index. Small files are split on every start; they take
+// less than a millisecond and are not worth a users.idx.
+void UserStore::load() {
+    PF_TIMED(METRIC_LOAD_USERS);
+    const size_t indexedSize = 1 << 20;
+    
+    mapping.open(fileName);     // a missing or empty file is no users
+    loadedBytes = mapping.size();
+    loaded = true;
+    if (!mapIndex()) {
+        buildIndex();
+        if (mapping.size() >= indexedSize) {
+            saveIndex();
+        }
+    }
+}
+
+// Map users.idx and add the blocks appended after it as if registered. A
+// missing or damaged index, a users.txt shorter than it covers or rewritten
+// since, or a tail of more than an eighth of the file mean a rebuild instead.
+bool UserStore::mapIndex() {
+    if (!indexMapping.open(indexFile) || indexMapping.size() < sizeof(UserIndexHeader)) {
+        return false;
+    }
+    UserIndexHeader header;
+    memcpy(&header, indexMapping.data(), sizeof(header));
+    bool valid = memcmp(header.magic, "PFUI", 4) == 0 && header.version == 3 &&
+                 header.coveredBytes <= mapping.size() && header.blocks >= header.users &&
+                 mapping.size() - header.coveredBytes <= max((uint64_t)1 << 20, header.coveredBytes / 8) &&
+                 has_single_bit(header.nameSlots) && has_single_bit(header.serialSlots) &&
+                 indexMapping.size() == sizeof(header) + (header.nameSlots + header.serialSlots) * sizeof(UserSlot) &&
+                 header.fingerprint == prefixFingerprint(fileName, header.coveredBytes);
+    if (!valid) {
+        indexMapping.close();
+        return false;
+    }
+    
+    nameTable.slots = (const UserSlot*)(indexMapping.data() + sizeof(header));
+    nameTable.capacity = header.nameSlots;
+    serialTable.slots = nameTable.slots + header.nameSlots;
+    serialTable.capacity = header.serialSlots;
+    mappedUsers = header.users;
+    mappedSerials = header.serials;
+    supersededBlocks = header.blocks - header.users;
+    
+    NewlineSplitter lines(mapping.data() + header.coveredBytes, mapping.size() - header.coveredBytes);
+    UserView user;
+    while (nextUserBlock(lines, user)) {
+        overlay(user.toUser());
+    }
+    return true;
+}
+
+// Split the whole file into the name and serial tables
+void UserStore::buildIndex() {
+    vector<UserSlot> nameKeys, serialKeys;
+    vector<uint64_t> nameHashes, serialHashes;
+    uint64_t hash;
+    UserView user;
+    
+    nameKeys.reserve(mapping.size() / 64);
+    nameHashes.reserve(mapping.size() / 64);
+    NewlineSplitter lines(mapping.data(), mapping.size());
+    while (nextUserBlock(lines, user)) {
+        uint64_t block = user.username.data() - mapping.data();
+        nameKeys.push_back(slotFor(block, user.username, 0, hash));
+        nameHashes.push_back(hash);
+        serialKeys.push_back(slotFor(block, user.meter1Serial, 1, hash));
+        serialHashes.push_back(hash);
+        if (user.numberOfMeters() == 2) {
+            serialKeys.push_back(slotFor(block, user.meter2Serial, 2, hash));
+            serialHashes.push_back(hash);
+        }
+    }
+    buildTable(nameKeys, nameHashes, nameTable, mappedUsers, true);
+    buildTable(serialKeys, serialHashes, serialTable, mappedSerials, false);
+    supersededBlocks = nameKeys.size() - mappedUsers;
+}
+
+bool UserStore::saveIndex() {
+    UserIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PFUI", 4);
+    header.version = 3;
+    header.coveredBytes = mapping.size();
+    header.fingerprint = prefixFingerprint(fileName, header.coveredBytes);
+    header.blocks = mappedUsers + supersededBlocks;
+    header.users = mappedUsers;
+    header.serials = mappedSerials;
+    header.nameSlots = nameTable.capacity;
+    header.serialSlots = serialTable.capacity;
+    
+    string tempFile = indexFile + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::binary | ios::trunc);
+    outFile.write((const char*)&header, sizeof(header));
+    outFile.write((const char*)nameTable.slots, nameTable.capacity * sizeof(UserSlot));
+    outFile.write((const char*)serialTable.slots, serialTable.capacity * sizeof(UserSlot));
+    outFile.close();
+    if (!outFile || rename(tempFile.c_str(), indexFile.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// which is 0 for the username and 1 or 2 for a serial, kept for keys too far into
+// a very long block to fit the slot
+UserSlot UserStore::slotFor(uint64_t block, string_view key, uint16_t which, uint64_t& hash) const {
+    UserSlot slot;
+    size_t offset = key.data() - (mapping.data() + block);
+    
+    hash = hashBytes(key.data(), key.size(), 14695981039346656037ULL);
+    slot.block = block + 1;
+    slot.tag = hash >> 32;
+    if (offset < LONG_USER_KEY && key.size() <= LONG_USER_KEY) {
+        slot.keyOffset = offset;
+        slot.keyLength = key.size();
+    } else {
+        slot.keyOffset = LONG_USER_KEY;
+        slot.keyLength = which;
+    }
+    return slot;
+}
+
+// Linear probing from the top bits of the hash, at most 3/4 full. The keys are
+// first grouped by their top 8 bits, so each group fills its own stretch of the
+// table while it is in cache instead of the whole table at random. Groups keep
+// file order, so for a repeated key the last block wins when replace is set and
+// the first otherwise.
+void UserStore::buildTable(const vector<UserSlot>& keys, const vector<uint64_t>& hashes, UserTable& table,
+                           size_t& count, bool replace) {
+    size_t capacity = 1024;
+    while (capacity * 3 < keys.size() * 4) {
+        capacity <<= 1;
+    }
+    
+    vector<size_t> starts(257, 0);
+    for (size_t i = 0; i < keys.size(); i++) {
+        starts[(hashes[i] >> 56) + 1]++;
+    }
+    for (int group = 0; group < 256; group++) {
+        starts[group + 1] += starts[group];
+    }
+    vector<uint32_t> order(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        order[starts[hashes[i] >> 56]++] = i;
+    }
+    
+    table.owned.assign(capacity, UserSlot());
+    table.slots = table.owned.data();
+    table.capacity = capacity;
+    count = 0;
+    int shift = 64 - countr_zero(capacity);
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < order.size(); i++) {
+        const UserSlot& key = keys[order[i]];
+        size_t slot = hashes[order[i]] >> shift;
+        while (table.owned[slot].block != 0 &&
+               (table.owned[slot].tag != key.tag || keyOf(table.owned[slot]) != keyOf(key))) {
+            slot = (slot + 1) & mask;
+        }
+        if (table.owned[slot].block == 0) {
+            table.owned[slot] = key;
+            count++;
+        } else if (replace) {
+            table.owned[slot] = key;
+        }
+    }
+}
+
+const UserSlot* UserStore::probe(const UserTable& table, string_view key) const {
+    if (table.capacity == 0) {
+        return NULL;
+    }
+    uint64_t hash = hashBytes(key.data(), key.size(), 14695981039346656037ULL);
+    uint32_t tag = hash >> 32;
+    size_t mask = table.capacity - 1;
+    for (size_t slot = hash >> (64 - countr_zero(table.capacity)); table.slots[slot].block != 0;
+         slot = (slot + 1) & mask) {
+        if (table.slots[slot].tag == tag && keyOf(table.slots[slot]) == key) {
+            return &table.slots[slot];
+        }
+    }
+    return NULL;
+}
+
+// Slots mapped from users.idx are checked against the mapping before use; a
+// slot pointing past it has no key
+string_view UserStore::keyOf(const UserSlot& slot) const {
+    if (slot.keyOffset != LONG_USER_KEY) {
+        if (slot.block == 0 || slot.block - 1 > mapping.size() ||
+            (uint64_t)slot.keyOffset + slot.keyLength > mapping.size() - (slot.block - 1)) {
+            return string_view();
+        }
+        return string_view(mapping.data() + slot.block - 1 + slot.keyOffset, slot.keyLength);
+    }
+    UserView user;
+    if (slot.block == 0 || !viewAt(slot.block - 1, user)) {
+        return string_view();
+    }
+    return (slot.keyLength == 0) ? user.username : (slot.keyLength == 1) ? user.meter1Serial : user.meter2Serial;
+}
+
+bool UserStore::viewAt(uint64_t block, UserView& user) const {
+    if (block >= mapping.size()) {
+        return false;
+    }
+    NewlineSplitter lines(mapping.data() + block, mapping.size() - block);
+    return nextUserBlock(lines, user);
+}
+
+// Username that registered a meter serial, or an empty view
+string_view UserStore::ownerOfSerial(string_view meterSerial) {
+    if (!loaded) {
+        load();
+    }
+    
+    const UserSlot* slot = probe(serialTable, meterSerial);
+    UserView owner;
+    if (slot != NULL && viewAt(slot->block - 1, owner)) {
+        return owner.username;
+    }
+    unordered_map<string, string, TextHash, TextEqual>::const_iterator it = addedSerials.find(meterSerial);
+    return (it == addedSerials.end()) ? string_view() : string_view(it->second);
+}
+
+// The user's latest block, without copying any field
+bool UserStore::view(string_view username, UserView& user) {
+    if (!loaded) {
+        load();
+    }
+    
+    unordered_map<string, User, TextHash, TextEqual>::const_iterator it = added.find(username);
+    if (it != added.end()) {
+        user = viewOfUser(it->second);
+        return true;
+    }
+    const UserSlot* slot = probe(nameTable, username);
+    return slot != NULL && viewAt(slot->block - 1, user);
+}
+
+// Before the index is loaded, a filter miss answers without reading users.txt
+bool UserStore::exists(const string& username) {
+    if (!loaded && !mightExist(username)) {
+        return false;
+    }
+    if (!loaded) {
+        load();
+    }
+    return added.find(username) != added.end() || probe(nameTable, username) != NULL;
+}
+
+bool UserStore::serialInUse(const string& meterSerial) {
+    if (!loaded && !mightUseSerial(meterSerial)) {
+        return false;
+    }
+    return !ownerOfSerial(meterSerial).empty();
+}
+
+// Filter answers only: false means certainly absent, true means check the index
+bool UserStore::mightExist(const string& username) {
+    if (!filtersLoaded) {
+        loadFilters();
+    }
+    if (nameCount > filterCapacity || serialCount > filterCapacity) {
+        rebuildFilters();
+    }
+    return names.mightContain(username);
+}
+
+bool UserStore::mightUseSerial(const string& meterSerial) {
+    if (!filtersLoaded) {
+        loadFilters();
+    }
+    if (nameCount > filterCapacity || serialCount > filterCapacity) {
+        rebuildFilters();
+    }
+    return serials.mightContain(meterSerial);
+}
+
+void UserStore::addToFilters(const User& user) {
+    names.add(user.username);
+    serials.add(user.meter1Serial);
+    nameCount++;
+    serialCount++;
+    if (user.numberOfMeters == 2) {
+        serials.add(user.meter2Serial);
+        serialCount++;
+    }
+}
+
+// Read users.bloom and add the blocks appended to users.txt since it was written.
+// A missing or damaged file, a users.txt shorter than the filters cover or whose
+// covered part has changed, or filters past their capacity mean a rebuild from
+// the full index.
+void UserStore::loadFilters() {
+    UserFilterHeader header;
+    long long size = fileSize(fileName);
+    ifstream inFile(filterFile.c_str(), ios::binary);
+    vector<uint64_t> nameWords, serialWords;
+    
+    filtersLoaded = true;
+    bool valid = inFile.read((char*)&header, sizeof(header)) && memcmp(header.magic, "PFUF", 4) == 0 &&
+                 header.version == 2 && header.coveredBytes <= (uint64_t)max(0LL, size) &&
+                 header.nameWords > 0 && header.serialWords > 0 &&
+                 header.fingerprint == prefixFingerprint(fileName, header.coveredBytes);
+    if (valid) {
+        nameWords.resize(header.nameWords);
+        serialWords.resize(header.serialWords);
+        valid = inFile.read((char*)nameWords.data(), nameWords.size() * sizeof(uint64_t)) &&
+                inFile.read((char*)serialWords.data(), serialWords.size() * sizeof(uint64_t));
+    }
+    if (!valid) {
+        rebuildFilters();
+        return;
+    }
+    
+    names.assign(nameWords.data(), nameWords.size());
+    serials.assign(serialWords.data(), serialWords.size());
+    filterCapacity = header.capacity;
+    nameCount = header.nameCount;
+    serialCount = header.serialCount;
+    if ((uint64_t)size == header.coveredBytes) {
+        return;
+    }
+    
+    ifstream usersFile(fileName.c_str());
+    User user;
+    usersFile.seekg(header.coveredBytes);
+    while (readUserBlock(usersFile, user)) {
+        addToFilters(user);
+    }
+    if (nameCount > filterCapacity || serialCount > filterCapacity) {
+        rebuildFilters();
+        return;
+    }
+    saveFilters(size);
+}
+
+// Size both filters for twice the current keys so they absorb later registrations
+void UserStore::rebuildFilters() {
+    if (!loaded) {
+        load();
+    }
+    
+    filtersLoaded = true;
+    nameCount = size();
+    serialCount = mappedSerials + addedSerials.size();
+    filterCapacity = max((size_t)1024, 2 * max(nameCount, serialCount));
+    names.reset(filterCapacity);
+    serials.reset(filterCapacity);
+    for (size_t i = 0; i < nameTable.capacity; i++) {
+        if (nameTable.slots[i].block != 0) {
+            names.add(keyOf(nameTable.slots[i]));
+        }
+    }
+    for (size_t i = 0; i < serialTable.capacity; i++) {
+        if (serialTable.slots[i].block != 0) {
+            serials.add(keyOf(serialTable.slots[i]));
+        }
+    }
+    for (unordered_map<string, User, TextHash, TextEqual>::const_iterator it = added.begin(); it != added.end(); it++) {
+        names.add(it->first);
+    }
+    for (unordered_map<string, string, TextHash, TextEqual>::const_iterator it = addedSerials.begin();
+         it != addedSerials.end(); it++) {
+        serials.add(it->first);
+    }
+    saveFilters(loadedBytes);
+}
+
+bool UserStore::saveFilters(uint64_t coveredBytes) {
+    UserFilterHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PFUF", 4);
+    header.version = 2;
+    header.coveredBytes = coveredBytes;
+    header.fingerprint = prefixFingerprint(fileName, coveredBytes);
+    header.capacity = filterCapacity;
+    header.nameCount = nameCount;
+    header.serialCount = serialCount;
+    header.nameWords = names.words().size();
+    header.serialWords = serials.words().size();
+    
+    string tempFile = filterFile + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::binary | ios::trunc);
+    outFile.write((const char*)&header, sizeof(header));
+    outFile.write((const char*)names.words().data(), names.words().size() * sizeof(uint64_t));
+    outFile.write((const char*)serials.words().data(), serials.words().size() * sizeof(uint64_t));
+    outFile.close();
+    if (!outFile || rename(tempFile.c_str(), filterFile.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Save the filters as covering all of users.txt. Only correct when every block in
+// the file has gone through add(), as after a bulk import by this process.
+bool UserStore::persistFilters() {
+    if (!filtersLoaded) {
+        return true;
+    }
+    return saveFilters(max(0LL, fileSize(fileName)));
+}
+
+// The user decoded into strings, kept so the pointer stays valid and later finds
+// are a hash lookup
+const User* UserStore::find(const string& username) {
+    if (!loaded) {
+        load();
+    }
+    
+    unordered_map<string, User, TextHash, TextEqual>::const_iterator it = added.find(username);
+    if (it != added.end()) {
+        return &it->second;
+    }
+    
+    lock_guard<mutex> guard(decodeLock);
+    unordered_map<string, User>::const_iterator cached = decoded.find(username);
+    if (cached != decoded.end()) {
+        return &cached->second;
+    }
+    const UserSlot* slot = probe(nameTable, username);
+    UserView user;
+    if (slot == NULL || !viewAt(slot->block - 1, user)) {
+        return NULL;
+    }
+    return &decoded.emplace(username, user.toUser()).first->second;
+}
+
+// Called after a user block is appended, so the index matches the file without re-reading it.
+// Before the index is loaded only the filters change; the block is read from the file later.
+void UserStore::add(const User& user) {
+    if (filtersLoaded) {
+        addToFilters(user);
+    }
+    if (loaded) {
+        overlay(user);
+    }
+}
+
+// Record a user block newer than the tables; it wins over theirs
+void UserStore::overlay(const User& user) {
+    if (added.find(user.username) == added.end() && probe(nameTable, user.username) == NULL) {
+        extraUsers++;
+    } else {
+        supersededBlocks++;
+    }
+    added[user.username] = user;
+    if (ownerOfSerial(user.meter1Serial).empty()) {
+        addedSerials.emplace(user.meter1Serial, user.username);
+    }
+    if (user.numberOfMeters == 2 && ownerOfSerial(user.meter2Serial).empty()) {
+        addedSerials.emplace(user.meter2Serial, user.username);
+    }
+}
+
+size_t UserStore::size() {
+    if (!loaded) {
+        load();
+    }
+    return mappedUsers + extraUsers;
+}
+
+// users.idx and users.bloom describe offsets and sizes of the current users.txt,
+// so they must go before the file is replaced by a rewritten one
+void UserStore::removeSidecars() {
+    remove(indexFile.c_str());
+    remove(filterFile.c_str());
+}
+
+// Forget everything read from users.txt; the next call maps it again. Pointers
+// from find() and views from view() are invalid afterwards.
+void UserStore::reload() {
+    mapping.close();
+    indexMapping.close();
+    nameTable.slots = serialTable.slots = NULL;
+    nameTable.capacity = serialTable.capacity = 0;
+    nameTable.owned.clear();
+    serialTable.owned.clear();
+    mappedUsers = mappedSerials = extraUsers = supersededBlocks = 0;
+    added.clear();
+    addedSerials.clear();
+    decoded.clear();
+    loaded = false;
+    loadedBytes = 0;
+    filtersLoaded = false;
+}
+
+// Handle non-interactive modes such as benchmarks
+int runCommandLine(int argc, char* argv[]) {
+    string mode = argv[1];
+    
+    string textFile = (argc > 2) ? argv[2] : "records.txt";
+    string binaryFile = (argc > 3) ? argv[3] : binaryLedgerName(textFile);
+    
+    if (mode == "--bench-users") {
+        benchmarkUserStore();
+        return 0;
+    }
+    if (mode == "--convert-records") {
+        if (!convertRecordsToBinary(textFile, binaryFile)) {
+            return 1;
+        }
+        return verifyBinaryLedger(textFile, binaryFile);
+    }
+    if (mode == "--verify-binary") {
+        return verifyBinaryLedger(textFile, binaryFile);
+    }
+    if (mode == "--build-columns") {
+        return buildColumnStore(textFile, (argc > 3) ? argv[3] : columnStoreName(textFile)) ? 0 : 1;
+    }
+    if (mode == "--report" && argc > 2) {
+        return runColumnReport(argv[2], (argc > 3) ? max(1, atoi(argv[3])) : 10);
+    }
+    if (mode == "--period" && argc > 2) {
+        int from = periodArgument(argv[2]);
+        int to = (argc > 3) ? periodArgument(argv[3]) : from;
+        if (from < 0 || to < 0) {
+            cout << "Give the months as YYYY-MM\n";
+            return 1;
+        }
+        return listPeriodBills(from, to);
+    }
+    if (mode == "--meter-history" && argc > 2) {
+        return listMeterPeriods(argv[2], (argc > 3) ? max(1, atoi(argv[3])) : 12);
+    }
+    if (mode == "--migrate-periods") {
+        return migrateRecordPeriods((argc > 2) ? atoi(argv[2]) : 0) ? 0 : 1;
+    }
+    if (mode == "--bench-columns") {
+        benchmarkColumnStore((argc > 2) ? strtoull(argv[2], NULL, 10) : 100);
+        return 0;
+    }
+    if (mode == "--bill-run" && argc > 2) {
+        BillRunOptions options;
+        BillRunReport report;
+        options.readingsFile = argv[2];
+        options.firstPeriod = periodText(currentPeriod());
+        options.threads = 1;
+        options.appendToLedger = true;
+        options.verbose = true;
+        for (int i = 3; i < argc; i++) {
+            if (string(argv[i]) == "--threads" && i + 1 < argc) {
+                options.threads = max(1, atoi(argv[++i]));
+            } else {
+                options.firstPeriod = argv[i];
+            }
+        }
+        
+        int status = runBillRun(options, report);
+        if (status == 0) {
+            printBillRunReport(report, options.threads);
+            historyIndex.refresh();
+            usageStats.refresh();
+            usageStats.persist();
+        }
+        return status;
+    }
+    if (mode == "--verify-stats") {
+        return usageStats.verify();
+    }
+    if (mode == "--bench-writer") {
+        benchmarkLedgerWriter((argc > 2) ? strtoull(argv[2], NULL, 10) : 200000);
+        return 0;
+    }
+    if (mode == "--serve") {
+        BillingServer server((argc > 2) ? argv[2] : "billing.sock");
+        return server.run();
+    }
+    if (mode == "--serve-async") {
+        return runAsyncServer((argc > 2) ? argv[2] : "billing.sock", (argc > 3) ? max(1, atoi(argv[3])) : 2);
+    }
+    if (mode == "--load-test") {
+        LoadTestReport report;
+        int sessions = (argc > 3) ? atoi(argv[3]) : 1000;
+        if (!runLoadTest((argc > 2) ? argv[2] : "billing.sock", sessions, (argc > 4) ? atoi(argv[4]) : 20, report)) {
+            return 1;
+        }
+        printLoadTestReport(report, sessions);
+        return 0;
+    }
+    if (mode == "--bench-servers") {
+        benchmarkServers((argc > 2) ? atoi(argv[2]) : 1000, (argc > 3) ? atoi(argv[3]) : 20,
+                         (argc > 4) ? max(1, atoi(argv[4])) : 2);
+        return 0;
+    }
+    if (mode == "--bench-wal-recovery") {
+        benchmarkWalRecovery((argc > 2) ? strtoull(argv[2], NULL, 10) : 1024);
+        return 0;
+    }
+    if (mode == "--memory-report") {
+        reportRecordMemory((argc > 2) ? strtoull(argv[2], NULL, 10) : 5000000);
+        return 0;
+    }
+    if (mode == "--bench-scans") {
+        benchmarkScans((argc > 2) ? strtoull(argv[2], NULL, 10) : 1000000);
+        return 0;
+    }
+    if (mode == "--fleet-stats") {
+        WorkerPool pool((argc > 2) ? max(1, atoi(argv[2])) : max(1u, thread::hardware_concurrency()));
+        FleetAggregate fleet;
+        if (!aggregateFleet("records.txt", pool, fleet)) {
+            cout << "Unable to read records.txt\n";
+            return 1;
+        }
+        printFleetAggregate(fleet);
+        return 0;
+    }
+    if (mode == "--bench-fleet-stats") {
+        benchmarkFleetAggregate((argc > 2) ? strtoull(argv[2], NULL, 10) : 10000000,
+                                (argc > 3) ? max(1, atoi(argv[3])) : 32);
+        return 0;
+    }
+    if (mode == "--seal-segments") {
+        bool ok = ledgerSegments.seal((argc > 2) ? max(1, atoi(argv[2])) : 10000, false);
+        ledgerSegments.list();
+        return ok ? 0 : 1;
+    }
+    if (mode == "--compact-segments") {
+        bool ok = ledgerSegments.compact((argc > 2) ? atoi(argv[2]) : 12);
+        ledgerSegments.list();
+        return ok ? 0 : 1;
+    }
+    if (mode == "--list-segments") {
+        ledgerSegments.list();
+        return 0;
+    }
+    if (mode == "--bench-segments") {
+        benchmarkSegments((argc > 2) ? max(1, atoi(argv[2])) : 5000, (argc > 3) ? max(1, atoi(argv[3])) : 20);
+        return 0;
+    }
+    if (mode == "--import-users") {
+        if (argc < 3) {
+            cout << "Usage: --import-users file.csv\n";
+            return 1;
+        }
+        return importUsers(argv[2], userStore, wal);
+    }
+    if (mode == "--bench-import") {
+        benchmarkImport((argc > 2) ? max(1, atoi(argv[2])) : 100000, (argc > 3) ? max(1, atoi(argv[3])) : 10000);
+        return 0;
+    }
+    if (mode == "--bench-metrics") {
+        benchmarkMetrics((argc > 2) ? strtoull(argv[2], NULL, 10) : 200000);
+        return 0;
+    }
+    if (mode == "--generate" && argc > 2) {
+        DatasetSpec spec;
+        spec.users = (argc > 3) ? max(1, atoi(argv[3])) : 10000;
+        spec.metersPerUser = (argc > 4) ? min(2, max(1, atoi(argv[4]))) : 2;
+        spec.months = (argc > 5) ? max(0, atoi(argv[5])) : 12;
+        spec.seed = (argc > 6) ? strtoull(argv[6], NULL, 10) : 1;
+        return generateDataset(argv[2], spec) ? 0 : 1;
+    }
+    if (mode == "--bench-suite") {
+        DatasetSpec spec;
+        spec.users = (argc > 2) ? max(1, atoi(argv[2])) : 10000;
+        spec.metersPerUser = (argc > 3) ? min(2, max(1, atoi(argv[3]))) : 2;
+        spec.months = (argc > 4) ? max(1, atoi(argv[4])) : 12;
+        spec.seed = 1;
+        return runBenchmarkSuite(spec, (argc > 5) ? argv[5] : "bench_results.json");
+    }
+    if (mode == "--bench-compare" && argc > 3) {
+        return compareSuiteResults(argv[2], argv[3], (argc > 4) ? atof(argv[4]) : 10.0);
+    }
+    if (mode == "--commands") {
+        int inputFd = (argc > 2) ? open(argv[2], O_RDONLY) : STDIN_FILENO;
+        if (inputFd < 0) {
+            cout << "Unable to open " << argv[2] << "\n";
+            return 1;
+        }
+        int failed = runCommands(inputFd, STDOUT_FILENO);
+        if (inputFd != STDIN_FILENO) {
+            ::close(inputFd);
+        }
+        return (failed > 0) ? 1 : 0;
+    }
+    if (mode == "--bench-logins") {
+        benchmarkLogins();
+        return 0;
+    }
+    if (mode == "--bench-simd") {
+        benchmarkBillKernel((argc > 2) ? strtoull(argv[2], NULL, 10) : 100000000);
+        return 0;
+    }
+    if (mode == "--bench-bill-run") {
+        benchmarkBillRun((argc > 2) ? atoi(argv[2]) : 1000000, (argc > 3) ? atoi(argv[3]) : 32);
+        return 0;
+    }
+    
+    cout << "Unknown option: " << mode << "\n";
+    cout << "Available options:\n";
+    cout << "  --bench-users                     time user lookups at 10k, 100k and 1M users\n";
+    cout << "  --convert-records [txt] [bin]     convert records.txt to the binary format\n";
+    cout << "  --verify-binary [txt] [bin]       compare the binary ledger with the text file\n";
+    cout << "  --build-columns [txt] [col]       write the columnar copy of records.txt\n";
+    cout << "  --report areas|top|growth [N]     area/month rollup, top N meters or monthly growth\n";
+    cout << "  --period YYYY-MM [YYYY-MM]        list every bill of a month or range of months\n";
+    cout << "  --meter-history serial [N]        the bills of a meter's last N months\n";
+    cout << "  --migrate-periods [year]          give month-only records a year, the last ending in year\n";
+    cout << "  --bench-columns [millions]        time the columnar group-by over synthetic records\n";
+    cout << "  --fleet-stats [threads]           totals and slab histogram over the whole ledger\n";
+    cout << "  --seal-segments [records]         seal finished billing periods into segments/\n";
+    cout << "  --compact-segments [keep]         merge all but the newest segments into yearly archives\n";
+    cout << "  --list-segments                   show the sealed segments and archives\n";
+    cout << "  --bench-segments [meters] [years] latest-reading lookup time as the ledger grows\n";
+    cout << "  --import-users file.csv           register users from username,password,name,street,area,serial1[,serial2]\n";
+    cout << "  --bench-import [users] [rows]     bulk import into an existing user base\n";
+    cout << "  --bench-metrics [records]         cost of the -DPF_METRICS instrumentation on record saving\n";
+    cout << "  --generate dir [users] [meters] [months] [seed]  write a synthetic users.txt and records.txt\n";
+    cout << "  --bench-suite [users] [meters] [months] [out.json]  time the main operations on generated data\n";
+    cout << "  --bench-compare base.json new.json [percent]  flag operations slower than a saved run\n";
+    cout << "  --commands [file]                 run tab-separated commands from file or stdin, one per line\n";
+    cout << "  --bench-fleet-stats [records] [threads]\n";
+    cout << "                                    parallel aggregation from 1 to N threads\n";
+    cout << "  --bill-run readings.csv [month] [--threads N]\n";
+    cout << "                                    bill every serial,currentReading row in the file\n";
+    cout << "  --bench-bill-run [meters] [threads]  bill-run scaling from 1 to N threads\n";
+    cout << "  --bench-simd [count]              compare calculateBill with the bulk kernels\n";
+    cout << "  --verify-stats                    recompute usage statistics and compare with stats.idx\n";
+    cout << "  --bench-writer [records]          ledger append throughput at each durability level\n";
+    cout << "  --bench-wal-recovery [MB]         time crash recovery of a wal.log of the given size\n";
+    cout << "  --bench-logins                    password checks per second and per core at each hash cost\n";
+    cout << "  --memory-report [records]         heap bytes per record as BillingRecord and as CompactRecord\n";
+    cout << "  --bench-scans [records]           allocations and throughput of the ledger loaders\n";
+    cout << "  --serve [socket]                  serve clients on a Unix socket until interrupted\n";
+    cout << "  --serve-async [socket] [loops]    the same with coroutine handlers on epoll loops\n";
+    cout << "  --load-test [socket] [sessions] [requests]\n";
+    cout << "                                    drive a running server and report latency percentiles\n";
+    cout << "  --bench-servers [sessions] [requests] [loops]\n";
+    cout << "                                    load-test the threaded and the async server\n";
+    return 1;
+}
+
+// Deterministic synthetic user, used by the benchmarks
+User makeSyntheticUser(int id) {
+    User user = User();
+    char name[32];
+    
+    snprintf(name, sizeof(name), "user%07d", id);
+    user.username = name;
+    user.password = encryptPassword("Password@" + to_string(id));
+    user.fullName = "Customer " + to_string(id);
+    user.streetNumber = to_string(id % 500 + 1);
+    user.residentialArea = "Area" + to_string(id % 40);
+    user.numberOfMeters = (id % 3 == 0) ? 2 : 1;
+    user.meter1Serial = "M" + to_string(id) + "A";
+    if (user.numberOfMeters == 2) {
+        user.meter2Serial = "M" + to_string(id) + "B";
+    }
+    return user;
+}
+
+// Index build from users.txt, open with users.idx, and lookups, at three sizes;
+// then the newline splitter against a memchr loop on the largest file
+void benchmarkUserStore() {
+    const string benchFile = "bench_users.txt";
+    const string indexFile = "bench_users.idx";
+    const int sizes[] = {10000, 100000, 1000000};
+    const int lookups = 1000000;
+    
+    cout << fixed << setprecision(1);
+    cout << setw(10) << "users" << setw(12) << "build ms" << setw(12) << "open ms" << setw(14) << "hit ns/op"
+         << setw(14) << "miss ns/op" << setw(14) << "find ns/op" << setw(18) << "linear scan ms" << "\n";
+    
+    for (int s = 0; s < 3; s++) {
+        int count = sizes[s];
+        
+        ofstream outFile(benchFile.c_str());
+        for (int i = 0; i < count; i++) {
+            writeUserBlock(outFile, makeSyntheticUser(i));
+        }
+        outFile.close();
+        remove(indexFile.c_str());
+        
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        {
+            UserStore building(benchFile);
+            building.size();
+        }
+        double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        // Open again, now with users.idx when the file was large enough to get one
+        UserStore store(benchFile);
+        start = chrono::steady_clock::now();
+        store.size();
+        double openMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        vector<string> hits, misses;
+        unsigned int seed = 12345;
+        for (int i = 0; i < 1024; i++) {
+            seed = seed * 1103515245 + 12345;
+            hits.push_back(makeSyntheticUser(seed % count).username);
+            misses.push_back("nobody" + to_string(seed));
+        }
+        
+        size_t found = 0;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < lookups; i++) {
+            found += store.exists(hits[i & 1023]);
+        }
+        double hitNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / lookups;
+        
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < lookups; i++) {
+            found += store.exists(misses[i & 1023]);
+        }
+        double missNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / lookups;
+        
+        // First finds decode a User; 1024 distinct names so none comes from the cache
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < 1024; i++) {
+            found += (store.find(hits[i]) != NULL) ? 1 : 0;
+        }
+        double findNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / 1024;
+        
+        // One worst-case lookup the way the old code did it: walk the file to the end
+        start = chrono::steady_clock::now();
+        ifstream inFile(benchFile.c_str());
+        User user;
+        while (readUserBlock(inFile, user) && user.username != "nobody") {
+        }
+        double scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        cout << setw(10) << count << setw(12) << buildMs << setw(12) << openMs << setw(14) << hitNs
+             << setw(14) << missNs << setw(14) << findNs << setw(18) << scanMs << "\n";
+        if (found != (size_t)lookups + 1024) {
+            cout << "Warning: expected " << lookups + 1024 << " hits, found " << found << "\n";
+        }
+    }
+    
+    MappedFile file;
+    if (file.open(benchFile)) {
+        size_t lines = 0, memchrLines = 0;
+        string_view line;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        NewlineSplitter splitter(file.data(), file.size());
+        while (splitter.next(line)) {
+            lines++;
+        }
+        double splitMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        start = chrono::steady_clock::now();
+        const char* cursor = file.data();
+        const char* limit = file.data() + file.size();
+        while (cursor < limit) {
+            const char* newline = (const char*)memchr(cursor, '\n', limit - cursor);
+            memchrLines++;
+            cursor = (newline == NULL) ? limit : newline + 1;
+        }
+        double memchrMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Splitting " << lines << " lines: newline mask " << splitMs << " ms, memchr " << memchrMs << " ms\n";
+        if (lines != memchrLines) {
+            cout << "Warning: line counts differ (" << memchrLines << " with memchr)\n";
+        }
+    }
+    
+    remove(benchFile.c_str());
+    remove(indexFile.c_str());
+}
+
+LedgerIndex::LedgerIndex(string fileName, LedgerSegments* segments)
+    : fileName(fileName), segments(segments), loaded(false), complete(false), meters(arena.resource()) {
+}
+
+string LedgerIndex::key(string_view username, string_view meterSerial) {
+    string text;
+    key(username, meterSerial, text);
+    return text;
+}
+
+// Same key written into a caller's buffer, which keeps its capacity between records
+void LedgerIndex::key(string_view username, string_view meterSerial, string& into) {
+    into.assign(username).append(1, '\t').append(meterSerial);
+}
+
+// One pass over records.txt, or only over the part after the sealed segments
+// unless full is set; later records overwrite earlier ones
+void LedgerIndex::load(bool full) {
+    PF_TIMED(METRIC_LOAD_LEDGER_INDEX);
+    string meterKey;
+    BillingRecord record;
+    uint64_t sealed = (full || segments == NULL) ? 0 : segments->sealedBytes();
+    
+    meters = ArenaMap<MeterState>(arena.resource());
+    arena.release();
+    function<void(const BillingRecord&)> visit = [&](const BillingRecord& record) {
+        key(record.username, record.meterSerial, meterKey);
+        MeterState& state = arenaEntry(meters, meterKey);
+        state.lastReading = record.currentReading;
+        state.lastPeriod = record.period;
+    };
+    
+    if (sealed == 0) {
+        forEachBillingRecord(fileName, "", visit);
+    } else {
+        LineScanner scanner(fileName, sealed);
+        string_view line;
+        while (scanner.next(line)) {
+            if (parseBillingRecord(line, record)) {
+                visit(record);
+            }
+        }
+    }
+    loaded = true;
+    complete = (sealed == 0);
+}
+
+const MeterState* LedgerIndex::latest(const string& username, const string& meterSerial) {
+    return latestByKey(key(username, meterSerial));
+}
+
+const MeterState* LedgerIndex::latestByKey(const string& meterKey) {
+    if (!loaded) {
+        load(false);
+    }
+    
+    ArenaMap<MeterState>::const_iterator it = meters.find(meterKey);
+    if (it != meters.end()) {
+        return &it->second;
+    }
+    
+    // Not billed since the last sealed segment; the newest segment holding the meter
+    // has its latest reading, which is kept for the next lookup
+    size_t tab = meterKey.find('\t');
+    MeterState state;
+    if (complete || tab == string::npos ||
+        !segments->latest(meterKey.substr(0, tab), meterKey.substr(tab + 1), state, NULL)) {
+        return NULL;
+    }
+    MeterState& cached = arenaEntry(meters, meterKey);
+    cached = state;
+    return &cached;
+}
+
+// Called after saveBillingRecord appends a record
+void LedgerIndex::update(const BillingRecord& record) {
+    if (!loaded) {
+        load(false);
+    }
+    MeterState& state = arenaEntry(meters, key(record.username, record.meterSerial));
+    state.lastReading = record.currentReading;
+    state.lastPeriod = record.period;
+}
+
+void LedgerIndex::set(const string& meterKey, const MeterState& state) {
+    if (!loaded) {
+        load(false);
+    }
+    arenaEntry(meters, meterKey) = state;
+}
+
+// Load the index before the first append, so a record still in the writer's
+// buffer is counted once
+void LedgerIndex::prepare() {
+    if (!loaded) {
+        load(false);
+    }
+}
+
+// Load every meter. Entries already known are at least as new as anything in
+// records.txt (they may come from records still being written), so they are
+// laid over the full load.
+size_t LedgerIndex::size() {
+    if (!complete) {
+        vector<pair<string, MeterState> > known;
+        for (ArenaMap<MeterState>::const_iterator it = meters.begin(); it != meters.end(); it++) {
+            known.push_back(make_pair(string(it->first), it->second));
+        }
+        load(true);
+        for (size_t i = 0; i < known.size(); i++) {
+            arenaEntry(meters, known[i].first) = known[i].second;
+        }
+    }
+    return meters.size();
+}
+
+long long fileSize(const string& fileName) {
+    struct stat info;
+    
+    if (stat(fileName.c_str(), &info) != 0) {
+        return -1;
+    }
+    return info.st_size;
+}
+
+// Identifies the first coveredBytes of an append-only file for a sidecar that
+// covers them: the inode, so a file replaced by a rename does not match, and a
+// hash of the first and last 4 KB of the prefix, so an in-place rewrite usually
+// does not either. Appends leave it unchanged. 0 when the file cannot be read.
+uint64_t prefixFingerprint(const string& fileName, uint64_t coveredBytes) {
+    const size_t sample = 4096;
+    char buffer[2 * sample];
+    struct stat info;
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    
+    if (fd < 0 || fstat(fd, &info) != 0 || (uint64_t)info.st_size < coveredBytes) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    size_t head = min((uint64_t)sample, coveredBytes);
+    size_t tail = min((uint64_t)sample, coveredBytes - head);
+    bool ok = pread(fd, buffer, head, 0) == (ssize_t)head &&
+              pread(fd, buffer + head, tail, coveredBytes - tail) == (ssize_t)tail;
+    close(fd);
+    if (!ok) {
+        return 0;
+    }
+    
+    uint64_t identity[3] = {(uint64_t)info.st_dev, (uint64_t)info.st_ino, coveredBytes};
+    uint64_t hash = hashBytes((const char*)identity, sizeof(identity), 14695981039346656037ULL);
+    return max((uint64_t)1, hashBytes(buffer, head + tail, hash));
+}
+
+// records.txt -> records.bin
+string binaryLedgerName(const string& textFile) {
+    size_t dot = textFile.rfind('.');
+    if (dot == string::npos || textFile.find('/', dot) != string::npos) {
+        return textFile + ".bin";
+    }
+    return textFile.substr(0, dot) + ".bin";
+}
+
+// Month name to 0-11, or -1 if it is not a month
+int monthIndex(string_view month) {
+    for (int i = 0; i < 12; i++) {
+        if (month == MONTH_NAMES[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A billing period from records.txt: YYYY-MM, or a bare month name as written
+// before periods had years, which reads as year 0. -1 if it is neither.
+int parsePeriod(string_view text) {
+    int year = 0, month = 0;
+    if (text.length() == 7 && text[4] == '-' &&
+        from_chars(text.data(), text.data() + 4, year).ptr == text.data() + 4 &&
+        from_chars(text.data() + 5, text.data() + 7, month).ptr == text.data() + 7) {
+        return (year > 0 && month >= 1 && month <= 12) ? makePeriod(year, month - 1) : -1;
+    }
+    return monthIndex(text);
+}
+
+// A period typed by a user: YYYY-MM, or a month (1-12 or its name) of the current year
+int periodArgument(string_view text) {
+    int month;
+    if (parseNumber(text, month)) {
+        return (month >= 1 && month <= 12) ? makePeriod(currentPeriod() / 12, month - 1) : -1;
+    }
+    int period = parsePeriod(text);
+    return (period >= 0 && period < 12) ? makePeriod(currentPeriod() / 12, period) : period;
+}
+
+// Write YYYY-MM, without a terminator, and return the end
+char* formatPeriod(char* out, int period) {
+    int year = period / 12, month = period % 12 + 1;
+    out[0] = '0' + year / 1000 % 10;
+    out[1] = '0' + year / 100 % 10;
+    out[2] = '0' + year / 10 % 10;
+    out[3] = '0' + year % 10;
+    out[4] = '-';
+    out[5] = '0' + month / 10;
+    out[6] = '0' + month % 10;
+    return out + 7;
+}
+
+string periodText(int period) {
+    char text[8];
+    return string(text, formatPeriod(text, period));
+}
+
+// "March 2025" for display; just the month for a period without a year
+string periodName(int period) {
+    if (period < 0) {
+        return "Unknown";
+    }
+    return (period < 12) ? MONTH_NAMES[period] : MONTH_NAMES[period % 12] + " " + to_string(period / 12);
+}
+
+// True if the first record of textFile has a month without a year
+bool recordsNeedPeriods(const string& textFile) {
+    LineScanner scanner(textFile, 0, 4096);
+    BillingRecord record;
+    string_view line;
+    while (scanner.next(line)) {
+        if (parseBillingRecord(line, record)) {
+            return record.period >= 0 && record.period < 12;
+        }
+    }
+    return false;
+}
+
+// Give every record written with a bare month name a year. A meter's records are
+// in billing order, so its year goes up wherever its month does not; the last of
+// them is placed in anchorYear, or (anchorYear 0) in the last year that makes it
+// no later than today, or just before the meter's first record with a year.
+// Two passes: the first counts the year changes of each meter, the second builds
+// the new records.txt. Both run inside wal.rewrite(), which holds the log's flock
+// from the scan to the rename, so no other process's append is lost. The old file
+// is kept as records.txt.bak, and files derived from byte offsets in it
+// (records.bin, records.col, stats.idx and the segments) are removed.
+bool migrateRecordPeriods(int anchorYear) {
+    struct MeterYears {
+        int wraps;
+        int lastMonth;
+        int firstDated;
+        int year;
+    };
+    const string textFile = "records.txt";
+    const string backupFile = textFile + ".bak";
+    unordered_map<string, MeterYears, TextHash, TextEqual> meters;
+    size_t legacy = 0;
+    size_t beforeDated = 0;
+    int today = currentPeriod();
+    
+    bool ok = wal.rewrite(WAL_RECORDS, [&](string_view current, string& migrated) {
+        BillingRecord record;
+        string meterKey;
+        string_view line;
+        
+        NewlineSplitter counter(current.data(), current.size());
+        while (counter.next(line)) {
+            if (!parseBillingRecord(line, record) || record.period < 0) {
+                continue;
+            }
+            LedgerIndex::key(record.username, record.meterSerial, meterKey);
+            unordered_map<string, MeterYears, TextHash, TextEqual>::iterator it = meters.find(meterKey);
+            if (it == meters.end()) {
+                MeterYears fresh = {0, -1, -1, 0};
+                it = meters.emplace(meterKey, fresh).first;
+            }
+            MeterYears& years = it->second;
+            if (record.period >= 12) {
+                if (years.firstDated < 0) {
+                    years.firstDated = record.period;
+                }
+            } else {
+                if (years.lastMonth >= 0 && record.period <= years.lastMonth) {
+                    years.wraps++;
+                }
+                years.lastMonth = record.period;
+                legacy++;
+            }
+        }
+        if (legacy == 0) {
+            return false;   // nothing to migrate; the file is left alone
+        }
+        
+        for (unordered_map<string, MeterYears, TextHash, TextEqual>::iterator it = meters.begin(); it != meters.end(); it++) {
+            MeterYears& years = it->second;
+            int last;
+            if (years.lastMonth < 0) {
+                continue;
+            }
+            if (years.firstDated >= 0) {
+                beforeDated++;
+                last = years.firstDated - 1 - ((years.firstDated - 1 - years.lastMonth) % 12 + 12) % 12;
+            } else if (anchorYear > 0) {
+                last = makePeriod(anchorYear, years.lastMonth);
+            } else {
+                last = makePeriod(today / 12, years.lastMonth);
+                if (last > today) {
+                    last -= 12;
+                }
+            }
+            years.year = last / 12 - years.wraps;   // the year of the meter's first record
+            years.lastMonth = -1;
+        }
+        
+        // Keep the old ledger so a wrong guess at the year can be undone
+        ofstream backup(backupFile.c_str(), ios::binary | ios::trunc);
+        backup.write(current.data(), current.size());
+        backup.close();
+        if (!backup) {
+            cout << "Unable to keep a copy of " << textFile << " as " << backupFile << "\n";
+            remove(backupFile.c_str());
+            return false;
+        }
+        
+        NewlineSplitter lines(current.data(), current.size());
+        migrated.reserve(current.size() + legacy * 5);
+        while (lines.next(line)) {
+            if (parseBillingRecord(line, record) && record.period >= 0 && record.period < 12) {
+                LedgerIndex::key(record.username, record.meterSerial, meterKey);
+                MeterYears& years = meters.find(meterKey)->second;
+                if (years.lastMonth >= 0 && record.period <= years.lastMonth) {
+                    years.year++;
+                }
+                years.lastMonth = record.period;
+                record.period = makePeriod(years.year, record.period);
+                formatBillingRecord(migrated, record);
+            } else {
+                migrated.append(line.data(), line.length());
+                if (line.data() + line.length() < current.data() + current.size()) {
+                    migrated += '\n';
+                }
+            }
+        }
+        return true;
+    });
+    if (legacy == 0) {
+        return true;
+    }
+    if (!ok) {
+        cout << "Unable to write " << textFile << "\n";
+        return false;
+    }
+    
+    remove(binaryLedgerName(textFile).c_str());
+    remove(columnStoreName(textFile).c_str());
+    remove("stats.idx");
+    ledgerSegments.clear();
+    cout << "Gave " << legacy << " records of " << meters.size() << " meters a billing year in " << textFile << "\n";
+    if (anchorYear > 0) {
+        cout << "Assumed each meter's last month without a year is in " << anchorYear << "\n";
+    } else {
+        cout << "Assumed each meter's last month without a year is the latest such month up to "
+             << periodName(today) << "\n";
+    }
+    if (beforeDated > 0) {
+        cout << beforeDated << " meters were placed just before their first record with a year\n";
+    }
+    cout << "The old file is kept as " << backupFile << "; restore it and run --migrate-periods year "
+         << "to choose another year\n";
+    return true;
+}
+
+// Parse an amount such as "1700.00" into paisa without going through floating point
+bool parseAmountPaisa(string_view text, int64_t& paisa) {
+    size_t i = 0;
+    bool negative = false;
+    int64_t rupees = 0;
+    int64_t fraction = 0;
+    int decimals = 0;
+    
+    if (i < text.length() && text[i] == '-') {
+        negative = true;
+        i++;
+    }
+    if (i == text.length()) {
+        return false;
+    }
+    for (; i < text.length() && text[i] != '.'; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        rupees = rupees * 10 + (text[i] - '0');
+    }
+    if (i < text.length()) {
+        for (i++; i < text.length(); i++) {
+            if (text[i] < '0' || text[i] > '9' || decimals == 2) {
+                return false;
+            }
+            fraction = fraction * 10 + (text[i] - '0');
+            decimals++;
+        }
+    }
+    if (decimals == 1) {
+        fraction *= 10;
+    }
+    
+    paisa = rupees * 100 + fraction;
+    if (negative) {
+        paisa = -paisa;
+    }
+    return true;
+}
+
+// Paisa back to the two-decimal text written by saveBillingRecord
+string formatPaisa(int64_t paisa) {
+    char text[32];
+    uint64_t magnitude = (paisa < 0) ? -(uint64_t)paisa : (uint64_t)paisa;
+    
+    snprintf(text, sizeof(text), "%s%llu.%02llu", (paisa < 0) ? "-" : "",
+             (unsigned long long)(magnitude / 100), (unsigned long long)(magnitude % 100));
+    return text;
+}
+
+// Visit every record, or only username's records when it is non-empty, in file order.
+// When records.bin covers a prefix of records.txt that prefix is read from the mapping
+// and only the text appended after it is parsed. records.txt is append-only, so a
+// binary file whose coverage is not larger than the text file is still valid.
+bool forEachBillingRecord(const string& textFile, const string& username,
+                          const function<void(const BillingRecord&)>& visit) {
+    PF_TIMED(METRIC_SCAN_RECORDS);
+    BillingRecord record;
+    BinaryLedger binary;
+    uint64_t textOffset = 0;
+    
+    if (fileSize(textFile) < 0) {
+        return false;
+    }
+    
+    if (binary.open(binaryLedgerName(textFile)) &&
+        binary.sourceBytes() <= (uint64_t)fileSize(textFile)) {
+        uint32_t userId = 0;
+        bool allUsers = username.empty();
+        
+        if (allUsers || binary.findSymbol(username, userId)) {
+            for (const CompactRecord* row = binary.begin(); row != binary.end(); row++) {
+                if (allUsers || row->userId == userId) {
+                    binary.toRecord(*row, record);
+                    visit(record);
+                }
+            }
+        }
+        textOffset = binary.sourceBytes();
+    }
+    
+    LineScanner scanner(textFile, textOffset);
+    string_view line;
+    while (scanner.next(line)) {
+        if (parseBillingRecord(line, record) && (username.empty() || record.username == username)) {
+            visit(record);
+        }
+    }
+    PF_COUNT(COUNTER_LEDGER_BYTES_SCANNED, scanner.offset() - textOffset);
+    return scanner.isOpen();
+}
+
+// Split a line at spaces and tabs into at most maxFields fields; returns how many were found
+size_t splitRecordFields(string_view line, string_view* fields, size_t maxFields) {
+    size_t count = 0;
+    size_t pos = 0;
+    
+    while (count < maxFields) {
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\r')) {
+            pos++;
+        }
+        if (pos == line.size()) {
+            break;
+        }
+        size_t start = pos;
+        while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t' && line[pos] != '\r') {
+            pos++;
+        }
+        fields[count++] = line.substr(start, pos - start);
+    }
+    return count;
+}
+
+bool parseNumber(string_view text, int& value) {
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+bool parseNumber(string_view text, double& value) {
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// Parse one line of records.txt without a stream. The strings of record keep their
+// capacity between calls, so a scan reusing one record does not allocate per line.
+bool parseBillingRecord(string_view line, BillingRecord& record) {
+    string_view fields[7];
+    
+    if (splitRecordFields(line, fields, 7) != 7 ||
+        !parseNumber(fields[3], record.previousReading) || !parseNumber(fields[4], record.currentReading) ||
+        !parseNumber(fields[5], record.unitsConsumed) || !parseNumber(fields[6], record.totalBill)) {
+        return false;
+    }
+    record.username.assign(fields[0]);
+    record.meterSerial.assign(fields[1]);
+    record.period = parsePeriod(fields[2]);
+    return true;
+}
+
+SymbolTable::SymbolTable(pmr::memory_resource* memory) : ids(memory), names(memory) {
+}
+
+uint32_t SymbolTable::intern(string_view text) {
+    pmr::unordered_map<string_view, uint32_t>::const_iterator it = ids.find(text);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    
+    uint32_t id = names.size();
+    names.emplace_back(text);
+    ids.emplace(string_view(names.back()), id);
+    return id;
+}
+
+bool SymbolTable::find(string_view text, uint32_t& id) const {
+    pmr::unordered_map<string_view, uint32_t>::const_iterator it = ids.find(text);
+    if (it == ids.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+string_view SymbolTable::name(uint32_t id) const {
+    return names[id];
+}
+
+size_t SymbolTable::size() const {
+    return names.size();
+}
+
+MappedFile::MappedFile() : bytes(NULL), length(0) {
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const string& fileName) {
+    close();
+    
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    
+    bytes = (const char*)mapping;
+    length = info.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (bytes != NULL) {
+        munmap((void*)bytes, length);
+        bytes = NULL;
+        length = 0;
+    }
+}
+
+LineScanner::LineScanner(const string& fileName, uint64_t offset, size_t blockSize)
+    : begin(0), end(0), position(offset), lastTerminated(true), atEnd(false) {
+    struct stat info;
+    
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd >= 0 && (fstat(fd, &info) != 0 || lseek(fd, offset, SEEK_SET) < 0)) {
+        ::close(fd);
+        fd = -1;
+    }
+    // A short tail, such as the few records appended since the last refresh,
+    // only needs a small buffer
+    uint64_t remaining = (fd >= 0 && (uint64_t)info.st_size > offset) ? info.st_size - offset : 0;
+    buffer.resize(max((size_t)4096, (size_t)min((uint64_t)blockSize, remaining + 1)));
+}
+
+LineScanner::~LineScanner() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+// The next line without its '\n'. A last line with no '\n' is returned too,
+// with terminated() false, so callers can decide whether to trust it.
+bool LineScanner::next(string_view& line) {
+    while (fd >= 0) {
+        const char* newline = (const char*)memchr(buffer.data() + begin, '\n', end - begin);
+        if (newline != NULL) {
+            size_t length = newline - (buffer.data() + begin);
+            line = string_view(buffer.data() + begin, length);
+            begin += length + 1;
+            position += length + 1;
+            lastTerminated = true;
+            return true;
+        }
+        if (atEnd) {
+            if (begin == end) {
+                return false;
+            }
+            line = string_view(buffer.data() + begin, end - begin);
+            position += end - begin;
+            begin = end;
+            lastTerminated = false;
+            return true;
+        }
+        
+        // Move the partial line to the front and refill; a line longer than the
+        // buffer doubles it
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t got = read(fd, buffer.data() + end, buffer.size() - end);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            atEnd = true;
+        } else {
+            end += got;
+        }
+    }
+    return false;
+}
+
+ScanArena::ScanArena(size_t firstBlockBytes) : arena(firstBlockBytes, &upstream) {
+}
+
+void* ScanArena::BlockSource::do_allocate(size_t size, size_t alignment) {
+    blocks++;
+    bytes += size;
+    return pmr::new_delete_resource()->allocate(size, alignment);
+}
+
+void ScanArena::BlockSource::do_deallocate(void* block, size_t size, size_t alignment) {
+    blocks--;
+    bytes -= size;
+    pmr::new_delete_resource()->deallocate(block, size, alignment);
+}
+
+bool BinaryLedger::open(const string& fileName) {
+    rows = NULL;
+    count = 0;
+    coveredBytes = 0;
+    symbols.clear();
+    symbolIds.clear();
+    
+    if (!file.open(fileName) || file.size() < sizeof(BinaryLedgerHeader)) {
+        return false;
+    }
+    
+    const BinaryLedgerHeader* header = (const BinaryLedgerHeader*)file.data();
+    if (memcmp(header->magic, "PFRB", 4) != 0 || header->version != 3 ||
+        header->rowCount > file.size() / sizeof(CompactRecord) ||
+        header->symbolOffset != sizeof(BinaryLedgerHeader) + header->rowCount * sizeof(CompactRecord) ||
+        header->symbolOffset > file.size()) {
+        file.close();
+        return false;
+    }
+    
+    // The symbol table is the only part that needs decoding up front
+    const char* cursor = file.data() + header->symbolOffset;
+    const char* limit = file.data() + file.size();
+    for (uint64_t i = 0; i < header->symbolCount; i++) {
+        uint32_t length;
+        if (limit - cursor < 4) {
+            file.close();
+            return false;
+        }
+        memcpy(&length, cursor, 4);
+        cursor += 4;
+        if ((uint64_t)(limit - cursor) < length) {
+            file.close();
+            return false;
+        }
+        symbols.push_back(string_view(cursor, length));
+        symbolIds.emplace(symbols.back(), (uint32_t)i);
+        cursor += length;
+    }
+    
+    // toRecord indexes the symbol table with these ids, so check them once here
+    rows = (const CompactRecord*)(file.data() + sizeof(BinaryLedgerHeader));
+    for (uint64_t i = 0; i < header->rowCount; i++) {
+        if (rows[i].userId >= symbols.size() || rows[i].serialId >= symbols.size()) {
+            rows = NULL;
+            symbols.clear();
+            symbolIds.clear();
+            file.close();
+            return false;
+        }
+    }
+    count = header->rowCount;
+    coveredBytes = header->sourceBytes;
+    return true;
+}
+
+bool BinaryLedger::findSymbol(const string& text, uint32_t& id) const {
+    unordered_map<string_view, uint32_t>::const_iterator it = symbolIds.find(string_view(text));
+    if (it == symbolIds.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+void BinaryLedger::toRecord(const CompactRecord& row, BillingRecord& record) const {
+    record.username.assign(symbols[row.userId].data(), symbols[row.userId].size());
+    record.meterSerial.assign(symbols[row.serialId].data(), symbols[row.serialId].size());
+    record.period = row.period;
+    record.previousReading = row.previousReading;
+    record.currentReading = row.currentReading;
+    record.unitsConsumed = row.unitsConsumed();
+    record.totalBill = row.amountPaisa / 100.0;
+}
+
+// Convert records.txt to records.bin; written to a temporary file and renamed into place
+bool convertRecordsToBinary(const string& textFile, const string& binaryFile) {
+    ifstream inFile(textFile.c_str());
+    if (!inFile.is_open()) {
+        cout << "Unable to open " << textFile << "\n";
+        return false;
+    }
+    
+    SymbolTable symbols;
+    vector<CompactRecord> rows;
+    CompactRecord row;
+    string username, serial, period, amount;
+    int previous, current, units;
+    int64_t paisa;
+    uint64_t covered = 0;
+    
+    memset(&row, 0, sizeof(row));
+    while (inFile >> username >> serial >> period >> previous >> current >> units >> amount) {
+        int index = parsePeriod(period);
+        if (index < 0 || units != current - previous || !parseAmountPaisa(amount, paisa)) {
+            cout << "Unsupported record after byte " << covered << " of " << textFile << "\n";
+            return false;
+        }
+        row.userId = symbols.intern(username);
+        row.serialId = symbols.intern(serial);
+        row.previousReading = previous;
+        row.currentReading = current;
+        row.amountPaisa = paisa;
+        row.period = index;
+        rows.push_back(row);
+        
+        inFile.ignore(numeric_limits<streamsize>::max(), '\n');
+        covered = inFile.eof() ? fileSize(textFile) : (uint64_t)inFile.tellg();
+    }
+    
+    BinaryLedgerHeader header;
+    memcpy(header.magic, "PFRB", 4);
+    header.version = 3;
+    header.rowCount = rows.size();
+    header.symbolCount = symbols.size();
+    header.symbolOffset = sizeof(header) + rows.size() * sizeof(CompactRecord);
+    header.sourceBytes = covered;
+    
+    string tempFile = binaryFile + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::binary | ios::trunc);
+    outFile.write((const char*)&header, sizeof(header));
+    if (!rows.empty()) {
+        outFile.write((const char*)&rows[0], rows.size() * sizeof(CompactRecord));
+    }
+    for (size_t i = 0; i < symbols.size(); i++) {
+        uint32_t length = symbols.name(i).length();
+        outFile.write((const char*)&length, 4);
+        outFile.write(symbols.name(i).data(), length);
+    }
+    outFile.close();
+    
+    if (!outFile || rename(tempFile.c_str(), binaryFile.c_str()) != 0) {
+        cout << "Unable to write " << binaryFile << "\n";
+        remove(tempFile.c_str());
+        return false;
+    }
+    
+    cout << "Converted " << rows.size() << " records (" << symbols.size()
+         << " symbols) into " << binaryFile << "\n";
+    return true;
+}
+
+// Re-read the covered part of the text file and compare it with the binary rows
+// field by field, then print both sets of totals in exact paisa
+int verifyBinaryLedger(const string& textFile, const string& binaryFile) {
+    BinaryLedger binary;
+    if (!binary.open(binaryFile)) {
+        cout << "Unable to open " << binaryFile << "\n";
+        return 1;
+    }
+    
+    ifstream inFile(textFile.c_str());
+    string username, serial, period, amount;
+    int previous, current, units;
+    int64_t paisa;
+    int64_t textUnits = 0, textPaisa = 0, binaryUnits = 0, binaryPaisa = 0;
+    size_t textRows = 0, mismatches = 0;
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    while ((uint64_t)inFile.tellg() < binary.sourceBytes() &&
+           inFile >> username >> serial >> period >> previous >> current >> units >> amount) {
+        inFile.ignore(numeric_limits<streamsize>::max(), '\n');
+        if (!parseAmountPaisa(amount, paisa)) {
+            paisa = 0;
+            mismatches++;
+        }
+        
+        if (textRows < binary.rowCount()) {
+            const CompactRecord& row = binary.begin()[textRows];
+            if (binary.symbol(row.userId) != username || binary.symbol(row.serialId) != serial ||
+                row.period != parsePeriod(period) || row.previousReading != previous ||
+                row.currentReading != current || row.unitsConsumed() != units || row.amountPaisa != paisa) {
+                mismatches++;
+            }
+        }
+        
+        textRows++;
+        textUnits += units;
+        textPaisa += paisa;
+    }
+    double textMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    start = chrono::steady_clock::now();
+    for (const CompactRecord* row = binary.begin(); row != binary.end(); row++) {
+        binaryUnits += row->unitsConsumed();
+        binaryPaisa += row->amountPaisa;
+    }
+    double binaryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << fixed << setprecision(2);
+    cout << "text   : " << textRows << " records, " << textUnits << " units, Rs. "
+         << formatPaisa(textPaisa) << " (" << textMs << " ms)\n";
+    cout << "binary : " << binary.rowCount() << " records, " << binaryUnits << " units, Rs. "
+         << formatPaisa(binaryPaisa) << " (" << binaryMs << " ms)\n";
+    
+    if (mismatches > 0 || textRows != binary.rowCount() || textUnits != binaryUnits || textPaisa != binaryPaisa) {
+        cout << "MISMATCH: " << mismatches << " differing records\n";
+        return 1;
+    }
+    cout << "Binary ledger matches " << textFile << "\n";
+    return 0;
+}
+
+// Split "serial,currentReading"; surrounding spaces and a trailing \\r are ignored
+bool parseReadingLine(const char* line, size_t length, string& meterSerial, int& currentReading) {
+    const char* end = line + length;
+    const char* comma = (const char*)memchr(line, ',', length);
+    if (comma == NULL) {
+        return false;
+    }
+    
+    const char* first = line;
+    const char* last = comma;
+    while (first < last && (*first == ' ' || *first == '\t')) {
+        first++;
+    }
+    while (last > first && (last[-1] == ' ' || last[-1] == '\t')) {
+        last--;
+    }
+    if (first == last) {
+        return false;
+    }
+    meterSerial.assign(first, last - first);
+    
+    const char* digit = comma + 1;
+    while (digit < end && (*digit == ' ' || *digit == '\t')) {
+        digit++;
+    }
+    long long value = 0;
+    const char* start = digit;
+    while (digit < end && *digit >= '0' && *digit <= '9' && value <= numeric_limits<int>::max()) {
+        value = value * 10 + (*digit - '0');
+        digit++;
+    }
+    while (digit < end && (*digit == ' ' || *digit == '\t' || *digit == '\r')) {
+        digit++;
+    }
+    if (digit == start || digit != end || value > numeric_limits<int>::max()) {
+        return false;
+    }
+    currentReading = value;
+    return true;
+}
+
+// Append one records.txt line: username serial period previous current units bill
+void formatBillingRecord(string& out, const BillingRecord& record) {
+    BillRunItem item;
+    item.tariff = NULL;
+    item.username = record.username;
+    item.meterSerial = &record.meterSerial;
+    item.period = record.period;
+    item.previousReading = record.previousReading;
+    item.currentReading = record.currentReading;
+    item.unitsConsumed = record.unitsConsumed;
+    item.totalBill = record.totalBill;
+    formatBillingRecord(out, item);
+}
+
+// Same layout; %.2f rounds exactly like the fixed/setprecision(2) stream output
+void formatBillingRecord(string& out, const BillRunItem& item) {
+    char numbers[96];
+    char* period = formatPeriod(numbers, item.period);
+    int length = snprintf(period, sizeof(numbers) - 7, " %d %d %d %.2f\n", item.previousReading,
+                          item.currentReading, item.unitsConsumed, item.totalBill);
+    
+    out += item.username;
+    out += ' ';
+    out += *item.meterSerial;
+    out += ' ';
+    out.append(numbers, 7 + length);
+}
+
+// FNV-1a, used to compare bill-run outputs without keeping them around
+uint64_t hashBytes(const char* data, size_t length, uint64_t hash) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+WorkerPool::WorkerPool(int threads) : workers(max(1, threads)), job(NULL), generation(0), pending(0), stopping(false) {
+    for (int i = 1; i < workers; i++) {
+        this->threads.push_back(thread(&WorkerPool::work, this, i));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void WorkerPool::run(const function<void(int worker)>& task) {
+    if (workers == 1) {
+        task(0);
+        return;
+    }
+    
+    {
+        lock_guard<mutex> guard(lock);
+        job = &task;
+        pending = workers - 1;
+        generation++;
+    }
+    wake.notify_all();
+    
+    task(0);
+    
+    unique_lock<mutex> guard(lock);
+    finished.wait(guard, [this] { return pending == 0; });
+    job = NULL;
+}
+
+void WorkerPool::work(int worker) {
+    unsigned long seen = 0;
+    
+    while (true) {
+        const function<void(int)>* task;
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            task = job;
+        }
+        
+        (*task)(worker);
+        
+        lock_guard<mutex> guard(lock);
+        if (--pending == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+// Bill every meter in a readings file without prompting.
+//
+// The file is read in large blocks. For each block the lines are parsed in
+// parallel, then every worker bills the meters whose serial hashes to its shard,
+// in file order, so readings of one meter chain correctly without any locking:
+// the shared indexes are only read, and each worker keeps the meters it billed
+// during the run in its own map. Each worker formats into its own buffer; the
+// buffers are merged back into file order, so the output does not depend on the
+// number of threads. The whole run is appended to records.txt with one write.
+int runBillRun(const BillRunOptions& options, BillRunReport& report) {
+    const size_t blockSize = 8 << 20;
+    const int threads = max(1, options.threads);
+    BillRunTimings& timings = report.timings;
+    chrono::steady_clock::time_point runStart = chrono::steady_clock::now();
+    
+    report = BillRunReport();
+    report.outputHash = 14695981039346656037ULL;
+    
+    ifstream inFile(options.readingsFile.c_str(), ios::binary);
+    if (!inFile.is_open()) {
+        cout << "Unable to open " << options.readingsFile << "\n";
+        return 1;
+    }
+    
+    int firstPeriod = periodArgument(options.firstPeriod);
+    if (firstPeriod < 0) {
+        cout << "Unknown month: " << options.firstPeriod << "\n";
+        return 1;
+    }
+    if (!plausibleFirstYear(firstPeriod / 12)) {
+        cout << "First billing month " << periodName(firstPeriod) << " is too far from today\n";
+        return 1;
+    }
+    
+    // Load the indexes and tariffs up front; the workers below only read them
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    userStore.size();
+    ledgerIndex.size();
+    tariffBook.forArea("");
+    timings.loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    WorkerPool pool(threads);
+    vector<unordered_map<string, MeterState> > runStates(threads);
+    vector<vector<vector<uint32_t> > > shardRows(threads, vector<vector<uint32_t> >(threads));
+    vector<vector<pair<size_t, string> > > errors(threads);
+    vector<string> workerOutput(threads);
+    vector<double> resolveMs(threads), calculateMs(threads), formatMs(threads);
+    vector<BillRunRow> rows;
+    vector<size_t> lineStarts;
+    vector<uint32_t> rowWorker, rowOffset, rowLength;
+    vector<size_t> outputOffset;
+    string block;
+    string output;
+    size_t lineBase = 0;
+    bool more = true;
+    
+    while (more) {
+        // Read a block of whole lines; a partial last line is carried into the next block
+        start = chrono::steady_clock::now();
+        size_t carried = block.size();
+        block.resize(carried + blockSize);
+        inFile.read(&block[carried], blockSize);
+        block.resize(carried + inFile.gcount());
+        more = (inFile.gcount() > 0);
+        
+        size_t usable = block.size();
+        if (more) {
+            size_t lastNewline = block.rfind('\n');
+            usable = (lastNewline == string::npos) ? 0 : lastNewline + 1;
+        }
+        
+        lineStarts.clear();
+        for (size_t pos = 0; pos < usable;) {
+            lineStarts.push_back(pos);
+            const char* newline = (const char*)memchr(block.data() + pos, '\n', usable - pos);
+            pos = (newline == NULL) ? usable : (newline - block.data()) + 1;
+        }
+        size_t lineCount = lineStarts.size();
+        lineStarts.push_back(usable);
+        if (rows.size() < lineCount) {
+            rows.resize(lineCount);
+        }
+        timings.readMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        // Parse: each worker takes a contiguous range of lines and sorts them into shards
+        start = chrono::steady_clock::now();
+        pool.run([&](int worker) {
+            size_t begin = lineCount * worker / threads;
+            size_t end = lineCount * (worker + 1) / threads;
+            hash<string> hasher;
+            
+            for (int shard = 0; shard < threads; shard++) {
+                shardRows[worker][shard].clear();
+            }
+            for (size_t i = begin; i < end; i++) {
+                const char* line = block.data() + lineStarts[i];
+                size_t length = lineStarts[i + 1] - lineStarts[i];
+                while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                    length--;
+                }
+                
+                BillRunRow& row = rows[i];
+                row.valid = false;
+                if (length == 0) {
+                    continue;
+                }
+                if (!parseReadingLine(line, length, row.meterSerial, row.currentReading)) {
+                    // The first line may be a header
+                    if (lineBase + i > 0) {
+                        errors[worker].push_back(make_pair(lineBase + i + 1, options.readingsFile + ":" +
+                                                 to_string(lineBase + i + 1) + ": malformed line"));
+                    }
+                    continue;
+                }
+                row.valid = true;
+                shardRows[worker][hasher(row.meterSerial) % threads].push_back(i);
+            }
+        });
+        timings.parseMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        // Process: worker w bills shard w, visiting the ranges in order to keep file order
+        start = chrono::steady_clock::now();
+        rowWorker.assign(lineCount, 0);
+        rowOffset.assign(lineCount, 0);
+        rowLength.assign(lineCount, 0);
+        pool.run([&](int worker) {
+            vector<BillRunItem> items;
+            vector<uint32_t> itemRows;
+            vector<int> units;
+            vector<double> bills;
+            string meterKey;
+            
+            chrono::steady_clock::time_point stageStart = chrono::steady_clock::now();
+            for (int range = 0; range < threads; range++) {
+                const vector<uint32_t>& mine = shardRows[range][worker];
+                for (size_t k = 0; k < mine.size(); k++) {
+                    BillRunRow& row = rows[mine[k]];
+                    size_t lineNumber = lineBase + mine[k] + 1;
+                    string_view owner = userStore.ownerOfSerial(row.meterSerial);
+                    if (owner.empty()) {
+                        errors[worker].push_back(make_pair(lineNumber, "Unknown meter serial " + row.meterSerial));
+                        continue;
+                    }
+                    
+                    LedgerIndex::key(owner, row.meterSerial, meterKey);
+                    unordered_map<string, MeterState>::iterator run = runStates[worker].find(meterKey);
+                    const MeterState* state = (run != runStates[worker].end()) ? &run->second : ledgerIndex.latestByKey(meterKey);
+                    
+                    UserView user;
+                    userStore.view(owner, user);
+                    BillRunItem item;
+                    item.tariff = &tariffBook.forArea(user.residentialArea);
+                    item.username = owner;
+                    item.meterSerial = &row.meterSerial;
+                    item.currentReading = row.currentReading;
+                    if (state != NULL) {
+                        item.period = nextPeriod(state->lastPeriod);
+                        item.previousReading = state->lastReading;
+                    } else {
+                        item.period = firstPeriod;
+                        item.previousReading = 0;
+                    }
+                    
+                    if (item.currentReading < item.previousReading) {
+                        errors[worker].push_back(make_pair(lineNumber, "Meter " + row.meterSerial + ": current reading " +
+                                                 to_string(item.currentReading) + " is below previous reading " +
+                                                 to_string(item.previousReading)));
+                        continue;
+                    }
+                    
+                    MeterState& next = (run != runStates[worker].end()) ? run->second : runStates[worker][meterKey];
+                    next.lastReading = item.currentReading;
+                    next.lastPeriod = item.period;
+                    items.push_back(item);
+                    itemRows.push_back(mine[k]);
+                }
+            }
+            chrono::steady_clock::time_point stageEnd = chrono::steady_clock::now();
+            resolveMs[worker] += chrono::duration<double, milli>(stageEnd - stageStart).count();
+            
+            // Meters on the built-in tariff go through the vector kernel together
+            stageStart = stageEnd;
+            units.clear();
+            for (size_t i = 0; i < items.size(); i++) {
+                items[i].unitsConsumed = items[i].currentReading - items[i].previousReading;
+                if (items[i].tariff->isDefault()) {
+                    units.push_back(items[i].unitsConsumed);
+                } else {
+                    items[i].totalBill = items[i].tariff->bill(items[i].unitsConsumed);
+                }
+            }
+            bills.resize(units.size());
+            calculateBills(units.data(), bills.data(), units.size());
+            for (size_t i = 0, next = 0; i < items.size(); i++) {
+                if (items[i].tariff->isDefault()) {
+                    items[i].totalBill = bills[next++];
+                }
+            }
+            stageEnd = chrono::steady_clock::now();
+            calculateMs[worker] += chrono::duration<double, milli>(stageEnd - stageStart).count();
+            
+            stageStart = stageEnd;
+            string& out = workerOutput[worker];
+            out.clear();
+            for (size_t i = 0; i < items.size(); i++) {
+                size_t before = out.size();
+                formatBillingRecord(out, items[i]);
+                rowWorker[itemRows[i]] = worker;
+                rowOffset[itemRows[i]] = before;
+                rowLength[itemRows[i]] = out.size() - before;
+            }
+            formatMs[worker] += chrono::duration<double, milli>(chrono::steady_clock::now() - stageStart).count();
+        });
+        timings.processMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        // Merge: place every row's text at its file-order position
+        start = chrono::steady_clock::now();
+        outputOffset.resize(lineCount + 1);
+        size_t base = output.size();
+        outputOffset[0] = base;
+        for (size_t i = 0; i < lineCount; i++) {
+            outputOffset[i + 1] = outputOffset[i] + rowLength[i];
+            if (rowLength[i] > 0) {
+                report.billed++;
+            }
+        }
+        output.resize(outputOffset[lineCount]);
+        pool.run([&](int worker) {
+            size_t begin = lineCount * worker / threads;
+            size_t end = lineCount * (worker + 1) / threads;
+            for (size_t i = begin; i < end; i++) {
+                if (rowLength[i] > 0) {
+                    memcpy(&output[outputOffset[i]], workerOutput[rowWorker[i]].data() + rowOffset[i], rowLength[i]);
+                }
+            }
+        });
+        report.outputHash = hashBytes(output.data() + base, output.size() - base, report.outputHash);
+        
+        vector<pair<size_t, string> > blockErrors;
+        for (int worker = 0; worker < threads; worker++) {
+            blockErrors.insert(blockErrors.end(), errors[worker].begin(), errors[worker].end());
+            errors[worker].clear();
+        }
+        sort(blockErrors.begin(), blockErrors.end());
+        report.rejected += blockErrors.size();
+        if (options.verbose) {
+            for (size_t i = 0; i < blockErrors.size(); i++) {
+                cerr << blockErrors[i].second << "\n";
+            }
+        }
+        timings.mergeMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        lineBase += lineCount;
+        block.erase(0, usable);
+    }
+    
+    for (int worker = 0; worker < threads; worker++) {
+        timings.resolveMs += resolveMs[worker];
+        timings.calculateMs += calculateMs[worker];
+        timings.formatMs += formatMs[worker];
+    }
+    report.bytes = output.size();
+    
+    // One append for the whole run, then bring the in-memory index up to date
+    if (options.appendToLedger) {
+        start = chrono::steady_clock::now();
+        if (!ledgerWriter.append(output) || !ledgerWriter.flush()) {
+            cout << "Error: unable to write records.txt\n";
+            return 1;
+        }
+        for (int worker = 0; worker < threads; worker++) {
+            for (unordered_map<string, MeterState>::const_iterator it = runStates[worker].begin();
+                 it != runStates[worker].end(); it++) {
+                ledgerIndex.set(it->first, it->second);
+            }
+        }
+        timings.writeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+    
+    report.totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - runStart).count();
+    return 0;
+}
+
+void printBillRunReport(const BillRunReport& report, int threads) {
+    cout << fixed << setprecision(1);
+    cout << "Bill run: " << report.billed << " records billed, " << report.rejected << " rejected, "
+         << report.bytes << " bytes appended, " << threads << " thread(s)\n";
+    cout << "  load      " << setw(10) << report.timings.loadMs << " ms\n";
+    cout << "  read      " << setw(10) << report.timings.readMs << " ms\n";
+    cout << "  parse     " << setw(10) << report.timings.parseMs << " ms\n";
+    cout << "  process   " << setw(10) << report.timings.processMs << " ms\n";
+    cout << "    resolve " << setw(10) << report.timings.resolveMs << " ms (all workers)\n";
+    cout << "    calc    " << setw(10) << report.timings.calculateMs << " ms (all workers)\n";
+    cout << "    format  " << setw(10) << report.timings.formatMs << " ms (all workers)\n";
+    cout << "  merge     " << setw(10) << report.timings.mergeMs << " ms\n";
+    cout << "  write     " << setw(10) << report.timings.writeMs << " ms\n";
+    cout << "  total     " << setw(10) << report.totalMs << " ms ("
+         << setprecision(0) << (report.totalMs > 0 ? report.billed * 1000.0 / report.totalMs : 0.0) << " records/s)\n";
+}
+
+// Generate users and one reading per meter in a scratch directory, then time the
+// bill run (without appending) at 1, 2, 4, ... threads and check that every run
+// produced exactly the single-threaded output
+void benchmarkBillRun(int meters, int maxThreads) {
+    const string benchDir = "bench_bill_run";
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    
+    ofstream usersFile("users.txt");
+    ofstream readingsFile("readings.csv");
+    int userCount = 0;
+    for (int written = 0; written < meters; userCount++) {
+        User user = makeSyntheticUser(userCount);
+        writeUserBlock(usersFile, user);
+        readingsFile << user.meter1Serial << "," << (userCount * 7919) % 1000 << "\n";
+        written++;
+        if (user.numberOfMeters == 2 && written < meters) {
+            readingsFile << user.meter2Serial << "," << (userCount * 104729) % 1000 << "\n";
+            written++;
+        }
+    }
+    usersFile.close();
+    readingsFile.close();
+    remove("records.txt");
+    userStore.size();
+    ledgerIndex.size();
+    
+    cout << "Bill run over " << meters << " meters (" << userCount << " users), "
+         << thread::hardware_concurrency() << " hardware threads\n";
+    cout << setw(8) << "threads" << setw(14) << "process ms" << setw(12) << "total ms"
+         << setw(16) << "records/s" << setw(10) << "speedup" << setw(10) << "output\n";
+    
+    double baseProcess = 0;
+    uint64_t baseHash = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        BillRunOptions options;
+        BillRunReport report;
+        options.readingsFile = "readings.csv";
+        options.firstPeriod = "2025-01";
+        options.threads = threads;
+        options.appendToLedger = false;
+        options.verbose = false;
+        runBillRun(options, report);
+        
+        double processMs = report.timings.parseMs + report.timings.processMs + report.timings.mergeMs;
+        if (threads == 1) {
+            baseProcess = processMs;
+            baseHash = report.outputHash;
+        }
+        cout << fixed << setprecision(1) << setw(8) << threads << setw(14) << processMs
+             << setw(12) << report.totalMs << setprecision(0) << setw(16)
+             << (report.billed * 1000.0 / report.totalMs) << setprecision(2) << setw(10)
+             << (baseProcess / processMs) << setw(10) << (report.outputHash == baseHash ? "same" : "DIFFERS") << "\n";
+    }
+    
+    remove("users.txt");
+    remove("users.idx");
+    remove("readings.csv");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
+}
+
+// The built-in tariff
+Tariff::Tariff() : fixedCharge(0.0), taxPercent(0.0), builtIn(true) {
+    for (size_t i = 0; i < sizeof(DEFAULT_SLABS) / sizeof(DEFAULT_SLABS[0]); i++) {
+        limits.push_back(DEFAULT_SLABS[i].upTo);
+        starts.push_back(DEFAULT_TARIFF.start[i]);
+        rates.push_back(DEFAULT_SLABS[i].rate);
+        cumulative.push_back(DEFAULT_TARIFF.cumulative[i]);
+    }
+}
+
+Tariff::Tariff(const vector<TariffSlab>& slabs, double fixedCharge, double taxPercent)
+    : fixedCharge(fixedCharge), taxPercent(taxPercent), builtIn(false) {
+    for (size_t i = 0; i < slabs.size(); i++) {
+        limits.push_back(slabs[i].upTo);
+        starts.push_back((i == 0) ? 0 : slabs[i - 1].upTo);
+        rates.push_back(slabs[i].rate);
+        cumulative.push_back((i == 0) ? 0.0 : cumulative[i - 1] + (starts[i] - starts[i - 1]) * rates[i - 1]);
+    }
+}
+
+double Tariff::energyCharge(int units) const {
+    if (builtIn) {
+        return DEFAULT_TARIFF.bill(units);
+    }
+    
+    // First slab whose limit is not below units; the last slab takes everything above
+    size_t slab = lower_bound(limits.begin(), limits.end() - 1, units) - limits.begin();
+    return cumulative[slab] + (units - starts[slab]) * rates[slab];
+}
+
+double Tariff::bill(int units) const {
+    double amount = energyCharge(units);
+    
+    if (fixedCharge != 0.0) {
+        amount += fixedCharge;
+    }
+    if (taxPercent != 0.0) {
+        amount += amount * taxPercent / 100.0;
+    }
+    return amount;
+}
+
+// Print one line per slab used, then the fixed charge and tax if the tariff has them
+void Tariff::printBreakdown(ostream& out, int units) const {
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+    size_t lastSlab = lower_bound(limits.begin(), limits.end() - 1, units) - limits.begin();
+    
+    out << fixed;
+    for (size_t i = 0; i <= lastSlab; i++) {
+        int slabUnits = ((i == lastSlab) ? units : limits[i]) - starts[i];
+        
+        if (lastSlab == 0) {
+            out << slabUnits << " units";
+        } else if (i == 0) {
+            out << "First " << slabUnits << " units";
+        } else if (i == limits.size() - 1) {
+            out << "Remaining " << slabUnits << " units";
+        } else {
+            out << "Next " << slabUnits << " units";
+        }
+        
+        out << " x Rs. " << setprecision(rates[i] == (int)rates[i] ? 0 : 2) << rates[i]
+            << " = Rs. " << setprecision(2) << (slabUnits * rates[i]) << "\n";
+    }
+    
+    double subtotal = energyCharge(units);
+    if (fixedCharge != 0.0) {
+        out << "Fixed charge = Rs. " << setprecision(2) << fixedCharge << "\n";
+        subtotal += fixedCharge;
+    }
+    if (taxPercent != 0.0) {
+        out << "Tax " << setprecision(taxPercent == (int)taxPercent ? 0 : 2) << taxPercent
+            << "% = Rs. " << setprecision(2) << (subtotal * taxPercent / 100.0) << "\n";
+    }
+    
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// area|fixed charge|tax percent|upTo:rate ... -:rate
+bool parseTariffLine(const string& line, string& area, Tariff& tariff) {
+    size_t first = line.find('|');
+    size_t second = (first == string::npos) ? string::npos : line.find('|', first + 1);
+    size_t third = (second == string::npos) ? string::npos : line.find('|', second + 1);
+    if (third == string::npos) {
+        return false;
+    }
+    
+    area = line.substr(0, first);
+    double fixedCharge = atof(line.substr(first + 1, second - first - 1).c_str());
+    double taxPercent = atof(line.substr(second + 1, third - second - 1).c_str());
+    
+    vector<TariffSlab> slabs;
+    istringstream slabText(line.substr(third + 1));
+    string slab;
+    while (slabText >> slab) {
+        size_t colon = slab.find(':');
+        if (colon == string::npos) {
+            return false;
+        }
+        
+        TariffSlab next;
+        string limit = slab.substr(0, colon);
+        next.upTo = (limit == "-") ? INT_MAX : atoi(limit.c_str());
+        next.rate = atof(slab.substr(colon + 1).c_str());
+        if (!slabs.empty() && next.upTo <= slabs.back().upTo) {
+            return false;
+        }
+        slabs.push_back(next);
+    }
+    if (slabs.empty() || slabs.back().upTo != INT_MAX) {
+        return false;
+    }
+    
+    tariff = Tariff(slabs, fixedCharge, taxPercent);
+    return true;
+}
+
+TariffBook::TariffBook(string fileName) : fileName(fileName), loaded(false) {
+}
+
+void TariffBook::load() {
+    ifstream inFile(fileName.c_str());
+    string line, area;
+    Tariff tariff;
+    int lineNumber = 0;
+    
+    while (getline(inFile, line)) {
+        lineNumber++;
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (!parseTariffLine(line, area, tariff)) {
+            cerr << fileName << ":" << lineNumber << ": invalid tariff, ignored\n";
+            continue;
+        }
+        if (area == "*") {
+            fallback = tariff;
+        } else {
+            areas[area] = tariff;
+        }
+    }
+    loaded = true;
+}
+
+const Tariff& TariffBook::forArea(string_view residentialArea) {
+    if (!loaded) {
+        load();
+    }
+    
+    unordered_map<string, Tariff, TextHash, TextEqual>::const_iterator it = areas.find(residentialArea);
+    if (it == areas.end()) {
+        return fallback;
+    }
+    return it->second;
+}
+
+// Time calculateBill in a loop against every bulk kernel on the same units and
+// check the outputs are bitwise identical
+void benchmarkBillKernel(size_t n) {
+    vector<int> units(n);
+    vector<double> expected(n), actual(n);
+    unsigned int seed = 2024;
+    
+    // Mostly realistic readings, with every slab well represented
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        units[i] = (seed >> 8) % 1200;
+    }
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    calculateBillsScalar(units.data(), expected.data(), n);
+    double scalarMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << fixed << setprecision(1);
+    cout << n << " bills, calculateBills uses " << billKernelName() << "\n";
+    cout << setw(10) << "kernel" << setw(12) << "ms" << setw(16) << "Mbills/s" << setw(10) << "speedup" << setw(10) << "output\n";
+    cout << setw(10) << "scalar" << setw(12) << scalarMs << setw(16) << (n / scalarMs / 1000.0)
+         << setw(10) << 1.0 << setw(10) << "reference" << "\n";
+    
+    vector<pair<string, void (*)(const int*, double*, size_t)> > kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    kernels.push_back(make_pair(string("sse2"), &calculateBillsSSE2));
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(make_pair(string("avx2"), &calculateBillsAVX2));
+    }
+#endif
+    kernels.push_back(make_pair(string("dispatch"), &calculateBills));
+    
+    for (size_t k = 0; k < kernels.size(); k++) {
+        fill(actual.begin(), actual.end(), -1.0);
+        start = chrono::steady_clock::now();
+        kernels[k].second(units.data(), actual.data(), n);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        bool same = (n == 0) || memcmp(expected.data(), actual.data(), n * sizeof(double)) == 0;
+        
+        cout << setw(10) << kernels[k].first << setw(12) << ms << setw(16) << (n / ms / 1000.0)
+             << setw(10) << (scalarMs / ms) << setw(10) << (same ? "identical" : "DIFFERS") << "\n";
+    }
+}
+
+// Amount as written to records.txt, in paisa
+int64_t amountToPaisa(double amount) {
+    char text[64];
+    int64_t paisa = 0;
+    
+    snprintf(text, sizeof(text), "%.2f", amount);
+    parseAmountPaisa(text, paisa);
+    return paisa;
+}
+
+void UsageAggregate::add(int units, int64_t paisa) {
+    if (count == 0 || units < minUnits) {
+        minUnits = units;
+    }
+    if (count == 0 || units > maxUnits) {
+        maxUnits = units;
+    }
+    count++;
+    totalUnits += units;
+    totalPaisa += paisa;
+}
+
+void UsageAggregate::merge(const UsageAggregate& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0 || other.minUnits < minUnits) {
+        minUnits = other.minUnits;
+    }
+    if (count == 0 || other.maxUnits > maxUnits) {
+        maxUnits = other.maxUnits;
+    }
+    count += other.count;
+    totalUnits += other.totalUnits;
+    totalPaisa += other.totalPaisa;
+}
+
+bool UsageAggregate::operator==(const UsageAggregate& other) const {
+    return count == other.count && totalUnits == other.totalUnits && totalPaisa == other.totalPaisa &&
+           minUnits == other.minUnits && maxUnits == other.maxUnits;
+}
+
+UsageStats::UsageStats(string recordsFile, string statsFile)
+    : recordsFile(recordsFile), statsFile(statsFile), loaded(false), dirty(false), coveredBytes(0),
+      users(arena.resource()), meters(arena.resource()) {
+}
+
+void UsageStats::apply(const BillingRecord& record) {
+    int64_t paisa = amountToPaisa(record.totalBill);
+    LedgerIndex::key(record.username, record.meterSerial, meterKey);
+    arenaEntry(users, record.username).add(record.unitsConsumed, paisa);
+    arenaEntry(meters, meterKey).add(record.unitsConsumed, paisa);
+}
+
+// Empty both maps and release everything they held in one go
+void UsageStats::clear() {
+    users = ArenaMap<UsageAggregate>(arena.resource());
+    meters = ArenaMap<UsageAggregate>(arena.resource());
+    arena.release();
+}
+
+// stats.idx: a header line with the covered byte count, then one tab-separated
+// line per user (U) and per meter (M)
+bool UsageStats::loadSidecar() {
+    ifstream inFile(statsFile.c_str());
+    string tag, line;
+    int version;
+    
+    if (!(inFile >> tag >> version >> coveredBytes) || tag != "PFSTATS" || version != 1) {
+        return false;
+    }
+    inFile.ignore(numeric_limits<streamsize>::max(), '\n');
+    
+    while (getline(inFile, line)) {
+        istringstream fields(line);
+        string kind, username, serial;
+        UsageAggregate aggregate;
+        
+        if (!getline(fields, kind, '\t') || !getline(fields, username, '\t') ||
+            (kind == "M" && !getline(fields, serial, '\t')) ||
+            !(fields >> aggregate.count >> aggregate.totalUnits >> aggregate.totalPaisa
+                     >> aggregate.minUnits >> aggregate.maxUnits)) {
+            return false;
+        }
+        if (kind == "U") {
+            arenaEntry(users, username) = aggregate;
+        } else if (kind == "M") {
+            arenaEntry(meters, LedgerIndex::key(username, serial)) = aggregate;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void UsageStats::rebuild() {
+    clear();
+    coveredBytes = max(0LL, fileSize(recordsFile));
+    forEachBillingRecord(recordsFile, "", [&](const BillingRecord& record) {
+        apply(record);
+    });
+    dirty = true;
+}
+
+void UsageStats::load() {
+    clear();
+    loaded = true;
+    dirty = false;
+    
+    long long size = fileSize(recordsFile);
+    if (!loadSidecar() || size < coveredBytes) {
+        rebuild();
+        return;
+    }
+    refresh();
+}
+
+// Fold in records appended to records.txt after the covered offset
+void UsageStats::refresh() {
+    if (!loaded) {
+        load();
+        return;
+    }
+    
+    long long size = fileSize(recordsFile);
+    if (size <= coveredBytes) {
+        return;
+    }
+    
+    PF_TIMED(METRIC_REFRESH_STATS);
+    LineScanner scanner(recordsFile, coveredBytes);
+    BillingRecord record;
+    string_view line;
+    while (scanner.next(line)) {
+        if (parseBillingRecord(line, record)) {
+            apply(record);
+        }
+    }
+    coveredBytes = size;
+    dirty = true;
+}
+
+const UsageAggregate* UsageStats::forUser(const string& username) {
+    if (!loaded) {
+        load();
+    }
+    
+    ArenaMap<UsageAggregate>::const_iterator it = users.find(username);
+    return (it == users.end()) ? NULL : &it->second;
+}
+
+const UsageAggregate* UsageStats::forMeter(const string& username, const string& meterSerial) {
+    if (!loaded) {
+        load();
+    }
+    
+    ArenaMap<UsageAggregate>::const_iterator it = meters.find(LedgerIndex::key(username, meterSerial));
+    return (it == meters.end()) ? NULL : &it->second;
+}
+
+// Called after saveBillingRecord appends a record of lineBytes bytes. The record
+// may still be in the writer's buffer, so the covered size is advanced by hand.
+void UsageStats::update(const BillingRecord& record, size_t lineBytes) {
+    if (!loaded) {
+        load();
+    }
+    apply(record);
+    coveredBytes += lineBytes;
+    dirty = true;
+}
+
+// Write the sidecar through a temporary file so a crash never leaves half of it
+bool UsageStats::persist() {
+    PF_TIMED(METRIC_PERSIST_STATS);
+    if (!loaded || !dirty) {
+        return true;
+    }
+    
+    string tempFile = statsFile + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::trunc);
+    outFile << "PFSTATS 1 " << coveredBytes << "\n";
+    for (ArenaMap<UsageAggregate>::const_iterator it = users.begin(); it != users.end(); it++) {
+        const UsageAggregate& a = it->second;
+        outFile << "U\t" << it->first << "\t" << a.count << " " << a.totalUnits << " " << a.totalPaisa
+                << " " << a.minUnits << " " << a.maxUnits << "\n";
+    }
+    for (ArenaMap<UsageAggregate>::const_iterator it = meters.begin(); it != meters.end(); it++) {
+        // The meter key is already "username<tab>serial"
+        const UsageAggregate& a = it->second;
+        outFile << "M\t" << it->first << "\t" << a.count << " " << a.totalUnits << " " << a.totalPaisa
+                << " " << a.minUnits << " " << a.maxUnits << "\n";
+    }
+    outFile.close();
+    
+    if (!outFile || rename(tempFile.c_str(), statsFile.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    dirty = false;
+    return true;
+}
+
+// Recompute everything from the ledger and report every aggregate that differs
+// from the incrementally maintained one. The recomputed copy lives in its own
+// arena, which is released as a whole when it goes out of scope.
+int UsageStats::verify() {
+    UsageStats fresh(recordsFile, "");
+    size_t differences = 0;
+    
+    refresh();
+    fresh.loaded = true;
+    fresh.rebuild();
+    
+    const ArenaMap<UsageAggregate>* ours[2] = {&users, &meters};
+    const ArenaMap<UsageAggregate>* theirs[2] = {&fresh.users, &fresh.meters};
+    const char* kinds[2] = {"user", "meter"};
+    
+    for (int k = 0; k < 2; k++) {
+        for (ArenaMap<UsageAggregate>::const_iterator it = theirs[k]->begin(); it != theirs[k]->end(); it++) {
+            ArenaMap<UsageAggregate>::const_iterator mine = ours[k]->find(it->first);
+            if (mine == ours[k]->end() || !(mine->second == it->second)) {
+                differences++;
+                cout << kinds[k] << " " << it->first << ": stored "
+                     << (mine == ours[k]->end() ? 0 : mine->second.count) << " records, recomputed "
+                     << it->second.count << "\n";
+            }
+        }
+        for (ArenaMap<UsageAggregate>::const_iterator it = ours[k]->begin(); it != ours[k]->end(); it++) {
+            if (theirs[k]->find(it->first) == theirs[k]->end()) {
+                differences++;
+                cout << kinds[k] << " " << it->first << ": stored but not in the ledger\n";
+            }
+        }
+    }
+    
+    cout << fresh.users.size() << " users and " << fresh.meters.size() << " meters checked, "
+         << differences << " differences\n";
+    if (differences == 0) {
+        persist();
+    }
+    return (differences == 0) ? 0 : 1;
+}
+
+HistoryIndex::HistoryIndex(string fileName)
+    : fileName(fileName), coveredBytes(0), tables(new Tables(arena.resource())) {
+}
+
+// Index the lines appended since the last call, tracking each line's byte offset.
+// A missing file has nothing to index yet; a shorter one is indexed again.
+void HistoryIndex::refresh() {
+    long long size = fileSize(fileName);
+    if (size < 0) {
+        return;
+    }
+    if (size < coveredBytes) {
+        tables.reset();
+        arena.release();
+        tables.reset(new Tables(arena.resource()));
+        coveredBytes = 0;
+    }
+    if (size <= coveredBytes) {
+        return;
+    }
+    
+    PF_TIMED(METRIC_REFRESH_HISTORY);
+    LineScanner scanner(fileName, coveredBytes);
+    string_view line;
+    string_view fields[3];
+    
+    uint64_t offset = coveredBytes;
+    while (scanner.next(line)) {
+        if (!scanner.terminated()) {
+            break;   // partial last line; picked up once it is complete
+        }
+        
+        if (splitRecordFields(line, fields, 3) == 3) {
+            HistoryEntry entry;
+            entry.offset = offset;
+            entry.serialId = tables->serials.intern(fields[1]);
+            entry.period = parsePeriod(fields[2]);
+            
+            // Space for a year of readings up front: a list that grows leaves its
+            // old buffers behind in the arena
+            pmr::vector<HistoryEntry>& entries = arenaEntry(tables->users, fields[0]);
+            if (entries.empty()) {
+                entries.reserve(12);
+            }
+            entries.push_back(entry);
+        }
+        offset += line.length() + 1;
+    }
+    coveredBytes = offset;
+}
+
+bool HistoryIndex::matches(const HistoryEntry& entry, const HistoryFilter& filter, uint32_t serialId) const {
+    if (!filter.meterSerial.empty() && entry.serialId != serialId) {
+        return false;
+    }
+    if (filter.fromPeriod >= 0 && entry.period < filter.fromPeriod) {
+        return false;
+    }
+    if (filter.toPeriod >= 0 && entry.period > filter.toPeriod) {
+        return false;
+    }
+    return true;
+}
+
+// Rows of one page, newest first. total is the number of records passing the filter.
+// The list of matches is built in a stack arena that only spills to the heap for
+// very long histories.
+vector<HistoryRow> HistoryIndex::page(const string& username, const HistoryFilter& filter,
+                                      size_t pageNumber, size_t perPage, size_t& total) const {
+    PF_TIMED(METRIC_HISTORY_PAGE);
+    vector<HistoryRow> rows;
+    char scratch[8192];
+    pmr::monotonic_buffer_resource pageArena(scratch, sizeof(scratch));
+    pmr::vector<size_t> matching(&pageArena);
+    uint32_t serialId = 0;
+    
+    total = 0;
+    
+    ArenaMap<pmr::vector<HistoryEntry> >::const_iterator it = tables->users.find(username);
+    if (it == tables->users.end()) {
+        return rows;
+    }
+    if (!filter.meterSerial.empty() && !tables->serials.find(filter.meterSerial, serialId)) {
+        return rows;   // a serial never seen in the ledger matches nothing
+    }
+    
+    // Newest first. A meter's records are in period order, so with a serial and a
+    // first period the scan ends at that meter's first record before the range.
+    const pmr::vector<HistoryEntry>& entries = it->second;
+    bool oneMeterRange = !filter.meterSerial.empty() && filter.fromPeriod >= 0;
+    for (size_t i = entries.size(); i-- > 0;) {
+        if (oneMeterRange && entries[i].serialId == serialId && entries[i].period < filter.fromPeriod) {
+            break;
+        }
+        if (matches(entries[i], filter, serialId)) {
+            matching.push_back(i);
+        }
+    }
+    total = matching.size();
+    
+    ifstream inFile(fileName.c_str(), ios::binary);
+    for (size_t k = pageNumber * perPage; k < total && k < (pageNumber + 1) * perPage; k++) {
+        size_t index = matching[k];
+        HistoryRow row;
+        
+        inFile.clear();
+        inFile.seekg(entries[index].offset);
+        if (readBillingRecord(inFile, row.record)) {
+            row.number = index + 1;
+            rows.push_back(row);
+        }
+    }
+    return rows;
+}
+
+LedgerWriter::LedgerWriter(WriteAheadLog& wal, WalTarget target, size_t flushBytes, int flushMillis,
+                           Durability durability)
+    : wal(wal), target(target), flushBytes(flushBytes), flushMillis(flushMillis), level(durability),
+      started(false), writing(false), stopping(false), failed(false) {
+}
+
+LedgerWriter::~LedgerWriter() {
+    close();
+}
+
+const char* durabilityName(Durability level) {
+    switch (level) {
+        case DURABILITY_NONE:
+            return "none";
+        case DURABILITY_PER_BATCH:
+            return "per-batch";
+        default:
+            return "per-record";
+    }
+}
+
+// The flusher thread only exists once something was appended
+void LedgerWriter::start() {
+    if (!started && flushMillis > 0) {
+        flusher = thread(&LedgerWriter::flushLoop, this);
+    }
+    started = true;
+}
+
+// Commit the buffer through the log. The caller holds the lock, which is let go
+// during the write so new records can gather behind it; batches are written one
+// at a time, in order.
+bool LedgerWriter::writeBuffer(unique_lock<mutex>& guard) {
+    while (writing) {
+        written.wait(guard);
+    }
+    if (failed || buffer.empty()) {
+        return !failed;
+    }
+    
+    batch.swap(buffer);
+    writing = true;
+    bool sync = level != DURABILITY_NONE;
+    guard.unlock();
+    bool ok = wal.append(target, batch.data(), batch.size(), sync);
+    guard.lock();
+    batch.clear();
+    writing = false;
+    if (!ok) {
+        failed = true;
+    }
+    written.notify_all();
+    return ok;
+}
+
+bool LedgerWriter::append(const string& data) {
+    unique_lock<mutex> guard(lock);
+    
+    if (failed) {
+        return false;
+    }
+    start();
+    if (buffer.empty()) {
+        oldest = chrono::steady_clock::now();
+    }
+    buffer += data;
+    
+    if (level == DURABILITY_PER_RECORD || buffer.size() >= flushBytes) {
+        return writeBuffer(guard);
+    }
+    return true;
+}
+
+// Returns once everything appended before the call is written. A batch already
+// being written may hold some of it, so that one is waited for first.
+bool LedgerWriter::flush() {
+    PF_TIMED(METRIC_LEDGER_FLUSH);
+    unique_lock<mutex> guard(lock);
+    return writeBuffer(guard);
+}
+
+void LedgerWriter::setDurability(Durability durability) {
+    lock_guard<mutex> guard(lock);
+    level = durability;
+}
+
+// Background flush for batches that never reach flushBytes
+void LedgerWriter::flushLoop() {
+    unique_lock<mutex> guard(lock);
+    
+    while (!stopping) {
+        if (buffer.empty()) {
+            wake.wait_for(guard, chrono::milliseconds(flushMillis));
+            continue;
+        }
+        
+        chrono::steady_clock::time_point due = oldest + chrono::milliseconds(flushMillis);
+        if (chrono::steady_clock::now() >= due) {
+            writeBuffer(guard);
+        } else {
+            wake.wait_until(guard, due);
+        }
+    }
+}
+
+void LedgerWriter::close() {
+    {
+        unique_lock<mutex> guard(lock);
+        if (!started) {
+            return;
+        }
+        writeBuffer(guard);
+        stopping = true;
+    }
+    
+    wake.notify_all();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+    started = false;
+    stopping = false;
+}
+
+// Append synthetic records through the old open/write/close pattern and through
+// the ledger writer at each durability level, and report records per second
+void benchmarkLedgerWriter(size_t records) {
+    const string benchFile = "bench_records.txt";
+    BillingRecord record;
+    string line;
+    
+    record.username = "benchuser";
+    record.meterSerial = "BENCH-0001";
+    record.period = SAMPLE_FIRST_PERIOD + 2;
+    record.previousReading = 1200;
+    record.currentReading = 1450;
+    record.unitsConsumed = 250;
+    record.totalBill = calculateBill(250);
+    formatBillingRecord(line, record);
+    
+    cout << fixed << setprecision(0);
+    cout << setw(26) << "mode" << setw(12) << "records" << setw(14) << "records/s" << "\n";
+    
+    // Per-record fsync is orders of magnitude slower, so it gets fewer records
+    size_t slowRecords = min(records, (size_t)2000);
+    
+    remove(benchFile.c_str());
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records; i++) {
+        ofstream outFile(benchFile.c_str(), ios::app);
+        outFile << line;
+        outFile.flush();
+        outFile.close();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << setw(26) << "open/append/close" << setw(12) << records << setw(14) << (records / seconds) << "\n";
+    
+    const Durability levels[] = {DURABILITY_NONE, DURABILITY_PER_BATCH, DURABILITY_PER_RECORD};
+    for (int l = 0; l < 3; l++) {
+        size_t count = (levels[l] == DURABILITY_PER_RECORD) ? slowRecords : records;
+        
+        remove(benchFile.c_str());
+        remove("bench_wal.log");
+        start = chrono::steady_clock::now();
+        {
+            WriteAheadLog benchWal("bench_wal.log", "bench_users.txt", benchFile);
+            LedgerWriter writer(benchWal, WAL_RECORDS, 1 << 20, 100, levels[l]);
+            for (size_t i = 0; i < count; i++) {
+                writer.append(line);
+            }
+            writer.close();
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        bool complete = fileSize(benchFile) == (long long)(count * line.length());
+        cout << setw(26) << (string("writer, ") + durabilityName(levels[l])) << setw(12) << count
+             << setw(14) << (count / seconds) << (complete ? "" : "  (short file!)") << "\n";
+    }
+    
+    remove(benchFile.c_str());
+    remove("bench_wal.log");
+    remove("bench_users.txt");
+}
+
+// CRC-32C (Castagnoli), with the SSE4.2 instruction when the CPU has it
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const char* data, size_t length) {
+    uint64_t value = ~crc;
+    size_t i = 0;
+    
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    uint32_t tail = value;
+    for (; i < length; i++) {
+        tail = _mm_crc32_u8(tail, data[i]);
+    }
+    return ~tail;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t length) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return crc32cHardware(crc, data, length);
+    }
+#endif
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t entry = i;
+            for (int bit = 0; bit < 8; bit++) {
+                entry = (entry & 1) ? (entry >> 1) ^ 0x82F63B78 : entry >> 1;
+            }
+            table[i] = entry;
+        }
+        tableReady = true;
+    }
+    
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Checksum of an entry: everything in the header after the checksum, then the payload
+uint32_t walChecksum(const WalEntryHeader& header, const char* payload) {
+    uint32_t crc = crc32c(0, (const char*)&header.target, sizeof(header) - offsetof(WalEntryHeader, target));
+    return crc32c(crc, payload, header.length);
+}
+
+WriteAheadLog::WriteAheadLog(string logFile, string usersFile, string recordsFile)
+    : logFile(logFile), logFd(-1), checkpointBytes(64 << 20) {
+    targetFiles[WAL_USERS] = usersFile;
+    targetFiles[WAL_RECORDS] = recordsFile;
+    for (int i = 0; i < WAL_TARGETS; i++) {
+        targetFds[i] = -1;
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    close();
+}
+
+// Open the log and the targets; the caller holds the lock
+bool WriteAheadLog::open() {
+    if (logFd >= 0) {
+        return true;
+    }
+    
+    logFd = ::open(logFile.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (logFd < 0) {
+        return false;
+    }
+    
+    for (int i = 0; i < WAL_TARGETS; i++) {
+        targetFds[i] = ::open(targetFiles[i].c_str(), O_WRONLY | O_CREAT, 0644);
+        if (targetFds[i] < 0) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+// A target another process replaced by renaming a new file over it is opened again,
+// so appends do not go to the unlinked copy; the caller holds the log's flock
+bool WriteAheadLog::reopenIfReplaced(WalTarget target) {
+    struct stat named;
+    struct stat opened;
+    
+    if (stat(targetFiles[target].c_str(), &named) == 0 && fstat(targetFds[target], &opened) == 0 &&
+        named.st_ino == opened.st_ino && named.st_dev == opened.st_dev) {
+        return true;
+    }
+    int fd = ::open(targetFiles[target].c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    ::close(targetFds[target]);
+    targetFds[target] = fd;
+    return true;
+}
+
+// flock, retried when a signal interrupts the wait
+bool lockFile(int fd, int operation) {
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void WriteAheadLog::close() {
+    if (logFd >= 0) {
+        ::close(logFd);
+        logFd = -1;
+    }
+    for (int i = 0; i < WAL_TARGETS; i++) {
+        if (targetFds[i] >= 0) {
+            ::close(targetFds[i]);
+            targetFds[i] = -1;
+        }
+    }
+}
+
+bool writeFully(int fd, const char* data, size_t length, long long offset) {
+    while (length > 0) {
+        ssize_t written = (offset < 0) ? ::write(fd, data, length) : ::pwrite(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+        if (offset >= 0) {
+            offset += written;
+        }
+    }
+    return true;
+}
+
+// Log the entry, make it durable if asked, then apply it to the target
+bool WriteAheadLog::append(WalTarget target, const char* data, size_t length, bool sync) {
+    PF_TIMED(METRIC_WAL_APPEND);
+    PF_COUNT(COUNTER_WAL_BYTES, length);
+    lock_guard<mutex> guard(lock);
+    
+    if (length == 0) {
+        return true;
+    }
+    if (!open() || !lockFile(logFd, LOCK_EX)) {
+        return false;
+    }
+    bool ok = appendLocked(target, data, length, sync);
+    flock(logFd, LOCK_UN);
+    return ok;
+}
+
+// The data goes at the target's current end, which another process may have moved
+bool WriteAheadLog::appendLocked(WalTarget target, const char* data, size_t length, bool sync) {
+    struct stat info;
+    if (!reopenIfReplaced(target) || fstat(targetFds[target], &info) != 0) {
+        return false;
+    }
+    
+    WalEntryHeader header;
+    memset(&header, 0, sizeof(header));
+    header.length = length;
+    header.target = target;
+    header.offset = info.st_size;
+    header.checksum = walChecksum(header, data);
+    
+    struct iovec parts[2];
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = (void*)data;
+    parts[1].iov_len = length;
+    ssize_t written = writev(logFd, parts, 2);
+    if (written < 0) {
+        return false;
+    }
+    // Finish a short write; if that fails too the torn entry is dropped by recovery
+    size_t done = written;
+    if (done < sizeof(header) && !writeFully(logFd, (const char*)&header + done, sizeof(header) - done, -1)) {
+        return false;
+    }
+    done = max(done, sizeof(header)) - sizeof(header);
+    if (done < length && !writeFully(logFd, data + done, length - done, -1)) {
+        return false;
+    }
+    if (sync && fdatasync(logFd) != 0) {
+        return false;
+    }
+    
+    if (!writeFully(targetFds[target], data, length, header.offset)) {
+        return false;
+    }
+    
+    // Other processes' entries count towards the checkpoint too
+    if (fstat(logFd, &info) == 0 && (uint64_t)info.st_size >= checkpointBytes) {
+        return checkpoint();
+    }
+    return true;
+}
+
+// Replace a target with edit's rewrite of it, for compaction. The log's offsets
+// point into the old file, so it is checkpointed first, and the flock is held from
+// reading the file to renaming the new one so no append falls in between.
+bool WriteAheadLog::rewrite(WalTarget target, const function<bool(string_view, string&)>& edit) {
+    lock_guard<mutex> guard(lock);
+    
+    if (!open() || !lockFile(logFd, LOCK_EX)) {
+        return false;
+    }
+    bool ok = rewriteLocked(target, edit);
+    flock(logFd, LOCK_UN);
+    return ok;
+}
+
+bool WriteAheadLog::rewriteLocked(WalTarget target, const function<bool(string_view, string&)>& edit) {
+    if (!reopenIfReplaced(target) || !checkpoint()) {
+        return false;
+    }
+    
+    MappedFile current;
+    string replacement;
+    current.open(targetFiles[target]);      // a missing or empty file maps as nothing
+    if (!edit(string_view(current.data(), current.size()), replacement)) {
+        return false;
+    }
+    
+    string tempFile = targetFiles[target] + ".tmp";
+    int fd = ::open(tempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && writeFully(fd, replacement.data(), replacement.size(), 0) && fdatasync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!written || rename(tempFile.c_str(), targetFiles[target].c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    return reopenIfReplaced(target);
+}
+
+// Make the targets durable, after which the log is no longer needed; the caller
+// holds the log's flock
+bool WriteAheadLog::checkpoint() {
+    PF_TIMED(METRIC_WAL_CHECKPOINT);
+    for (int i = 0; i < WAL_TARGETS; i++) {
+        if (fdatasync(targetFds[i]) != 0) {
+            return false;
+        }
+    }
+    if (ftruncate(logFd, 0) != 0 || fdatasync(logFd) != 0) {
+        return false;
+    }
+    return true;
+}
+
+// Scan the log, stopping at the first entry that is short or fails its checksum,
+// and make every target hold exactly the logged bytes at the logged offsets.
+// Entries are applied in order, so everything below a target's current size was
+// written before the crash; only the last such entry and the entries past the
+// end of the target need to be looked at.
+bool WriteAheadLog::recover(WalRecoveryReport& report) {
+    lock_guard<mutex> guard(lock);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    
+    memset(&report, 0, sizeof(report));
+    close();
+    
+    // A process in the middle of an append holds the lock; once it is ours, every
+    // live process's entries are complete in their targets and only a crashed
+    // process can have left work behind
+    int logLockFd = ::open(logFile.c_str(), O_RDWR | O_CREAT, 0644);
+    if (logLockFd < 0) {
+        return false;
+    }
+    if (!lockFile(logLockFd, LOCK_EX)) {
+        ::close(logLockFd);
+        return false;
+    }
+    bool ok = recoverLocked(logLockFd, report);
+    ::close(logLockFd);
+    report.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+bool WriteAheadLog::recoverLocked(int logLockFd, WalRecoveryReport& report) {
+    MappedFile log;
+    if (!log.open(logFile)) {
+        return fileSize(logFile) <= 0;
+    }
+    
+    vector<const WalEntryHeader*> entries;
+    size_t position = 0;
+    while (position + sizeof(WalEntryHeader) <= log.size()) {
+        WalEntryHeader header;
+        memcpy(&header, log.data() + position, sizeof(header));
+        const char* payload = log.data() + position + sizeof(header);
+        
+        if (header.target >= WAL_TARGETS || header.length > log.size() - position - sizeof(header) ||
+            walChecksum(header, payload) != header.checksum) {
+            break;
+        }
+        entries.push_back((const WalEntryHeader*)(log.data() + position));
+        position += sizeof(header) + header.length;
+    }
+    report.entries = entries.size();
+    report.bytesScanned = position;
+    report.tornBytes = log.size() - position;
+    
+    for (int target = 0; target < WAL_TARGETS; target++) {
+        int fd = ::open(targetFiles[target].c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        uint64_t size = max(0LL, fileSize(targetFiles[target]));
+        
+        // Index of the last entry that lies entirely inside the target
+        long long lastInside = -1;
+        for (size_t i = 0; i < entries.size(); i++) {
+            WalEntryHeader header;
+            memcpy(&header, entries[i], sizeof(header));
+            if (header.target == target && header.offset + header.length <= size) {
+                lastInside = i;
+            }
+        }
+        
+        for (size_t i = (lastInside < 0) ? 0 : lastInside; i < entries.size(); i++) {
+            WalEntryHeader header;
+            memcpy(&header, entries[i], sizeof(header));
+            if (header.target != target) {
+                continue;
+            }
+            const char* payload = (const char*)entries[i] + sizeof(header);
+            
+            if ((long long)i == lastInside) {
+                string existing(header.length, '\0');
+                if (pread(fd, &existing[0], header.length, header.offset) == (ssize_t)header.length &&
+                    memcmp(existing.data(), payload, header.length) == 0) {
+                    continue;
+                }
+            }
+            if (!writeFully(fd, payload, header.length, header.offset)) {
+                ::close(fd);
+                return false;
+            }
+            report.replayedEntries++;
+            report.replayedBytes += header.length;
+            size = max(size, (uint64_t)(header.offset + header.length));
+        }
+        
+        // A torn write past the last logged entry is cut off
+        uint64_t loggedEnd = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            WalEntryHeader header;
+            memcpy(&header, entries[i], sizeof(header));
+            if (header.target == target) {
+                loggedEnd = header.offset + header.length;
+            }
+        }
+        if (loggedEnd > 0 && size > loggedEnd && ftruncate(fd, loggedEnd) != 0) {
+            ::close(fd);
+            return false;
+        }
+        
+        bool synced = fdatasync(fd) == 0;
+        ::close(fd);
+        if (!synced) {
+            return false;
+        }
+    }
+    
+    // Everything is in the targets now, so the log starts over
+    log.close();
+    return ftruncate(logLockFd, 0) == 0;
+}
+
+void printRecoveryReport(const WalRecoveryReport& report) {
+    cout << fixed << setprecision(1);
+    cout << "Recovered wal.log: " << report.entries << " entries (" << report.bytesScanned << " bytes) checked, "
+         << report.replayedEntries << " replayed (" << report.replayedBytes << " bytes), "
+         << report.tornBytes << " torn bytes dropped in " << report.milliseconds << " ms\n";
+}
+
+// Build a log of the given size in a scratch directory the way a crash would leave
+// it: the last quarter of the entries never reached records.txt, the write of the
+// first missing entry was torn half-way, and the log ends in half an entry. Then
+// time recovery and check that records.txt ends up with exactly the logged bytes.
+void benchmarkWalRecovery(size_t megabytes) {
+    const string benchDir = "bench_wal";
+    const size_t batchBytes = 64 << 10;
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    remove("wal.log");
+    remove("records.txt");
+    remove("users.txt");
+    
+    // One 64 KB batch of records, repeated
+    string batch;
+    BillingRecord record;
+    record.username = "benchuser";
+    record.meterSerial = "BENCH-0001";
+    record.period = SAMPLE_FIRST_PERIOD + 2;
+    record.previousReading = 1200;
+    record.currentReading = 1450;
+    record.unitsConsumed = 250;
+    record.totalBill = calculateBill(250);
+    while (batch.size() < batchBytes) {
+        formatBillingRecord(batch, record);
+    }
+    
+    size_t batches = max((size_t)4, (megabytes << 20) / (batch.size() + sizeof(WalEntryHeader)));
+    size_t applied = batches * 3 / 4;
+    uint64_t expectedHash = 14695981039346656037ULL;
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    {
+        ofstream logFile("wal.log", ios::binary);
+        ofstream dataFile("records.txt", ios::binary);
+        WalEntryHeader header;
+        memset(&header, 0, sizeof(header));
+        header.target = WAL_RECORDS;
+        header.length = batch.size();
+        
+        for (size_t i = 0; i < batches; i++) {
+            header.offset = (uint64_t)i * batch.size();
+            header.checksum = walChecksum(header, batch.data());
+            logFile.write((const char*)&header, sizeof(header));
+            logFile.write(batch.data(), batch.size());
+            expectedHash = hashBytes(batch.data(), batch.size(), expectedHash);
+            if (i < applied) {
+                dataFile.write(batch.data(), batch.size());
+            } else if (i == applied) {
+                dataFile.write(batch.data(), batch.size() / 2);
+            }
+        }
+        logFile.write((const char*)&header, sizeof(header));
+        logFile.write(batch.data(), batch.size() / 2);
+    }
+    double setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    long long logBytes = fileSize("wal.log");
+    
+    WriteAheadLog benchWal("wal.log", "users.txt", "records.txt");
+    WalRecoveryReport report;
+    bool ok = benchWal.recover(report);
+    
+    MappedFile result;
+    bool correct = ok && result.open("records.txt") && result.size() == batches * batch.size() &&
+                   hashBytes(result.data(), result.size(), 14695981039346656037ULL) == expectedHash;
+    result.close();
+    
+    cout << fixed << setprecision(1);
+    cout << "Log of " << (logBytes >> 20) << " MB (" << batches << " entries) written in " << setupSeconds << " s\n";
+    printRecoveryReport(report);
+    cout << "Recovery throughput: " << (logBytes / 1048576.0) / (report.milliseconds / 1000.0) << " MB/s, "
+         << "records.txt " << (correct ? "matches the log" : "DOES NOT MATCH the log") << "\n";
+    
+    remove("wal.log");
+    remove("records.txt");
+    remove("users.txt");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
+}
+
+StripedLocks::StripedLocks(size_t stripes) : locks(stripes) {
+}
+
+mutex& StripedLocks::forKey(const string& key) {
+    return locks[hash<string>()(key) % locks.size()];
+}
+
+vector<string> splitFields(const string& line, char separator) {
+    vector<string> fields;
+    size_t start = 0;
+    
+    while (true) {
+        size_t end = line.find(separator, start);
+        if (end == string::npos) {
+            fields.push_back(line.substr(start));
+            return fields;
+        }
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+BillingServer::BillingServer(string socketPath)
+    : socketPath(socketPath), listenFd(-1), stopping(false) {
+}
+
+// Load everything up front; afterwards the stores are only changed under the locks
+void BillingServer::preload() {
+    userStore.size();
+    ledgerIndex.size();
+    usageStats.refresh();
+    historyIndex.refresh();
+    tariffBook.forArea("");
+    
+    // Optional background sealing and compaction of ledger segments
+    const char* compactSeconds = getenv("PF_COMPACT_SECONDS");
+    if (compactSeconds != NULL && atoi(compactSeconds) > 0) {
+        ledgerSegments.startCompaction(atoi(compactSeconds), 10000, 12);
+    }
+}
+
+// A descriptor per client, so lift the soft limit (often 1024) to the hard one
+void raiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Bind and listen, replacing a socket file left behind by an earlier run
+int listenOnUnixSocket(const string& socketPath) {
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (listenFd < 0 || socketPath.length() >= sizeof(address.sun_path)) {
+        cout << "Error: unable to create socket " << socketPath << "\n";
+        if (listenFd >= 0) {
+            ::close(listenFd);
+        }
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    unlink(socketPath.c_str());
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+        cout << "Error: unable to listen on " << socketPath << ": " << strerror(errno) << "\n";
+        ::close(listenFd);
+        return -1;
+    }
+    return listenFd;
+}
+
+// Accept connections until SIGINT or SIGTERM, then drain the clients and save state
+int BillingServer::run() {
+    preload();
+    raiseFileLimit();
+    listenFd = listenOnUnixSocket(socketPath);
+    if (listenFd < 0) {
+        return 1;
+    }
+    
+    // Signals are taken by one thread with sigwait instead of interrupting a random one
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    thread signalWaiter([this, signals]() {
+        int received;
+        sigwait(&signals, &received);
+        stop();
+    });
+    
+    cout << "Serving " << userStore.size() << " users on " << socketPath << " (Ctrl+C to stop)\n";
+    while (true) {
+        int clientFd = accept(listenFd, NULL, NULL);
+        if (clientFd < 0) {
+            int error = errno;
+            {
+                lock_guard<mutex> guard(clientsLock);
+                if (stopping) {
+                    break;   // the listening socket was shut down by stop()
+                }
+            }
+            // Out of descriptors or memory is usually over once some clients leave, so
+            // back off and try again; only stop() ends the loop
+            if (error != EINTR && error != ECONNABORTED) {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+            continue;
+        }
+        
+        lock_guard<mutex> guard(clientsLock);
+        if (stopping) {
+            ::close(clientFd);
+            break;
+        }
+        clients.insert(clientFd);
+        thread(&BillingServer::serve, this, clientFd).detach();
+    }
+    
+    {
+        unique_lock<mutex> guard(clientsLock);
+        clientsDone.wait(guard, [this]() { return clients.empty(); });
+    }
+    signalWaiter.join();
+    ::close(listenFd);
+    unlink(socketPath.c_str());
+    
+    ledgerWriter.flush();
+    usageStats.persist();
+    cout << "Server stopped\n";
+    return 0;
+}
+
+// Stop accepting and wake every connection thread out of read()
+void BillingServer::stop() {
+    lock_guard<mutex> guard(clientsLock);
+    
+    stopping = true;
+    shutdown(listenFd, SHUT_RDWR);
+    for (unordered_set<int>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        shutdown(*it, SHUT_RDWR);
+    }
+}
+
+// Read request lines from one client and answer each in turn
+void BillingServer::serve(int clientFd) {
+    ServerSession session;
+    session.fd = clientFd;
+    session.loggedIn = false;
+    
+    string pending;
+    string reply;
+    char chunk[4096];
+    bool open = true;
+    
+    while (open) {
+        ssize_t received = read(clientFd, chunk, sizeof(chunk));
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        pending.append(chunk, received);
+        
+        size_t start = 0;
+        size_t end;
+        reply.clear();
+        while (open && (end = pending.find('\n', start)) != string::npos) {
+            string line = pending.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line[line.length() - 1] == '\r') {
+                line.erase(line.length() - 1);
+            }
+            open = runCommand(session, splitFields(line, '\t'), reply);
+        }
+        pending.erase(0, start);
+        
+        if (!reply.empty() && !writeFully(clientFd, reply.data(), reply.length(), -1)) {
+            break;
+        }
+    }
+    
+    ::close(clientFd);
+    lock_guard<mutex> guard(clientsLock);
+    clients.erase(clientFd);
+    if (clients.empty()) {
+        clientsDone.notify_all();
+    }
+}
+
+// One simulated field agent of the load test
+struct LoadSession {
+    int fd;
+    int sent;
+    int step;
+    int reading;
+    size_t expectedLines;
+    string username;
+    string serial;
+    string received;
+    chrono::steady_clock::time_point started;
+};
+
+// The request a load session sends at each step: register, log in, then
+// mostly readings with a history page every 5th and statistics every 10th
+string loadRequest(LoadSession& session) {
+    int step = session.step;
+    
+    if (step == 0) {
+        return "REGISTER\t" + session.username + "\tLoad@Test1\tLoad Agent\t1\tLoad Area\t" + session.serial + "\n";
+    }
+    if (step == 1) {
+        return "LOGIN\t" + session.username + "\tLoad@Test1\n";
+    }
+    if (step % 10 == 0) {
+        return "STATS\n";
+    }
+    if (step % 5 == 0) {
+        return "HISTORY\t1\n";
+    }
+    session.reading += 25 + (step * 37) % 200;
+    return "SUBMIT\t" + session.serial + "\t" + to_string(session.reading) + "\n";
+}
+
+// Open sessions connections to a running server and keep one request in flight
+// on each until every session has sent requestsPerSession requests after logging
+// in. Latency is measured from sending a request to receiving its whole reply.
+bool runLoadTest(const string& socketPath, int sessions, int requestsPerSession, LoadTestReport& report) {
+    raiseFileLimit();
+    signal(SIGPIPE, SIG_IGN);
+    
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    
+    // Names are unique per run so repeated runs never collide with earlier users
+    vector<LoadSession> load(sessions);
+    string runTag = to_string(getpid());
+    for (int i = 0; i < sessions; i++) {
+        load[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (load[i].fd < 0 || connect(load[i].fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            cout << "Unable to open session " << i << " on " << socketPath << ": " << strerror(errno) << "\n";
+            for (int j = 0; j <= i; j++) {
+                ::close(load[j].fd);
+            }
+            return false;
+        }
+        load[i].sent = 0;
+        load[i].step = 0;
+        load[i].reading = 0;
+        load[i].username = "load" + runTag + "_" + to_string(i);
+        load[i].serial = "LG" + runTag + "-" + to_string(i);
+    }
+    
+    vector<double> latencies;
+    vector<struct pollfd> polls(sessions);
+    long long errors = 0;
+    int active = sessions;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    
+    for (int i = 0; i < sessions; i++) {
+        string request = loadRequest(load[i]);
+        load[i].expectedLines = 0;
+        load[i].started = chrono::steady_clock::now();
+        writeFully(load[i].fd, request.data(), request.length(), -1);
+        polls[i].fd = load[i].fd;
+        polls[i].events = POLLIN;
+    }
+    
+    while (active > 0) {
+        if (poll(&polls[0], sessions, 10000) <= 0) {
+            cout << "Server stopped answering\n";
+            break;
+        }
+        for (int i = 0; i < sessions; i++) {
+            if (polls[i].fd < 0 || polls[i].revents == 0) {
+                continue;
+            }
+            LoadSession& session = load[i];
+            char chunk[4096];
+            ssize_t received = read(session.fd, chunk, sizeof(chunk));
+            if (received <= 0) {
+                errors++;
+                ::close(session.fd);
+                polls[i].fd = -1;
+                active--;
+                continue;
+            }
+            session.received.append(chunk, received);
+            
+            // A reply is one line, except HISTORY which announces how many rows follow
+            size_t lines = count(session.received.begin(), session.received.end(), '\n');
+            if (lines == 0) {
+                continue;
+            }
+            if (session.expectedLines == 0) {
+                session.expectedLines = 1;
+                if (session.received.compare(0, 3, "ERR") == 0) {
+                    // A duplicate registration is expected when names were used before
+                    if (session.step != 0) {
+                        errors++;
+                    }
+                } else if (session.step >= 2 && session.step % 5 == 0 && session.step % 10 != 0) {
+                    session.expectedLines += atoi(session.received.c_str() + 3);
+                }
+            }
+            if (lines < session.expectedLines) {
+                continue;
+            }
+            
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - session.started).count());
+            session.received.clear();
+            session.step++;
+            if (session.step > 2) {
+                session.sent++;
+            }
+            if (session.sent >= requestsPerSession) {
+                writeFully(session.fd, "QUIT\n", 5, -1);
+                ::close(session.fd);
+                polls[i].fd = -1;
+                active--;
+                continue;
+            }
+            
+            string request = loadRequest(session);
+            session.expectedLines = 0;
+            session.started = chrono::steady_clock::now();
+            writeFully(session.fd, request.data(), request.length(), -1);
+        }
+    }
+    for (int i = 0; i < sessions; i++) {
+        if (polls[i].fd >= 0) {
+            ::close(polls[i].fd);
+        }
+    }
+    
+    sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    report.requests = n;
+    report.errors = errors;
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report.p50Ms = (n > 0) ? latencies[n / 2] / 1000.0 : 0.0;
+    report.p99Ms = (n > 0) ? latencies[min(n - 1, n * 99 / 100)] / 1000.0 : 0.0;
+    report.maxMs = (n > 0) ? latencies[n - 1] / 1000.0 : 0.0;
+    return active == 0;
+}
+
+void printLoadTestReport(const LoadTestReport& report, int sessions) {
+    cout << fixed << setprecision(2);
+    cout << sessions << " sessions, " << report.requests << " requests in " << report.seconds << " s ("
+         << setprecision(0) << (report.requests / report.seconds) << " requests/s), " << report.errors << " errors\n";
+    cout << setprecision(1) << "Latency p50 " << report.p50Ms << " ms, p99 " << report.p99Ms
+         << " ms, max " << report.maxMs << " ms\n";
+}
+
+bool EventLoop::LineAwaiter::await_resume() {
+    size_t end = connection.input.find('\n');
+    if (end == string::npos) {
+        return false;   // closed with no complete line left
+    }
+    
+    line.assign(connection.input, 0, end);
+    connection.input.erase(0, end + 1);
+    if (!line.empty() && line[line.length() - 1] == '\r') {
+        line.erase(line.length() - 1);
+    }
+    return true;
+}
+
+EventLoop::EventLoop(int listenFd)
+    : listenFd(listenFd), stopping(false), acceptPaused(false), pendingJobs(0) {
+    epollFd = epoll_create1(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    watchListener();
+}
+
+// EPOLLEXCLUSIVE cannot be changed with EPOLL_CTL_MOD, so pausing drops the
+// listener from the set and this adds it back
+void EventLoop::watchListener() {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+}
+
+EventLoop::~EventLoop() {
+    ::close(epollFd);
+    ::close(wakeFd);
+}
+
+// Serve requests from one connection until it quits or goes away
+DetachedTask EventLoop::handleConnection(AsyncConnection* connection) {
+    string line;
+    bool open = true;
+    
+    // The awaiter is a named local and the test comes first on its own: GCC 12 does
+    // not short-circuit "open && co_await ..." and would wait for another line.
+    while (open) {
+        LineAwaiter next = {*connection, line};
+        if (!co_await next) {
+            break;
+        }
+        vector<string> fields = splitFields(line, '\t');
+        string reply;
+        
+        // The request runs on the request pool, hashing and all, while this connection
+        // is suspended. The awaiter is a named local: it must outlive the suspension.
+        PoolAwaiter request = {*this, [&]() { open = runCommand(connection->session, fields, reply); }};
+        co_await request;
+        connection->output += reply;
+        send(connection);
+    }
+    
+    connection->finished = true;
+    send(connection);
+}
+
+void EventLoop::acceptClients() {
+    while (true) {
+        int clientFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK);
+        if (clientFd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;
+        }
+        if (clientFd < 0 && errno != EAGAIN) {
+            // Out of descriptors or memory. The listener is level-triggered and would
+            // wake the loop again at once, so stop watching it for a while.
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, NULL);
+            acceptPaused = true;
+            acceptResumes = chrono::steady_clock::now() + chrono::milliseconds(50);
+            return;
+        }
+        if (clientFd < 0) {
+            return;   // another loop took the connection
+        }
+        
+        AsyncConnection* connection = new AsyncConnection();
+        connection->fd = clientFd;
+        connection->closed = false;
+        connection->finished = false;
+        connection->writing = false;
+        connection->session.fd = clientFd;
+        connection->session.loggedIn = false;
+        connections[clientFd].reset(connection);
+        
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = clientFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+        handleConnection(connection);
+    }
+}
+
+// Read whatever has arrived and wake the coroutine if it now has a line.
+// The coroutine may finish and free the connection, so it is not touched after.
+void EventLoop::receive(AsyncConnection* connection) {
+    char chunk[4096];
+    
+    while (true) {
+        ssize_t received = read(connection->fd, chunk, sizeof(chunk));
+        if (received > 0) {
+            connection->input.append(chunk, received);
+            continue;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received == 0 || errno != EAGAIN) {
+            connection->closed = true;
+        }
+        break;
+    }
+    
+    coroutine_handle<> reader = connection->reader;
+    if (reader && (connection->closed || connection->input.find('\n') != string::npos)) {
+        connection->reader = nullptr;
+        reader.resume();
+    }
+}
+
+// Write pending replies, waiting for EPOLLOUT when the socket is full, and
+// close the connection once its coroutine has finished and everything is sent
+void EventLoop::send(AsyncConnection* connection) {
+    while (!connection->output.empty() && !connection->closed) {
+        ssize_t written = write(connection->fd, connection->output.data(), connection->output.length());
+        if (written > 0) {
+            connection->output.erase(0, written);
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            connection->closed = true;
+        }
+    }
+    if (connection->closed) {
+        connection->output.clear();
+    }
+    
+    if (connection->finished && connection->output.empty()) {
+        closeConnection(connection);
+        return;
+    }
+    
+    bool wantWrite = !connection->output.empty();
+    if (wantWrite != connection->writing) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+        event.data.fd = connection->fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->writing = wantWrite;
+    }
+    
+    // A failed write ends a coroutine that is waiting for input
+    coroutine_handle<> reader = connection->reader;
+    if (connection->closed && reader) {
+        connection->reader = nullptr;
+        reader.resume();
+    }
+}
+
+void EventLoop::closeConnection(AsyncConnection* connection) {
+    int fd = connection->fd;
+    
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    ::close(fd);
+    connections.erase(fd);
+}
+
+void EventLoop::run() {
+    const int maxEvents = 256;
+    struct epoll_event events[maxEvents];
+    
+    while (!stopping) {
+        int timeout = -1;
+        if (acceptPaused) {
+            chrono::steady_clock::duration left = acceptResumes - chrono::steady_clock::now();
+            timeout = max(0, (int)chrono::duration_cast<chrono::milliseconds>(left).count() + 1);
+        }
+        int ready = epoll_wait(epollFd, events, maxEvents, timeout);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (acceptPaused && chrono::steady_clock::now() >= acceptResumes) {
+            acceptPaused = false;
+            watchListener();
+        }
+        
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd) {
+                acceptClients();
+                continue;
+            }
+            if (fd == wakeFd) {
+                resumePosted();
+                continue;
+            }
+            
+            // Skip events for connections closed earlier in this pass
+            unordered_map<int, unique_ptr<AsyncConnection> >::iterator it = connections.find(fd);
+            if (it == connections.end()) {
+                continue;
+            }
+            AsyncConnection* connection = it->second.get();
+            if (events[i].events & EPOLLOUT) {
+                send(connection);
+                if (connections.find(fd) == connections.end()) {
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                receive(connection);
+            }
+        }
+    }
+    
+    // Wake every coroutine still waiting for input so it finishes, then drop what is left
+    vector<int> open;
+    for (unordered_map<int, unique_ptr<AsyncConnection> >::iterator it = connections.begin();
+         it != connections.end(); ++it) {
+        open.push_back(it->first);
+    }
+    for (size_t i = 0; i < open.size(); i++) {
+        unordered_map<int, unique_ptr<AsyncConnection> >::iterator it = connections.find(open[i]);
+        if (it != connections.end()) {
+            it->second->closed = true;
+            send(it->second.get());
+        }
+    }
+    
+    // Coroutines waiting on the request pool still own their connections
+    while (pendingJobs > 0) {
+        struct pollfd wait = {wakeFd, POLLIN, 0};
+        poll(&wait, 1, 100);
+        resumePosted();
+    }
+    while (!connections.empty()) {
+        closeConnection(connections.begin()->second.get());
+    }
+}
+
+// Run the work on the request pool, which posts the coroutine back when it is done
+void EventLoop::PoolAwaiter::await_suspend(coroutine_handle<> handle) {
+    loop.pendingJobs++;
+    requestPool.submit([this, handle]() {
+        work();
+        loop.post(handle);
+    });
+}
+
+// Called from any thread
+void EventLoop::post(coroutine_handle<> handle) {
+    uint64_t one = 1;
+    
+    {
+        lock_guard<mutex> guard(postedLock);
+        posted.push_back(handle);
+    }
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        cout << "Error: unable to wake event loop\n";
+    }
+}
+
+void EventLoop::resumePosted() {
+    uint64_t count;
+    vector<coroutine_handle<> > ready;
+    
+    if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(postedLock);
+        ready.swap(posted);
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+        pendingJobs--;
+        ready[i].resume();
+    }
+}
+
+// Called from another thread
+void EventLoop::stop() {
+    uint64_t one = 1;
+    
+    stopping = true;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        cout << "Error: unable to wake event loop\n";
+    }
+}
+
+// The async server: the same requests as --serve, answered by coroutines on a
+// few epoll loops instead of one thread per connection
+int runAsyncServer(const string& socketPath, int loops) {
+    BillingServer server(socketPath);
+    server.preload();
+    
+    int listenFd = listenOnUnixSocket(socketPath);
+    if (listenFd < 0) {
+        return 1;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    raiseFileLimit();
+    
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    vector<unique_ptr<EventLoop> > eventLoops;
+    vector<thread> threads;
+    for (int i = 0; i < loops; i++) {
+        eventLoops.push_back(unique_ptr<EventLoop>(new EventLoop(listenFd)));
+    }
+    for (int i = 1; i < loops; i++) {
+        threads.push_back(thread(&EventLoop::run, eventLoops[i].get()));
+    }
+    thread signalWaiter([&eventLoops, signals]() {
+        int received;
+        sigwait(&signals, &received);
+        for (size_t i = 0; i < eventLoops.size(); i++) {
+            eventLoops[i]->stop();
+        }
+    });
+    
+    cout << "Serving " << userStore.size() << " users on " << socketPath << " with " << loops
+         << " event loops (Ctrl+C to stop)\n";
+    eventLoops[0]->run();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    signalWaiter.join();
+    ::close(listenFd);
+    unlink(socketPath.c_str());
+    
+    ledgerWriter.flush();
+    usageStats.persist();
+    cout << "Server stopped\n";
+    return 0;
+}
+
+// Start this program as a server in the current directory and wait for its socket
+pid_t startServerProcess(const vector<string>& arguments, const string& socketPath) {
+    pid_t child = fork();
+    if (child == 0) {
+        vector<char*> argv;
+        argv.push_back((char*)"/proc/self/exe");
+        for (size_t i = 0; i < arguments.size(); i++) {
+            argv.push_back((char*)arguments[i].c_str());
+        }
+        argv.push_back(NULL);
+        int devNull = ::open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        execv("/proc/self/exe", &argv[0]);
+        _exit(127);
+    }
+    
+    for (int i = 0; child > 0 && i < 500 && fileSize(socketPath) < 0; i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return child;
+}
+
+// Run the same load test against the thread-per-connection server and the
+// async server at 1 to loops event loops, each on fresh files in a scratch
+// directory. Both answer a reading through submitReading, after it is flushed.
+void benchmarkServers(int sessions, int requestsPerSession, int loops) {
+    const string benchDir = "bench_server";
+    const string socketPath = "bench.sock";
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    
+    vector<vector<string> > servers;
+    vector<string> names;
+    servers.push_back(vector<string>{"--serve", socketPath});
+    names.push_back("threads");
+    for (int n = 1; n <= loops; n *= 2) {
+        servers.push_back(vector<string>{"--serve-async", socketPath, to_string(n)});
+        names.push_back("async x" + to_string(n));
+    }
+    
+    // Every session registers and logs in once; a low hash cost keeps that from dominating
+    setenv("PF_HASH_ITERATIONS", "1000", 1);
+    
+    cout << sessions << " sessions, " << requestsPerSession << " requests each, "
+         << thread::hardware_concurrency() << " hardware threads\n";
+    cout << setw(12) << "server" << setw(14) << "requests/s" << setw(10) << "p50 ms"
+         << setw(10) << "p99 ms" << setw(10) << "max ms" << setw(8) << "errors\n";
+    
+    for (size_t i = 0; i < servers.size(); i++) {
+        remove("users.txt");
+        remove("records.txt");
+        remove("stats.idx");
+        remove("wal.log");
+        
+        pid_t child = startServerProcess(servers[i], socketPath);
+        LoadTestReport report;
+        bool ok = child > 0 && runLoadTest(socketPath, sessions, requestsPerSession, report);
+        if (child > 0) {
+            kill(child, SIGTERM);
+            waitpid(child, NULL, 0);
+        }
+        
+        if (!ok) {
+            cout << setw(12) << names[i] << "  failed\n";
+            continue;
+        }
+        cout << fixed << setw(12) << names[i] << setprecision(0) << setw(14) << (report.requests / report.seconds)
+             << setprecision(1) << setw(10) << report.p50Ms << setw(10) << report.p99Ms
+             << setw(10) << report.maxMs << setw(7) << report.errors << "\n";
+    }
+    
+    remove("users.txt");
+    remove("records.txt");
+    remove("stats.idx");
+    remove("wal.log");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
+}
+
+// SHA-256 (FIPS 180-4)
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotateRight(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256Compress(uint32_t state[8], const unsigned char block[64]) {
+    uint32_t w[64];
+    
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) +
+                      ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static inline void storeDigest(const uint32_t state[8], unsigned char digest[32]) {
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = state[i] >> 24;
+        digest[i * 4 + 1] = state[i] >> 16;
+        digest[i * 4 + 2] = state[i] >> 8;
+        digest[i * 4 + 3] = state[i];
+    }
+}
+
+Sha256::Sha256() : used(0), total(0) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state, initial, sizeof(state));
+}
+
+void Sha256::update(const unsigned char* data, size_t length) {
+    total += length;
+    while (length > 0) {
+        size_t take = min(length, sizeof(block) - used);
+        memcpy(block + used, data, take);
+        used += take;
+        data += take;
+        length -= take;
+        if (used == sizeof(block)) {
+            sha256Compress(state, block);
+            used = 0;
+        }
+    }
+}
+
+void Sha256::finish(unsigned char digest[32]) {
+    uint64_t bits = total * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padLength = (used < 56) ? 56 - used : 120 - used;
+    
+    for (int i = 0; i < 8; i++) {
+        padding[padLength + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    update(padding, padLength + 8);
+    storeDigest(state, digest);
+}
+
+// PBKDF2 with HMAC-SHA256 (RFC 8018). The keyed inner and outer hash states are
+// computed once, so each iteration costs two compressions.
+void pbkdf2Sha256(const string& password, const unsigned char* salt, size_t saltLength,
+                  unsigned iterations, unsigned char* out, size_t outLength) {
+    unsigned char key[64] = {0};
+    if (password.length() > sizeof(key)) {
+        Sha256 keyHash;
+        keyHash.update((const unsigned char*)password.data(), password.length());
+        keyHash.finish(key);
+    } else {
+        memcpy(key, password.data(), password.length());
+    }
+    
+    unsigned char pad[64];
+    Sha256 inner, outer;
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    inner.update(pad, sizeof(pad));
+    for (int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    outer.update(pad, sizeof(pad));
+    
+    for (uint32_t blockIndex = 1; outLength > 0; blockIndex++) {
+        unsigned char counter[4] = {(unsigned char)(blockIndex >> 24), (unsigned char)(blockIndex >> 16),
+                                    (unsigned char)(blockIndex >> 8), (unsigned char)blockIndex};
+        unsigned char u[32], t[32];
+        
+        Sha256 first = inner;
+        first.update(salt, saltLength);
+        first.update(counter, sizeof(counter));
+        first.finish(u);
+        Sha256 firstOuter = outer;
+        firstOuter.update(u, sizeof(u));
+        firstOuter.finish(u);
+        memcpy(t, u, sizeof(t));
+        
+        // Later rounds hash one 32-byte value after a 64-byte key block, so the padded
+        // message block is fixed apart from the value and can be compressed directly
+        unsigned char message[64] = {0};
+        message[32] = 0x80;
+        message[62] = 0x03;   // (64 + 32) * 8 = 768 bits
+        for (unsigned n = 1; n < iterations; n++) {
+            uint32_t state[8];
+            
+            memcpy(message, u, sizeof(u));
+            inner.copyState(state);
+            sha256Compress(state, message);
+            storeDigest(state, message);
+            outer.copyState(state);
+            sha256Compress(state, message);
+            storeDigest(state, u);
+            for (int i = 0; i < 32; i++) {
+                t[i] ^= u[i];
+            }
+        }
+        
+        size_t take = min(outLength, sizeof(t));
+        memcpy(out, t, take);
+        out += take;
+        outLength -= take;
+    }
+}
+
+string toHex(const unsigned char* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    string text(length * 2, '0');
+    
+    for (size_t i = 0; i < length; i++) {
+        text[i * 2] = digits[data[i] >> 4];
+        text[i * 2 + 1] = digits[data[i] & 15];
+    }
+    return text;
+}
+
+bool fromHex(const string& text, vector<unsigned char>& data) {
+    if (text.length() % 2 != 0) {
+        return false;
+    }
+    data.resize(text.length() / 2);
+    for (size_t i = 0; i < data.size(); i++) {
+        int value = 0;
+        for (int k = 0; k < 2; k++) {
+            char c = text[i * 2 + k];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (digit < 0) {
+                return false;
+            }
+            value = value * 16 + digit;
+        }
+        data[i] = value;
+    }
+    return true;
+}
+
+bool randomBytes(unsigned char* out, size_t length) {
+    while (length > 0) {
+        ssize_t got = getrandom(out, length, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        out += got;
+        length -= got;
+    }
+    return true;
+}
+
+// Hash cost for new passwords: PF_HASH_ITERATIONS if set, otherwise 100000
+unsigned passwordIterations() {
+    const unsigned defaultIterations = 100000;
+    const char* setting = getenv("PF_HASH_ITERATIONS");
+    
+    if (setting == NULL) {
+        return defaultIterations;
+    }
+    unsigned long iterations = strtoul(setting, NULL, 10);
+    return (iterations >= 1000 && iterations <= 10000000) ? iterations : defaultIterations;
+}
+
+// Stored form: pbkdf2$<iterations>$<salt hex>$<hash hex>, with a random 16-byte salt
+string hashPassword(const string& password, unsigned iterations) {
+    unsigned char salt[16];
+    unsigned char hash[32];
+    
+    if (!randomBytes(salt, sizeof(salt))) {
+        return "";
+    }
+    pbkdf2Sha256(password, salt, sizeof(salt), iterations, hash, sizeof(hash));
+    return "pbkdf2$" + to_string(iterations) + "$" + toHex(salt, sizeof(salt)) + "$" + toHex(hash, sizeof(hash));
+}
+
+// Check a password against its stored form. outdated is set when the password is
+// right but was stored with the old shift or another cost, and should be re-hashed.
+bool verifyPassword(const string& stored, const string& password, bool& outdated) {
+    outdated = false;
+    
+    vector<string> parts = splitFields(stored, '$');
+    vector<unsigned char> salt, expected;
+    if (parts.size() != 4 || parts[0] != "pbkdf2") {
+        outdated = decryptPassword(stored) == password;
+        return outdated;
+    }
+    unsigned long iterations = strtoul(parts[1].c_str(), NULL, 10);
+    if (iterations == 0 || !fromHex(parts[2], salt) || !fromHex(parts[3], expected) || expected.empty()) {
+        return false;
+    }
+    
+    vector<unsigned char> actual(expected.size());
+    pbkdf2Sha256(password, &salt[0], salt.size(), iterations, &actual[0], actual.size());
+    
+    // Compare every byte so the time taken does not depend on where they differ
+    unsigned char difference = 0;
+    for (size_t i = 0; i < actual.size(); i++) {
+        difference |= actual[i] ^ expected[i];
+    }
+    if (difference != 0) {
+        return false;
+    }
+    outdated = iterations != passwordIterations();
+    return true;
+}
+
+PasswordHasher::PasswordHasher(size_t threads, size_t queueLimit)
+    : threads(threads), queueLimit(queueLimit), stopping(false) {
+}
+
+PasswordHasher::~PasswordHasher() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+// Queue a job; done is called on a pool thread. Fails when the queue is full.
+bool PasswordHasher::submit(const PasswordJob& job, const function<void(const PasswordResult&)>& done) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (queue.size() >= queueLimit) {
+            PF_COUNT(COUNTER_PASSWORD_QUEUE_FULL, 1);
+            return false;
+        }
+        if (workers.empty()) {
+            for (size_t i = 0; i < threads; i++) {
+                workers.push_back(thread(&PasswordHasher::work, this));
+            }
+        }
+        queue.push_back(make_pair(job, done));
+    }
+    wake.notify_one();
+    return true;
+}
+
+// Submit and wait for the result
+PasswordResult PasswordHasher::run(const PasswordJob& job) {
+    promise<PasswordResult> finished;
+    future<PasswordResult> result = finished.get_future();
+    
+    if (!submit(job, [&finished](const PasswordResult& done) { finished.set_value(done); })) {
+        PasswordResult busy = {false, true, ""};
+        return busy;
+    }
+    return result.get();
+}
+
+void PasswordHasher::work() {
+    unique_lock<mutex> guard(lock);
+    
+    while (true) {
+        wake.wait(guard, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        pair<PasswordJob, function<void(const PasswordResult&)> > next = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        
+        PasswordResult result = {false, false, ""};
+        unsigned iterations = passwordIterations();
+        {
+            PF_TIMED(METRIC_PASSWORD_JOB);
+            if (!next.first.verify) {
+                result.stored = hashPassword(next.first.password, iterations);
+                result.ok = !result.stored.empty();
+            } else {
+                bool outdated = false;
+                result.ok = verifyPassword(next.first.stored, next.first.password, outdated);
+                if (outdated) {
+                    result.stored = hashPassword(next.first.password, iterations);
+                }
+            }
+        }
+        next.second(result);
+        
+        guard.lock();
+    }
+}
+
+TaskPool::TaskPool(size_t threads) : threads(threads), stopping(false) {
+}
+
+TaskPool::~TaskPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void TaskPool::submit(const function<void()>& task) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (workers.empty()) {
+            for (size_t i = 0; i < threads; i++) {
+                workers.push_back(thread(&TaskPool::work, this));
+            }
+        }
+        queue.push_back(task);
+    }
+    wake.notify_one();
+}
+
+void TaskPool::work() {
+    unique_lock<mutex> guard(lock);
+    
+    while (true) {
+        wake.wait(guard, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        function<void()> next = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        next();
+        guard.lock();
+    }
+}
+
+// Append a user block through the log
+bool saveUser(const User& user) {
+    PF_TIMED(METRIC_SAVE_USER);
+    ostringstream block;
+    writeUserBlock(block, user);
+    return wal.append(WAL_USERS, block.str().data(), block.str().length(), true);
+}
+
+// Rewrite users.txt with only the latest block of each user, in the order they
+// first registered, once superseded blocks (left by password upgrades) make up an
+// eighth of the users. Checking the fraction keeps a wave of upgrades to one
+// rewrite per eighth. The caller holds usersLock exclusively and makes sure nothing
+// from userStore.find() or view() is in use, since the store is reloaded.
+bool compactUsers() {
+    if (userStore.superseded() == 0 || userStore.superseded() * 8 < userStore.size()) {
+        return true;
+    }
+    
+    bool ok = wal.rewrite(WAL_USERS, [](string_view current, string& compacted) {
+        vector<string_view> blocks;
+        unordered_map<string_view, size_t> positions;
+        NewlineSplitter lines(current.data(), current.size());
+        UserView user;
+        while (nextUserBlock(lines, user)) {
+            string_view last = (user.numberOfMeters() == 2) ? user.meter2Serial : user.meter1Serial;
+            string_view block(user.username.data(), last.data() + last.size() - user.username.data());
+            pair<unordered_map<string_view, size_t>::iterator, bool> found =
+                positions.emplace(user.username, blocks.size());
+            if (found.second) {
+                blocks.push_back(block);
+            } else {
+                blocks[found.first->second] = block;
+            }
+        }
+        compacted.reserve(current.size());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            compacted.append(blocks[i]).append(1, '\n');
+        }
+        userStore.removeSidecars();
+        return true;
+    });
+    // Load the store again while the caller's exclusive lock keeps readers out;
+    // readers only take a shared lock and would otherwise all load it at once
+    userStore.reload();
+    userStore.size();
+    return ok;
+}
+
+SessionCache::SessionCache(size_t maxEntries, int ttlSeconds) : maxEntries(maxEntries), ttlSeconds(ttlSeconds) {
+}
+
+// Drop expired tokens and, past maxEntries, the oldest ones; the caller holds the lock
+void SessionCache::evict(chrono::steady_clock::time_point now) {
+    while (!order.empty()) {
+        unordered_map<string, Entry>::iterator it = tokens.find(order.front());
+        if (it != tokens.end() && it->second.expires > now && tokens.size() <= maxEntries) {
+            break;
+        }
+        if (it != tokens.end()) {
+            tokens.erase(it);
+        }
+        order.pop_front();
+    }
+}
+
+string SessionCache::issue(const string& username) {
+    unsigned char bytes[16];
+    if (!randomBytes(bytes, sizeof(bytes))) {
+        return "";
+    }
+    string token = toHex(bytes, sizeof(bytes));
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    
+    lock_guard<mutex> guard(lock);
+    Entry entry = {username, now + chrono::seconds(ttlSeconds)};
+    tokens[token] = entry;
+    order.push_back(token);
+    evict(now);
+    return token;
+}
+
+bool SessionCache::check(const string& token, string& username) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    
+    lock_guard<mutex> guard(lock);
+    evict(now);
+    unordered_map<string, Entry>::const_iterator it = tokens.find(token);
+    if (it == tokens.end()) {
+        return false;
+    }
+    username = it->second.username;
+    return true;
+}
+
+// Password checks per second through the pool at several costs, with one
+// thread and with every hardware thread, next to the old shift and a token check
+void benchmarkLogins() {
+    const unsigned costs[] = {1000, 10000, 100000, 300000};
+    unsigned hardware = max(1u, thread::hardware_concurrency());
+    vector<unsigned> threadCounts;
+    threadCounts.push_back(1);
+    if (hardware > 1) {
+        threadCounts.push_back(hardware);
+    }
+    
+    cout << hardware << " hardware threads\n";
+    cout << setw(12) << "iterations" << setw(10) << "threads" << setw(14) << "logins/s"
+         << setw(18) << "logins/s/core" << setw(14) << "ms/login\n";
+    
+    for (size_t c = 0; c < sizeof(costs) / sizeof(costs[0]); c++) {
+        string stored = hashPassword("Password@1", costs[c]);
+        setenv("PF_HASH_ITERATIONS", to_string(costs[c]).c_str(), 1);
+        
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            PasswordHasher pool(threadCounts[t], 1 << 20);
+            PasswordJob job = {"Password@1", stored, true};
+            atomic<long long> verified(0);
+            atomic<long long> failed(0);
+            
+            // Keep the pool busy for about a second
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            long long submitted = 0;
+            double seconds = 0;
+            while (seconds < 1.0) {
+                for (unsigned i = 0; i < threadCounts[t] * 2; i++) {
+                    pool.submit(job, [&verified, &failed](const PasswordResult& result) {
+                        (result.ok && result.stored.empty() ? verified : failed)++;
+                    });
+                    submitted++;
+                }
+                while (verified + failed < submitted) {
+                    this_thread::sleep_for(chrono::microseconds(200));
+                }
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            }
+            
+            double rate = verified / seconds;
+            cout << fixed << setprecision(0) << setw(12) << costs[c] << setw(10) << threadCounts[t]
+                 << setw(14) << rate << setw(18) << rate / min(threadCounts[t], hardware)
+                 << setprecision(3) << setw(13) << (1000.0 * threadCounts[t] / rate)
+                 << (failed > 0 ? "  (failures!)" : "") << "\n";
+        }
+    }
+    unsetenv("PF_HASH_ITERATIONS");
+    
+    // What repeat requests cost instead: the old shift, and a session token check
+    const int rounds = 1000000;
+    string legacy = encryptPassword("Password@1");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int matches = 0;
+    for (int i = 0; i < rounds; i++) {
+        matches += decryptPassword(legacy) == "Password@1";
+    }
+    double legacySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    SessionCache cache(10000, 900);
+    string token = cache.issue("user0000001");
+    string username;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        matches += cache.check(token, username);
+    }
+    double tokenSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << setprecision(0);
+    cout << "Legacy shift check : " << (rounds / legacySeconds) << " /s\n";
+    cout << "Session token check: " << (rounds / tokenSeconds) << " /s"
+         << (matches == 2 * rounds ? "" : "  (mismatch!)") << "\n";
+}
+
+// Heap bytes in use, from glibc's allocator statistics
+size_t heapBytesInUse() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Hold the same synthetic ledger (a year of readings per meter) once as
+// BillingRecord structs and once as CompactRecord rows with interned names,
+// and report the heap growth and load time of each
+void reportRecordMemory(size_t count) {
+    const size_t meters = max((size_t)1, count / 12);
+    
+    cout << count << " records over " << meters << " meters\n";
+    cout << "sizeof(BillingRecord) = " << sizeof(BillingRecord) << ", sizeof(CompactRecord) = "
+         << sizeof(CompactRecord) << "\n";
+    cout << setw(16) << "layout" << setw(14) << "heap MB" << setw(18) << "bytes/record" << setw(12) << "load ms\n";
+    
+    double beforeBytes = 0;
+    double afterBytes = 0;
+    int64_t beforePaisa = 0;
+    int64_t afterPaisa = 0;
+    
+    for (int layout = 0; layout < 2; layout++) {
+        size_t base = heapBytesInUse();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<BillingRecord> records;
+        SymbolTable symbols;
+        vector<CompactRecord> compact;
+        
+        if (layout == 0) {
+            records.reserve(count);
+        } else {
+            compact.reserve(count);
+        }
+        for (size_t i = 0; i < count; i++) {
+            char name[32], serial[32];
+            size_t meter = i % meters;
+            int previous = (int)(i / meters) * 150;
+            snprintf(name, sizeof(name), "user%07zu", meter);
+            snprintf(serial, sizeof(serial), "M%zuA", meter);
+            
+            if (layout == 0) {
+                BillingRecord record;
+                record.username = name;
+                record.meterSerial = serial;
+                record.period = SAMPLE_FIRST_PERIOD + (int)(i / meters);
+                record.previousReading = previous;
+                record.currentReading = previous + 150;
+                record.unitsConsumed = 150;
+                record.totalBill = calculateBill(150);
+                records.push_back(record);
+                beforePaisa += amountToPaisa(record.totalBill);
+            } else {
+                CompactRecord record;
+                record.userId = symbols.intern(name);
+                record.serialId = symbols.intern(serial);
+                record.period = SAMPLE_FIRST_PERIOD + (int)(i / meters);
+                record.previousReading = previous;
+                record.currentReading = previous + 150;
+                record.amountPaisa = amountToPaisa(calculateBill(150));
+                compact.push_back(record);
+                afterPaisa += record.amountPaisa;
+            }
+        }
+        double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        double bytes = heapBytesInUse() - base;
+        
+        (layout == 0 ? beforeBytes : afterBytes) = bytes;
+        cout << fixed << setprecision(1) << setw(16) << (layout == 0 ? "BillingRecord" : "CompactRecord")
+             << setw(14) << bytes / 1048576.0 << setw(18) << bytes / count << setw(11) << loadMs << "\n";
+    }
+    
+    cout << setprecision(1) << "Compact layout uses " << (afterBytes > 0 ? beforeBytes / afterBytes : 0.0)
+         << "x less memory" << (beforePaisa == afterPaisa ? "" : " (TOTALS DIFFER!)") << "\n";
+}
+
+// Allocations and bytes the calling thread has asked operator new for so far;
+// false when the counting allocator below is not built in
+bool threadAllocationCounts(uint64_t& allocations, uint64_t& bytes) {
+#ifdef PF_BENCH_ALLOC
+    allocations = threadAllocations;
+    bytes = threadAllocatedBytes;
+    return true;
+#else
+    allocations = bytes = 0;
+    return false;
+#endif
+}
+
+#ifdef PF_BENCH_ALLOC
+// Counting replacements for the global allocation functions, only built for
+// benchmarking with -DPF_BENCH_ALLOC. Each thread counts its own allocations, so
+// the counters cost no synchronisation. They are kept out of line so the compiler
+// never pairs an inlined malloc with a visible free.
+__attribute__((noinline)) void* operator new(size_t size) {
+    threadAllocations++;
+    threadAllocatedBytes += size;
+    void* block = malloc(size == 0 ? 1 : size);
+    if (block == NULL) {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+// Over-aligned requests, which is how the arenas get their blocks
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment) {
+    threadAllocations++;
+    threadAllocatedBytes += size;
+    void* block = NULL;
+    if (posix_memalign(&block, max(sizeof(void*), (size_t)alignment), size == 0 ? 1 : size) != 0) {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+__attribute__((noinline)) void operator delete(void* block) noexcept {
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, align_val_t) noexcept {
+    free(block);
+}
+
+__attribute__((noinline)) void operator delete(void* block, size_t, align_val_t) noexcept {
+    free(block);
+}
+#endif
+
+// Heap allocations, allocated bytes and throughput of each ledger loader over a
+// synthetic records.txt. The first row is the stream-and-heap-map loader the scans
+// used before they moved to LineScanner and arenas, kept as the reference.
+void benchmarkScans(size_t records) {
+    const string benchDir = "bench_scan";
+    const size_t meters = max((size_t)1, records / 12);
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    
+    writeSyntheticLedger("records.txt", records);
+    
+    double megabytes = fileSize("records.txt") / 1048576.0;
+    cout << records << " records over " << meters << " meters, " << fixed << setprecision(1)
+         << megabytes << " MB\n";
+    uint64_t allocations, bytes;
+    bool counted = threadAllocationCounts(allocations, bytes);
+    if (!counted) {
+        cout << "allocation counts unavailable (build with -DPF_BENCH_ALLOC)\n";
+    }
+    cout << setw(24) << "scan" << setw(12) << "allocs" << setw(14) << "allocs/rec" << setw(12) << "bytes/rec"
+         << setw(10) << "MB/s" << setw(10) << "ms\n";
+    
+    // Each scan runs with its containers in scope, so freeing them is timed too
+    function<void(const char*, const function<void()>&)> measure = [&](const char* name, const function<void()>& scan) {
+        uint64_t allocationsBefore, bytesBefore, allocationsAfter, bytesAfter;
+        threadAllocationCounts(allocationsBefore, bytesBefore);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        scan();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        threadAllocationCounts(allocationsAfter, bytesAfter);
+        
+        uint64_t allocations = allocationsAfter - allocationsBefore;
+        cout << setw(24) << name;
+        if (counted) {
+            cout << setw(12) << allocations << setprecision(3) << setw(14) << (double)allocations / records
+                 << setprecision(1) << setw(12) << (double)(bytesAfter - bytesBefore) / records;
+        } else {
+            cout << setw(12) << "-" << setw(14) << "-" << setw(12) << "-";
+        }
+        cout << setprecision(1) << setw(10) << megabytes / seconds << setw(10) << seconds * 1000 << "\n";
+    };
+    
+    size_t checked = 0;
+    measure("istream + heap maps", [&]() {
+        ifstream inFile("records.txt");
+        BillingRecord record;
+        unordered_map<string, UsageAggregate> users, byMeter;
+        while (readBillingRecord(inFile, record)) {
+            int64_t paisa = amountToPaisa(record.totalBill);
+            users[record.username].add(record.unitsConsumed, paisa);
+            byMeter[LedgerIndex::key(record.username, record.meterSerial)].add(record.unitsConsumed, paisa);
+        }
+        checked += users.size();
+    });
+    measure("forEachBillingRecord", [&]() {
+        size_t visited = 0;
+        forEachBillingRecord("records.txt", "", [&](const BillingRecord&) {
+            visited++;
+        });
+        checked += (visited == records) ? 0 : 1;
+    });
+    measure("LedgerIndex load", [&]() {
+        LedgerIndex index("records.txt");
+        checked += (index.size() == meters) ? 0 : 1;
+    });
+    measure("UsageStats rebuild", [&]() {
+        UsageStats stats("records.txt", "stats.idx");
+        const UsageAggregate* first = stats.forUser("user0000000");
+        checked += (first != NULL && first->count > 0) ? 0 : 1;
+    });
+    measure("HistoryIndex refresh", [&]() {
+        HistoryIndex index("records.txt");
+        index.refresh();
+    });
+    
+    // History pages are small, so they are reported per page rather than per record
+    HistoryIndex index("records.txt");
+    HistoryFilter filter = {"", -1, -1};
+    const size_t pages = min(meters, (size_t)10000);
+    size_t total = 0;
+    index.refresh();
+    
+    uint64_t allocationsAfter;
+    threadAllocationCounts(allocations, bytes);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < pages; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "user%07zu", i * (meters / pages));
+        checked += (index.page(name, filter, 0, 5, total).size() == min(total, (size_t)5)) ? 0 : 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    threadAllocationCounts(allocationsAfter, bytes);
+    cout << setw(24) << "history page" << setprecision(1) << setw(12);
+    if (counted) {
+        cout << (double)(allocationsAfter - allocations) / pages;
+    } else {
+        cout << "-";
+    }
+    cout << " allocs/page" << setw(10) << seconds * 1e6 / pages << " us/page\n";
+    
+    if (checked != meters) {
+        cout << "Scan results differ from the generated ledger!\n";
+    }
+    
+    remove("records.txt");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
+}
+
+// records.txt -> records.col
+string columnStoreName(const string& textFile) {
+    string binary = binaryLedgerName(textFile);
+    return binary.substr(0, binary.length() - 4) + ".col";
+}
+
+bool ColumnStore::open(const string& fileName) {
+    memset(parts, 0, sizeof(parts));
+    coveredBytes = 0;
+    meterNames.clear();
+    areaNames.clear();
+    tailNames.clear();
+    tailPeriods.clear();
+    tailAreas.clear();
+    tailMeters.clear();
+    tailUnits.clear();
+    tailAmounts.clear();
+    
+    if (!file.open(fileName) || file.size() < sizeof(ColumnStoreHeader)) {
+        return false;
+    }
+    
+    const ColumnStoreHeader* header = (const ColumnStoreHeader*)file.data();
+    bool valid = memcmp(header->magic, "PFCS", 4) == 0 && header->version == 2 &&
+                 header->dictionaryOffset <= file.size() && header->rowCount <= file.size();
+    uint64_t offsets[COLUMN_COUNT];
+    for (int c = 0; valid && c < COLUMN_COUNT; c++) {
+        offsets[c] = header->columnOffset[c];
+        valid = offsets[c] % 64 == 0 && offsets[c] <= header->dictionaryOffset &&
+                header->rowCount * COLUMN_WIDTHS[c] <= header->dictionaryOffset - offsets[c];
+    }
+    
+    // Meter names first, then area names
+    const char* cursor = file.data() + header->dictionaryOffset;
+    const char* limit = file.data() + file.size();
+    for (uint64_t i = 0; valid && i < header->meterCount + header->areaCount; i++) {
+        uint32_t length;
+        if (limit - cursor < 4) {
+            valid = false;
+            break;
+        }
+        memcpy(&length, cursor, 4);
+        cursor += 4;
+        if ((uint64_t)(limit - cursor) < length) {
+            valid = false;
+            break;
+        }
+        (i < header->meterCount ? meterNames : areaNames).push_back(string_view(cursor, length));
+        cursor += length;
+    }
+    
+    if (valid) {
+        ColumnRows& rows = parts[0];
+        rows.periods = (const uint32_t*)(file.data() + offsets[COLUMN_PERIOD]);
+        rows.areas = (const uint16_t*)(file.data() + offsets[COLUMN_AREA]);
+        rows.meters = (const uint32_t*)(file.data() + offsets[COLUMN_METER]);
+        rows.units = (const int32_t*)(file.data() + offsets[COLUMN_UNITS]);
+        rows.amounts = (const int64_t*)(file.data() + offsets[COLUMN_AMOUNT]);
+        rows.count = header->rowCount;
+        valid = validRows();
+    }
+    if (!valid) {
+        memset(parts, 0, sizeof(parts));
+        meterNames.clear();
+        areaNames.clear();
+        file.close();
+        return false;
+    }
+    
+    coveredBytes = header->sourceBytes;
+    return true;
+}
+
+// The group-by indexes its totals by these ids and periodRows() searches the
+// period column, so a damaged file is rejected once here instead of being read
+// out of bounds: every id must be in its dictionary and the periods ascending
+// within years 1-9999.
+bool ColumnStore::validRows() const {
+    const ColumnRows& rows = parts[0];
+    uint32_t previous = 12;
+    
+    for (size_t i = 0; i < rows.count; i++) {
+        if (rows.periods[i] < previous || rows.meters[i] >= meterNames.size() || rows.areas[i] >= areaNames.size()) {
+            return false;
+        }
+        previous = rows.periods[i];
+    }
+    return previous < 10000 * 12;
+}
+
+// The distinct billing periods of all rows, ascending. The mapped rows are
+// sorted by period, so each of their periods costs one binary search; the tail
+// is in ledger order and is small.
+void ColumnStore::periodsPresent(vector<uint32_t>& periods) const {
+    const uint32_t* end = parts[0].periods + parts[0].count;
+    
+    periods.clear();
+    for (const uint32_t* period = parts[0].periods; period < end; period = upper_bound(period, end, *period)) {
+        periods.push_back(*period);
+    }
+    periods.insert(periods.end(), parts[1].periods, parts[1].periods + parts[1].count);
+    sort(periods.begin(), periods.end());
+    periods.erase(unique(periods.begin(), periods.end()), periods.end());
+}
+
+// Parse the records appended to textFile after the mapped rows, up to its last
+// complete line, into the tail. Returns false when there are more than maxBytes
+// of them or one does not parse; the store is then rebuilt instead.
+bool ColumnStore::catchUp(const string& textFile, uint64_t maxBytes) {
+    long long size = fileSize(textFile);
+    if (size < (long long)coveredBytes || (uint64_t)size - coveredBytes > maxBytes) {
+        return false;
+    }
+    if ((uint64_t)size == coveredBytes) {
+        return true;
+    }
+    
+    LineScanner scanner(textFile, coveredBytes);
+    if (!scanner.isOpen()) {
+        return false;
+    }
+    unordered_map<string_view, uint32_t> meterIds, areaIds;
+    unordered_map<string, uint32_t> userAreas;
+    for (uint32_t i = 0; i < meterNames.size(); i++) {
+        meterIds.emplace(meterNames[i], i);
+    }
+    for (uint32_t i = 0; i < areaNames.size(); i++) {
+        areaIds.emplace(areaNames[i], i);
+    }
+    
+    // Names first seen here get the next id of their dictionary
+    function<uint32_t(unordered_map<string_view, uint32_t>&, vector<string_view>&, string_view)> intern =
+        [&](unordered_map<string_view, uint32_t>& ids, vector<string_view>& names, string_view name) {
+            unordered_map<string_view, uint32_t>::iterator found = ids.find(name);
+            if (found != ids.end()) {
+                return found->second;
+            }
+            tailNames.emplace_back(name);
+            names.push_back(tailNames.back());
+            ids.emplace(names.back(), names.size() - 1);
+            return (uint32_t)(names.size() - 1);
+        };
+    
+    vector<uint32_t> periods, meters;
+    vector<uint16_t> areas;
+    vector<int32_t> units;
+    vector<int64_t> amounts;
+    string_view line, fields[7];
+    uint64_t covered = coveredBytes;
+    while (scanner.next(line)) {
+        int period, used;
+        int64_t paisa;
+        if (!parseColumnRow(line, fields, period, used, paisa)) {
+            if (!scanner.terminated()) {
+                break;
+            }
+            return false;
+        }
+        
+        string user(fields[0]);
+        unordered_map<string, uint32_t>::iterator known = userAreas.find(user);
+        if (known == userAreas.end()) {
+            const User* owner = userStore.find(user);
+            known = userAreas.emplace(user, intern(areaIds, areaNames, (owner == NULL) ? "-" : owner->residentialArea)).first;
+        }
+        if (known->second > UINT16_MAX) {
+            return false;
+        }
+        periods.push_back(period);
+        areas.push_back(known->second);
+        meters.push_back(intern(meterIds, meterNames, fields[1]));
+        units.push_back(used);
+        amounts.push_back(paisa);
+        covered = scanner.offset();
+    }
+    
+    // The tail is small, so a stable sort of its row numbers puts it in period order
+    vector<uint32_t> order(periods.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return periods[a] < periods[b];
+    });
+    for (size_t k = 0; k < order.size(); k++) {
+        tailPeriods.push_back(periods[order[k]]);
+        tailAreas.push_back(areas[order[k]]);
+        tailMeters.push_back(meters[order[k]]);
+        tailUnits.push_back(units[order[k]]);
+        tailAmounts.push_back(amounts[order[k]]);
+    }
+    
+    ColumnRows& rows = parts[1];
+    rows.periods = tailPeriods.data();
+    rows.areas = tailAreas.data();
+    rows.meters = tailMeters.data();
+    rows.units = tailUnits.data();
+    rows.amounts = tailAmounts.data();
+    rows.count = tailPeriods.size();
+    coveredBytes = covered;
+    return true;
+}
+
+// The rows of periods fromPeriod to toPeriod are one run, found by binary search
+void ColumnRows::periodRows(int fromPeriod, int toPeriod, size_t& begin, size_t& end) const {
+    begin = (count == 0) ? 0 : lower_bound(periods, periods + count, (uint32_t)max(0, fromPeriod)) - periods;
+    end = (count == 0 || toPeriod < fromPeriod) ? begin :
+          upper_bound(periods + begin, periods + count, (uint32_t)toPeriod) - periods;
+}
+
+// Header, then each column padded to a 64-byte boundary, then the dictionaries.
+// writeColumn writes exactly rows values of the column it is given. The file is
+// written under a temporary name and renamed into place.
+bool writeColumnStore(const string& columnFile, uint64_t rows, uint64_t sourceBytes,
+                      const SymbolTable& meters, const SymbolTable& areas,
+                      const function<bool(ColumnId, ostream&)>& writeColumn) {
+    ColumnStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PFCS", 4);
+    header.version = 2;
+    header.rowCount = rows;
+    header.sourceBytes = sourceBytes;
+    header.meterCount = meters.size();
+    header.areaCount = areas.size();
+    
+    uint64_t offset = sizeof(header);
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        offset = (offset + 63) / 64 * 64;
+        header.columnOffset[c] = offset;
+        offset += rows * COLUMN_WIDTHS[c];
+    }
+    header.dictionaryOffset = offset;
+    
+    string tempFile = columnFile + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::binary | ios::trunc);
+    const char padding[64] = {0};
+    bool ok = (bool)outFile.write((const char*)&header, sizeof(header));
+    
+    for (int c = 0; ok && c < COLUMN_COUNT; c++) {
+        outFile.write(padding, header.columnOffset[c] - outFile.tellp());
+        ok = writeColumn((ColumnId)c, outFile) &&
+             (uint64_t)outFile.tellp() == header.columnOffset[c] + rows * COLUMN_WIDTHS[c];
+    }
+    const SymbolTable* dictionaries[2] = {&meters, &areas};
+    for (int d = 0; ok && d < 2; d++) {
+        for (size_t i = 0; i < dictionaries[d]->size(); i++) {
+            string_view name = dictionaries[d]->name(i);
+            uint32_t length = name.length();
+            outFile.write((const char*)&length, 4);
+            outFile.write(name.data(), length);
+        }
+    }
+    outFile.close();
+    
+    if (!ok || !outFile || rename(tempFile.c_str(), columnFile.c_str()) != 0) {
+        cout << "Unable to write " << columnFile << "\n";
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Split a records.txt line into its 7 fields and parse the ones records.col keeps
+bool parseColumnRow(string_view line, string_view* fields, int& period, int& used, int64_t& paisa) {
+    int previous, current;
+    period = (splitRecordFields(line, fields, 7) == 7) ? parsePeriod(fields[2]) : -1;
+    return period >= 0 && parseNumber(fields[3], previous) && parseNumber(fields[4], current) &&
+           parseNumber(fields[5], used) && parseAmountPaisa(fields[6], paisa);
+}
+
+// Split records.txt into columns. Meter serials and residential areas (looked up
+// once per user in users.txt) are dictionary encoded. The rows are written in
+// period order by a stable counting sort, so each period is a contiguous run.
+bool buildColumnStore(const string& textFile, const string& columnFile) {
+    LineScanner scanner(textFile, 0);
+    if (!scanner.isOpen()) {
+        cout << "Unable to open " << textFile << "\n";
+        return false;
+    }
+    
+    SymbolTable meters, areas;
+    ScanArena arena;
+    ArenaMap<int> userAreas(arena.resource());
+    vector<uint32_t> periods;
+    vector<uint16_t> areaIds;
+    vector<uint32_t> meterIds;
+    vector<int32_t> units;
+    vector<int64_t> amounts;
+    string_view line, fields[7];
+    uint64_t covered = 0;
+    
+    while (scanner.next(line)) {
+        int period, used;
+        int64_t paisa;
+        if (!parseColumnRow(line, fields, period, used, paisa)) {
+            if (!scanner.terminated()) {
+                break;   // a partial last line is left for the next build
+            }
+            cout << "Unsupported record after byte " << covered << " of " << textFile << "\n";
+            return false;
+        }
+        if (period < 12) {
+            cout << textFile << " has months without a year; run --migrate-periods [year] first\n";
+            return false;
+        }
+        
+        ArenaMap<int>::iterator user = userAreas.find(fields[0]);
+        if (user == userAreas.end()) {
+            const User* owner = userStore.find(string(fields[0]));
+            uint32_t area = areas.intern((owner == NULL) ? "-" : owner->residentialArea);
+            if (area > UINT16_MAX) {
+                cout << "Too many residential areas for " << columnFile << "\n";
+                return false;
+            }
+            user = userAreas.emplace(piecewise_construct, forward_as_tuple(fields[0]), forward_as_tuple(area)).first;
+        }
+        
+        periods.push_back(period);
+        areaIds.push_back(user->second);
+        meterIds.push_back(meters.intern(fields[1]));
+        units.push_back(used);
+        amounts.push_back(paisa);
+        covered = scanner.offset();
+    }
+    
+    vector<uint32_t> order(periods.size());
+    if (!periods.empty()) {
+        uint32_t first = *min_element(periods.begin(), periods.end());
+        vector<size_t> starts(*max_element(periods.begin(), periods.end()) - first + 2, 0);
+        for (size_t i = 0; i < periods.size(); i++) {
+            starts[periods[i] - first + 1]++;
+        }
+        for (size_t p = 1; p < starts.size(); p++) {
+            starts[p] += starts[p - 1];
+        }
+        for (size_t i = 0; i < periods.size(); i++) {
+            order[starts[periods[i] - first]++] = i;
+        }
+    }
+    
+    const size_t chunk = 1 << 16;
+    const char* columns[COLUMN_COUNT] = {(const char*)periods.data(), (const char*)areaIds.data(),
+                                         (const char*)meterIds.data(), (const char*)units.data(),
+                                         (const char*)amounts.data()};
+    if (!writeColumnStore(columnFile, order.size(), covered, meters, areas, [&](ColumnId c, ostream& out) {
+            size_t width = COLUMN_WIDTHS[c];
+            vector<char> buffer(chunk * width);
+            for (size_t start = 0; start < order.size(); start += chunk) {
+                size_t length = min(chunk, order.size() - start);
+                for (size_t k = 0; k < length; k++) {
+                    memcpy(&buffer[k * width], columns[c] + (size_t)order[start + k] * width, width);
+                }
+                if (!out.write(buffer.data(), length * width)) {
+                    return false;
+                }
+            }
+            return true;
+        })) {
+        return false;
+    }
+    cout << "Wrote " << order.size() << " records (" << meters.size() << " meters, " << areas.size()
+         << " areas) into " << columnFile << "\n";
+    return true;
+}
+
+// Open records.col for textFile and parse the records appended since it was
+// built. It is rebuilt first if it is missing or damaged, covers more than the
+// ledger holds, or the tail is over an eighth of what it covers.
+bool openColumnStore(const string& textFile, ColumnStore& store) {
+    string columnFile = columnStoreName(textFile);
+    long long size = fileSize(textFile);
+    
+    if (store.open(columnFile) && store.catchUp(textFile, max((uint64_t)1 << 20, store.sourceBytes() / 8))) {
+        return true;
+    }
+    return size >= 0 && buildColumnStore(textFile, columnFile) && store.open(columnFile) &&
+           store.catchUp(textFile, max((uint64_t)1 << 20, store.sourceBytes() / 8));
+}
+
+// Vectorized group-by. Each batch first computes the group of every row into a
+// small key array, a branch-free loop over narrow columns that the compiler turns
+// into SIMD code, and then adds the batch's units and amounts into the groups.
+// Periods are grouped by their index among the periods present, which are
+// returned in periods, so a stray far-off period adds one group, not the months
+// between. A table from period to index makes the key one lookup.
+void groupColumns(const ColumnStore& store, GroupBy by, vector<GroupTotals>& groups, vector<uint32_t>& periods) {
+    const size_t batchSize = 4096;
+    uint32_t keys[batchSize];
+    vector<uint32_t> periodIndex;
+    uint32_t first = 0;
+    
+    periods.clear();
+    if (by != GROUP_METER) {
+        store.periodsPresent(periods);
+    }
+    if (!periods.empty()) {
+        first = periods.front();
+        periodIndex.assign(periods.back() + 1 - first, 0);
+        for (size_t i = 0; i < periods.size(); i++) {
+            periodIndex[periods[i] - first] = i;
+        }
+    }
+    uint32_t span = periods.size();
+    size_t groupCount = (by == GROUP_AREA_PERIOD) ? store.areaCount() * span :
+                        (by == GROUP_METER) ? store.meterCount() : span;
+    
+    groups.assign(groupCount, GroupTotals());
+    for (int p = 0; p < ColumnStore::PART_COUNT; p++) {
+        const ColumnRows& rows = store.part(p);
+        for (size_t start = 0; start < rows.count; start += batchSize) {
+            size_t length = min(batchSize, rows.count - start);
+            const uint32_t* rowPeriods = rows.periods + start;
+            const uint16_t* areas = rows.areas + start;
+            const uint32_t* meters = rows.meters + start;
+            const int32_t* units = rows.units + start;
+            const int64_t* amounts = rows.amounts + start;
+            
+            switch (by) {
+                case GROUP_AREA_PERIOD:
+                    for (size_t i = 0; i < length; i++) {
+                        keys[i] = areas[i] * span + periodIndex[rowPeriods[i] - first];
+                    }
+                    break;
+                case GROUP_METER:
+                    memcpy(keys, meters, length * sizeof(uint32_t));
+                    break;
+                case GROUP_PERIOD:
+                    for (size_t i = 0; i < length; i++) {
+                        keys[i] = periodIndex[rowPeriods[i] - first];
+                    }
+                    break;
+            }
+            
+            for (size_t i = 0; i < length; i++) {
+                GroupTotals& group = groups[keys[i]];
+                group.records++;
+                group.units += units[i];
+                group.paisa += amounts[i];
+            }
+        }
+    }
+}
+
+// Fleet-wide reports over records.col: units per area and billing period, the top
+// consumers by units, or period-over-period growth
+int runColumnReport(const string& kind, size_t limit) {
+    ColumnStore store;
+    vector<GroupTotals> groups;
+    vector<uint32_t> periods;
+    
+    if (kind != "areas" && kind != "top" && kind != "growth") {
+        cout << "Unknown report: " << kind << " (use areas, top or growth)\n";
+        return 1;
+    }
+    if (!openColumnStore("records.txt", store)) {
+        cout << "Unable to open the columnar ledger\n";
+        return 1;
+    }
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    groupColumns(store, (kind == "areas") ? GROUP_AREA_PERIOD : (kind == "top") ? GROUP_METER : GROUP_PERIOD, groups,
+                 periods);
+    double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << fixed << setprecision(2);
+    if (kind == "areas") {
+        vector<uint32_t> order(store.areaCount());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return store.areaName(a) < store.areaName(b);
+        });
+        
+        size_t span = periods.size();
+        cout << left << setw(20) << "Area" << setw(16) << "Month" << right << setw(10) << "Bills"
+             << setw(14) << "Units" << setw(18) << "Amount (Rs.)\n";
+        for (size_t a = 0; a < order.size(); a++) {
+            for (size_t p = 0; p < span; p++) {
+                const GroupTotals& group = groups[order[a] * span + p];
+                if (group.records > 0) {
+                    cout << left << setw(20) << store.areaName(order[a]) << setw(16)
+                         << periodName(periods[p]) << right
+                         << setw(10) << group.records << setw(14) << group.units << setw(17)
+                         << formatPaisa(group.paisa) << "\n";
+                }
+            }
+        }
+    } else if (kind == "top") {
+        vector<uint32_t> order(groups.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        limit = min(limit, order.size());
+        partial_sort(order.begin(), order.begin() + limit, order.end(), [&](uint32_t a, uint32_t b) {
+            return groups[a].units > groups[b].units || (groups[a].units == groups[b].units && a < b);
+        });
+        
+        cout << right << setw(5) << "Rank" << "  " << left << setw(16) << "Meter" << setw(16) << "Owner" << right
+             << setw(8) << "Bills" << setw(14) << "Units" << setw(18) << "Amount (Rs.)\n";
+        for (size_t i = 0; i < limit; i++) {
+            const GroupTotals& group = groups[order[i]];
+            string_view owner = userStore.ownerOfSerial(store.meterName(order[i]));
+            cout << right << setw(5) << (i + 1) << "  " << left << setw(16) << store.meterName(order[i])
+                 << setw(16) << (owner.empty() ? "-" : owner) << right << setw(8) << group.records
+                 << setw(14) << group.units << setw(17) << formatPaisa(group.paisa) << "\n";
+        }
+    } else {
+        cout << left << setw(16) << "Month" << right << setw(10) << "Bills" << setw(14) << "Units"
+             << setw(18) << "Amount (Rs.)" << setw(10) << "Change\n";
+        long long previous = 0;
+        for (size_t p = 0; p < groups.size(); p++) {
+            const GroupTotals& group = groups[p];
+            if (group.records == 0) {
+                continue;
+            }
+            cout << left << setw(16) << periodName(periods[p]) << right << setw(10) << group.records << setw(14)
+                 << group.units << setw(18) << formatPaisa(group.paisa);
+            if (previous > 0) {
+                cout << setw(8) << showpos << setprecision(1) << 100.0 * (group.units - previous) / previous
+                     << noshowpos << setprecision(2) << "%";
+            }
+            cout << "\n";
+            previous = group.units;
         }
     }
     
+    cout << setprecision(1) << store.rowCount() << " records aggregated in " << queryMs << " ms\n";
     return 0;
 }
 
-void clearScreen() {
-    #ifdef _WIN32
-        system("cls");
-    #else
-        system("clear");
-    #endif
+// Every bill of periods fromPeriod to toPeriod, read from the one run of records.col
+// rows that holds them, merged by period with the matching run of the tail
+int listPeriodBills(int fromPeriod, int toPeriod) {
+    ColumnStore store;
+    if (!openColumnStore("records.txt", store)) {
+        cout << "Unable to open the columnar ledger\n";
+        return 1;
+    }
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t begin[ColumnStore::PART_COUNT], end[ColumnStore::PART_COUNT];
+    for (int p = 0; p < ColumnStore::PART_COUNT; p++) {
+        store.part(p).periodRows(fromPeriod, toPeriod, begin[p], end[p]);
+    }
+    double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    long long units = 0;
+    int64_t paisa = 0;
+    size_t bills = (end[0] - begin[0]) + (end[1] - begin[1]);
+    cout << left << setw(16) << "Month" << setw(16) << "Meter" << setw(16) << "Owner" << setw(20) << "Area"
+         << right << setw(10) << "Units" << setw(18) << "Amount (Rs.)\n";
+    while (begin[0] < end[0] || begin[1] < end[1]) {
+        // Within a period the mapped rows come before the tail's, as in the ledger
+        int p = (begin[1] == end[1] || (begin[0] < end[0] &&
+                 store.part(0).periods[begin[0]] <= store.part(1).periods[begin[1]])) ? 0 : 1;
+        const ColumnRows& rows = store.part(p);
+        size_t i = begin[p]++;
+        string_view meter = store.meterName(rows.meters[i]);
+        string_view owner = userStore.ownerOfSerial(meter);
+        cout << left << setw(16) << periodName(rows.periods[i]) << setw(16) << meter << setw(16)
+             << (owner.empty() ? "-" : owner) << setw(20) << store.areaName(rows.areas[i]) << right
+             << setw(10) << rows.units[i] << setw(17) << formatPaisa(rows.amounts[i]) << "\n";
+        units += rows.units[i];
+        paisa += rows.amounts[i];
+    }
+    cout << fixed << setprecision(3) << bills << " bills, " << units << " units, Rs. " << formatPaisa(paisa)
+         << "; " << bills << " of " << store.rowCount() << " rows found in " << queryMs << " ms\n";
+    return 0;
 }
 
-// Function to get valid integer input
-int getValidInteger(string prompt) {
-    int value;
+// The bills of a meter's last periods, newest first, through the owner's history
+int listMeterPeriods(const string& meterSerial, int periods) {
+    string owner(userStore.ownerOfSerial(meterSerial));
+    const MeterState* state = owner.empty() ? NULL : ledgerIndex.latest(owner, meterSerial);
+    if (state == NULL || state->lastPeriod < 0) {
+        cout << "No bills for meter " << meterSerial << "\n";
+        return 1;
+    }
     
-    while (true) {
-        if (!prompt.empty()) {
-            cout << prompt;
+    HistoryFilter filter = {meterSerial, state->lastPeriod - periods + 1, state->lastPeriod};
+    HistoryResult history = billingHistory(owner, filter, 0, periods);
+    cout << fixed << setprecision(2);
+    for (size_t i = 0; i < history.rows.size(); i++) {
+        const BillingRecord& record = history.rows[i].record;
+        cout << left << setw(16) << periodName(record.period) << right << setw(10) << record.previousReading
+             << setw(10) << record.currentReading << setw(8) << record.unitsConsumed << setw(12)
+             << record.totalBill << "\n";
+    }
+    cout << history.rows.size() << " bills of " << owner << " for meter " << meterSerial << "\n";
+    return 0;
+}
+
+// Write a synthetic records.col straight from generated columns (a year of readings
+// per meter over 40 areas) and time each report's group-by on it
+void benchmarkColumnStore(size_t millions) {
+    const string benchDir = "bench_columns";
+    const uint64_t rows = max((size_t)1, millions) * 1000000ULL;
+    const uint64_t meterCount = rows / 12;
+    const size_t chunk = 1 << 20;
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SymbolTable meters, areas;
+    char name[32];
+    for (uint64_t m = 0; m < meterCount; m++) {
+        snprintf(name, sizeof(name), "M%lluA", (unsigned long long)m);
+        meters.intern(name);
+    }
+    for (int a = 0; a < 40; a++) {
+        areas.intern("Area" + to_string(a));
+    }
+    
+    // Row i is period i / meterCount (from January 2025) of meter i % meterCount
+    int64_t billPaisa[500];
+    for (int units = 0; units < 500; units++) {
+        billPaisa[units] = amountToPaisa(calculateBill(units));
+    }
+    long long expectedUnits = 0;
+    bool written = writeColumnStore("records.col", rows, 0, meters, areas, [&](ColumnId c, ostream& out) {
+        vector<char> buffer(chunk * COLUMN_WIDTHS[c]);
+        for (uint64_t base = 0; base < rows; base += chunk) {
+            size_t length = min((uint64_t)chunk, rows - base);
+            for (size_t k = 0; k < length; k++) {
+                uint64_t i = base + k;
+                uint64_t meter = i % meterCount;
+                int units = (meter * 7 + (i / meterCount) * 13) % 500;
+                switch (c) {
+                    case COLUMN_PERIOD: ((uint32_t*)buffer.data())[k] = SAMPLE_FIRST_PERIOD + i / meterCount; break;
+                    case COLUMN_AREA: ((uint16_t*)buffer.data())[k] = meter % 40; break;
+                    case COLUMN_METER: ((uint32_t*)buffer.data())[k] = meter; break;
+                    case COLUMN_UNITS: ((int32_t*)buffer.data())[k] = units; expectedUnits += units; break;
+                    default: ((int64_t*)buffer.data())[k] = billPaisa[units]; break;
+                }
+            }
+            if (!out.write(buffer.data(), length * COLUMN_WIDTHS[c])) {
+                return false;
+            }
         }
+        return true;
+    });
+    double generateSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    meters = SymbolTable();
+    
+    ColumnStore store;
+    if (!written || !store.open("records.col")) {
+        cout << "Unable to write the benchmark ledger\n";
+    } else {
+        cout << rows << " records, " << meterCount << " meters, 40 areas; records.col "
+             << fixed << setprecision(0) << fileSize("records.col") / 1048576.0 << " MB written in "
+             << setprecision(1) << generateSeconds << " s\n";
+        cout << setw(14) << "query" << setw(10) << "groups" << setw(12) << "first ms" << setw(12) << "warm ms"
+             << setw(16) << "M records/s\n";
         
-        if (cin >> value) {
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            return value;
-        } else {
-            cout << "\nInvalid input! Please enter a valid number.\n";
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        const char* names[3] = {"area x period", "by meter", "by period"};
+        GroupBy kinds[3] = {GROUP_AREA_PERIOD, GROUP_METER, GROUP_PERIOD};
+        vector<GroupTotals> groups;
+        vector<uint32_t> periods;
+        for (int q = 0; q < 3; q++) {
+            double ms[2];
+            for (int run = 0; run < 2; run++) {
+                start = chrono::steady_clock::now();
+                groupColumns(store, kinds[q], groups, periods);
+                ms[run] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            }
+            long long units = 0;
+            for (size_t g = 0; g < groups.size(); g++) {
+                units += groups[g].units;
+            }
+            cout << setw(14) << names[q] << setw(10) << groups.size() << setw(12) << ms[0] << setw(12) << ms[1]
+                 << setw(15) << rows / ms[1] / 1000.0 << (units == expectedUnits ? "" : "  (TOTALS DIFFER!)") << "\n";
+        }
+        
+        // One period is a run of rows, so its total only reads that run; it must
+        // match the period's group above
+        size_t begin, end;
+        long long units = 0;
+        start = chrono::steady_clock::now();
+        store.part(0).periodRows(SAMPLE_FIRST_PERIOD + 6, SAMPLE_FIRST_PERIOD + 6, begin, end);
+        for (size_t i = begin; i < end; i++) {
+            units += store.part(0).units[i];
         }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << setw(14) << "one period" << setw(10) << 1 << setw(12) << ms << setw(12) << ms << setw(15)
+             << (end - begin) / ms / 1000.0
+             << (periods.size() > 6 && periods[6] == SAMPLE_FIRST_PERIOD + 6 && units == groups[6].units ? ""
+                                                                                           : "  (TOTALS DIFFER!)")
+             << "\n";
+    }
+    
+    remove("records.col");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
     }
 }
 
-// Password validation function
-bool isPasswordValid(string password) {
-    if (password.length() < 8) {
-        cout << "\nPassword must be at least 8 characters long!\n";
+// A year of readings per meter (one meter per twelve records), written meter by
+// meter within each month, with consumption spread over all tariff slabs
+void writeSyntheticLedger(const string& fileName, size_t records) {
+    const size_t meters = max((size_t)1, records / 12);
+    ofstream outFile(fileName.c_str(), ios::trunc);
+    BillingRecord record;
+    string out;
+    char name[32], serial[32];
+    
+    for (size_t i = 0; i < records; i++) {
+        size_t meter = i % meters;
+        int month = (int)(i / meters);
+        snprintf(name, sizeof(name), "user%07zu", meter);
+        snprintf(serial, sizeof(serial), "M%zuA", meter);
+        record.username = name;
+        record.meterSerial = serial;
+        record.period = SAMPLE_FIRST_PERIOD + month;
+        record.unitsConsumed = (int)((meter * 7 + month * 13) % 500);
+        record.previousReading = month * 500;
+        record.currentReading = record.previousReading + record.unitsConsumed;
+        record.totalBill = calculateBill(record.unitsConsumed);
+        formatBillingRecord(out, record);
+        if (out.size() > (1 << 20)) {
+            outFile << out;
+            out.clear();
+        }
+    }
+    outFile << out;
+}
+
+FleetAggregate::FleetAggregate() : rejected(0) {
+    for (size_t i = 0; i < SLAB_COUNT; i++) {
+        slabBills[i] = 0;
+        slabUnits[i] = 0;
+    }
+}
+
+void FleetAggregate::add(int units, int64_t paisa) {
+    totals.add(units, paisa);
+    for (size_t i = 0; i < SLAB_COUNT; i++) {
+        int start = DEFAULT_TARIFF.start[i];
+        if (units > start) {
+            slabUnits[i] += min(units, DEFAULT_SLABS[i].upTo) - start;
+        }
+        if (units <= DEFAULT_SLABS[i].upTo) {
+            slabBills[i]++;
+            break;
+        }
+    }
+}
+
+void FleetAggregate::merge(const FleetAggregate& other) {
+    totals.merge(other.totals);
+    for (size_t i = 0; i < SLAB_COUNT; i++) {
+        slabBills[i] += other.slabBills[i];
+        slabUnits[i] += other.slabUnits[i];
+    }
+    rejected += other.rejected;
+}
+
+bool FleetAggregate::operator==(const FleetAggregate& other) const {
+    for (size_t i = 0; i < SLAB_COUNT; i++) {
+        if (slabBills[i] != other.slabBills[i] || slabUnits[i] != other.slabUnits[i]) {
+            return false;
+        }
+    }
+    return totals == other.totals && rejected == other.rejected;
+}
+
+// Reference result: one thread, the ordinary record parser, amounts via amountToPaisa
+bool aggregateFleetSequential(const string& textFile, FleetAggregate& result) {
+    LineScanner scanner(textFile, 0);
+    BillingRecord record;
+    string_view line;
+    
+    result = FleetAggregate();
+    while (scanner.next(line)) {
+        if (parseBillingRecord(line, record)) {
+            result.add(record.unitsConsumed, amountToPaisa(record.totalBill));
+        } else if (line.find_first_not_of(" \t\r") != string_view::npos) {
+            result.rejected++;
+        }
+    }
+    return scanner.isOpen();
+}
+
+// Start of the first line that begins at or after pos
+size_t nextLineStart(const char* data, size_t size, size_t pos) {
+    if (pos == 0 || pos >= size) {
+        return min(pos, size);
+    }
+    const char* newline = (const char*)memchr(data + pos - 1, '\n', size - (pos - 1));
+    return (newline == NULL) ? size : (newline - data) + 1;
+}
+
+// Split the mapped ledger into one byte range per worker, each moved forward to
+// a line start so no record is cut, and aggregate the ranges in parallel. Every
+// worker fills its own partial, and the partials are merged in worker order.
+bool aggregateFleet(const string& textFile, WorkerPool& pool, FleetAggregate& result) {
+    MappedFile file;
+    
+    result = FleetAggregate();
+    if (!file.open(textFile)) {
+        return fileSize(textFile) == 0;   // an empty ledger cannot be mapped
+    }
+    
+    const char* data = file.data();
+    const size_t size = file.size();
+    const int workers = pool.size();
+    vector<FleetAggregate> partials(workers);
+    
+    pool.run([&](int worker) {
+        size_t begin = nextLineStart(data, size, size * worker / workers);
+        size_t end = nextLineStart(data, size, size * (worker + 1) / workers);
+        FleetAggregate local;
+        string_view fields[7];
+        
+        while (begin < end) {
+            const char* newline = (const char*)memchr(data + begin, '\n', end - begin);
+            size_t lineEnd = (newline == NULL) ? end : newline - data;
+            string_view line(data + begin, lineEnd - begin);
+            int previous, current, units;
+            int64_t paisa;
+            
+            size_t count = splitRecordFields(line, fields, 7);
+            if (count == 7 && parseNumber(fields[3], previous) && parseNumber(fields[4], current) &&
+                parseNumber(fields[5], units) && parseAmountPaisa(fields[6], paisa)) {
+                local.add(units, paisa);
+            } else if (count > 0) {
+                local.rejected++;
+            }
+            begin = lineEnd + 1;
+        }
+        partials[worker] = local;
+    });
+    
+    for (int worker = 0; worker < workers; worker++) {
+        result.merge(partials[worker]);
+    }
+    return true;
+}
+
+void printFleetAggregate(const FleetAggregate& fleet) {
+    const UsageAggregate& totals = fleet.totals;
+    
+    cout << fixed << setprecision(2);
+    cout << "Total Bills          : " << totals.count << "\n";
+    cout << "Total Units          : " << totals.totalUnits << " units\n";
+    cout << "Total Amount         : Rs. " << formatPaisa(totals.totalPaisa) << "\n";
+    if (totals.count > 0) {
+        cout << "Average Units/Bill   : " << (double)totals.totalUnits / totals.count << " units\n";
+        cout << "Average Bill         : Rs. " << totals.totalPaisa / 100.0 / totals.count << "\n";
+        cout << "Lowest/Highest Units : " << totals.minUnits << " / " << totals.maxUnits << "\n";
+    }
+    if (fleet.rejected > 0) {
+        cout << "Unreadable lines     : " << fleet.rejected << "\n";
+    }
+    
+    cout << "\n" << left << setw(12) << "Slab" << right << setw(12) << "Bills" << setw(9) << "Share"
+         << setw(16) << "Units charged" << "\n";
+    for (size_t i = 0; i < SLAB_COUNT; i++) {
+        int start = DEFAULT_TARIFF.start[i];
+        string range = (DEFAULT_SLABS[i].upTo == INT_MAX) ? to_string(start + 1) + "+" :
+                       to_string(i == 0 ? 0 : start + 1) + "-" + to_string(DEFAULT_SLABS[i].upTo);
+        double share = (totals.count > 0) ? 100.0 * fleet.slabBills[i] / totals.count : 0.0;
+        cout << left << setw(12) << range << right << setw(12) << fleet.slabBills[i] << setprecision(1)
+             << setw(8) << share << "%" << setw(16) << fleet.slabUnits[i] << "  "
+             << string((size_t)(share / 2.5), '#') << "\n";
+    }
+}
+
+// Parallel aggregation over a synthetic ledger at 1, 2, 4 ... maxThreads threads,
+// each result checked against the sequential reference
+void benchmarkFleetAggregate(size_t records, int maxThreads) {
+    const string benchDir = "bench_fleet";
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    writeSyntheticLedger("records.txt", records);
+    
+    FleetAggregate reference;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    aggregateFleetSequential("records.txt", reference);
+    double referenceMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    double megabytes = fileSize("records.txt") / 1048576.0;
+    
+    cout << records << " records, " << fixed << setprecision(1) << megabytes << " MB, "
+         << thread::hardware_concurrency() << " hardware threads\n";
+    cout << "Sequential reference: " << referenceMs << " ms\n";
+    cout << setw(8) << "threads" << setw(12) << "ms" << setw(12) << "MB/s" << setw(10) << "speedup"
+         << setw(10) << "result\n";
+    
+    double baseMs = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        WorkerPool pool(threads);
+        FleetAggregate fleet;
+        
+        aggregateFleet("records.txt", pool, fleet);   // warm-up, also starts the pool threads
+        start = chrono::steady_clock::now();
+        aggregateFleet("records.txt", pool, fleet);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        if (threads == 1) {
+            baseMs = ms;
+        }
+        cout << setw(8) << threads << setw(12) << ms << setw(12) << megabytes * 1000 / ms << setprecision(2)
+             << setw(10) << baseMs / ms << setprecision(1) << setw(10)
+             << (fleet == reference ? "same" : "DIFFERS") << "\n";
+    }
+    
+    remove("records.txt");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
+}
+
+void BloomFilter::reset(size_t expectedKeys) {
+    bits.assign(max((size_t)1, (expectedKeys * 10 + 63) / 64), 0);
+}
+
+// The seven probes come from two hashes of the key (double hashing)
+void BloomFilter::add(string_view key) {
+    uint64_t h1 = hashBytes(key.data(), key.size(), 14695981039346656037ULL);
+    uint64_t h2 = ((h1 >> 32) | (h1 << 32)) * 0x9E3779B97F4A7C15ULL | 1;
+    uint64_t bitCount = bits.size() * 64;
+    
+    for (int i = 0; i < 7; i++) {
+        uint64_t bit = (h1 + i * h2) % bitCount;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+// An empty filter has not been built, so it cannot rule anything out
+bool BloomFilter::mightContain(string_view key) const {
+    if (bits.empty()) {
+        return true;
+    }
+    uint64_t h1 = hashBytes(key.data(), key.size(), 14695981039346656037ULL);
+    uint64_t h2 = ((h1 >> 32) | (h1 << 32)) * 0x9E3779B97F4A7C15ULL | 1;
+    uint64_t bitCount = bits.size() * 64;
+    
+    for (int i = 0; i < 7; i++) {
+        uint64_t bit = (h1 + i * h2) % bitCount;
+        if ((bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// LEB128 varint; signed values are zigzag-encoded by the caller
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool getVarint(const char*& cursor, const char* limit, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; cursor < limit && shift < 64; shift += 7) {
+        unsigned char byte = *cursor++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+LedgerSegments::LedgerSegments(string textFile, string directory)
+    : textFile(textFile), directory(directory), loaded(false), stopping(false) {
+}
+
+LedgerSegments::~LedgerSegments() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+}
+
+// Read the header and bloom filter of every segment file, in ledger order
+void LedgerSegments::load() {
+    segments.clear();
+    loaded = true;
+    
+    DIR* dir = opendir(directory.c_str());
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name.length() < 5 || (name.substr(name.length() - 4) != ".seg" && name.substr(name.length() - 4) != ".arc")) {
+            continue;
+        }
+        
+        Segment segment;
+        segment.fileName = directory + "/" + name;
+        ifstream inFile(segment.fileName.c_str(), ios::binary);
+        if (!inFile.read((char*)&segment.header, sizeof(SegmentHeader)) ||
+            memcmp(segment.header.magic, "PFSG", 4) != 0 || segment.header.version != 2) {
+            continue;
+        }
+        vector<uint64_t> words(segment.header.bloomWords);
+        if (!inFile.read((char*)words.data(), words.size() * sizeof(uint64_t))) {
+            continue;
+        }
+        segment.meters.assign(words.data(), words.size());
+        segments.push_back(segment);
+    }
+    closedir(dir);
+    
+    // Widest range first at each offset. A crash during compaction can leave an
+    // archive next to the segments it replaced; they hold the same records, so
+    // anything inside a range already kept is skipped.
+    sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) {
+        return a.header.sourceOffset < b.header.sourceOffset ||
+               (a.header.sourceOffset == b.header.sourceOffset && a.header.sourceBytes > b.header.sourceBytes);
+    });
+    vector<Segment> kept;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (kept.empty() || segments[i].header.sourceOffset >=
+                                kept.back().header.sourceOffset + kept.back().header.sourceBytes) {
+            kept.push_back(segments[i]);
+        }
+    }
+    segments.swap(kept);
+}
+
+// How much of records.txt the segments cover
+uint64_t LedgerSegments::sealedBytes() {
+    lock_guard<mutex> guard(lock);
+    if (!loaded) {
+        load();
+    }
+    return segments.empty() ? 0 : segments.back().header.sourceOffset + segments.back().header.sourceBytes;
+}
+
+// Write one segment or archive under a temporary name and rename it into place.
+// The name is the source offset, so files sort in ledger order.
+bool LedgerSegments::writeSegment(const vector<CompactRecord>& rows, const SymbolTable& symbols,
+                                  uint64_t sourceOffset, uint64_t sourceBytes, bool archive) {
+    SegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PFSG", 4);
+    header.version = 2;
+    header.sourceOffset = sourceOffset;
+    header.sourceBytes = sourceBytes;
+    header.recordCount = rows.size();
+    header.symbolCount = symbols.size();
+    header.minPeriod = UINT32_MAX;
+    header.maxPeriod = 0;
+    header.archived = archive ? 1 : 0;
+    
+    unordered_set<uint64_t> meterIds;
+    string body;
+    for (size_t i = 0; i < rows.size(); i++) {
+        const CompactRecord& row = rows[i];
+        header.minPeriod = min(header.minPeriod, (uint32_t)row.period);
+        header.maxPeriod = max(header.maxPeriod, (uint32_t)row.period);
+        meterIds.insert((uint64_t)row.userId << 32 | row.serialId);
+        if (archive) {
+            int64_t values[3] = {row.previousReading, row.unitsConsumed(), row.amountPaisa};
+            putVarint(body, row.userId);
+            putVarint(body, row.serialId);
+            putVarint(body, row.period);
+            for (int v = 0; v < 3; v++) {
+                putVarint(body, ((uint64_t)values[v] << 1) ^ (uint64_t)(values[v] >> 63));
+            }
+        }
+    }
+    if (!archive && !rows.empty()) {
+        body.assign((const char*)&rows[0], rows.size() * sizeof(CompactRecord));
+    }
+    header.rowBytes = body.size();
+    
+    BloomFilter bloom;
+    string meterKey;
+    bloom.reset(meterIds.size());
+    for (unordered_set<uint64_t>::const_iterator it = meterIds.begin(); it != meterIds.end(); it++) {
+        meterKey.assign(symbols.name(*it >> 32)).append(1, '\t').append(symbols.name(*it & 0xFFFFFFFF));
+        bloom.add(meterKey);
+    }
+    header.bloomWords = bloom.words().size();
+    
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)sourceOffset);
+    string fileName = directory + name + (archive ? ".arc" : ".seg");
+    string tempFile = fileName + ".tmp";
+    ofstream outFile(tempFile.c_str(), ios::binary | ios::trunc);
+    outFile.write((const char*)&header, sizeof(header));
+    outFile.write((const char*)bloom.words().data(), bloom.words().size() * sizeof(uint64_t));
+    outFile.write(body.data(), body.size());
+    for (size_t i = 0; i < symbols.size(); i++) {
+        uint32_t length = symbols.name(i).length();
+        outFile.write((const char*)&length, 4);
+        outFile.write(symbols.name(i).data(), length);
+    }
+    outFile.close();
+    
+    if (!outFile || rename(tempFile.c_str(), fileName.c_str()) != 0) {
+        cout << "Unable to write " << fileName << "\n";
+        remove(tempFile.c_str());
         return false;
     }
+    return true;
+}
+
+// Cut the records after the last segment into segments of one billing period each:
+// a period ends where the period changes once it has periodRecords records (or at
+// four times that). The last, still open period stays in records.txt unless
+// sealOpenPeriod is set. The ledger is scanned and the files written without
+// holding lock, so lookups go on meanwhile; sealing is serialized by its own
+// mutex and lock is taken again only to publish the new segments.
+bool LedgerSegments::seal(size_t periodRecords, bool sealOpenPeriod) {
+    lock_guard<mutex> sealGuard(sealing);
+    uint64_t start = sealedBytes();
+    LineScanner scanner(textFile, start);
+    vector<CompactRecord> rows;
+    SymbolTable symbols;
+    BillingRecord record;
+    CompactRecord row;
+    string_view line;
+    uint64_t position = start;
+    int lastPeriod = -1;
+    bool complete = true;
     
-    bool hasCapital = false;
-    bool hasSpecial = false;
+    mkdir(directory.c_str(), 0755);
+    memset(&row, 0, sizeof(row));
+    while (scanner.next(line) && scanner.terminated()) {
+        int period = parseBillingRecord(line, record) ? record.period : -1;
+        if (period < 0) {
+            if (line.find_first_not_of(" \t\r") == string_view::npos) {
+                position += line.length() + 1;
+                continue;
+            }
+            cout << "Unsupported record after byte " << position << " of " << textFile << "\n";
+            complete = false;
+            break;
+        }
+        
+        if (!rows.empty() && ((period != lastPeriod && rows.size() >= periodRecords) || rows.size() >= 4 * periodRecords)) {
+            if (!writeSegment(rows, symbols, start, position - start, false)) {
+                lock_guard<mutex> guard(lock);
+                load();
+                return false;
+            }
+            rows.clear();
+            symbols = SymbolTable();
+            start = position;
+        }
+        
+        row.userId = symbols.intern(record.username);
+        row.serialId = symbols.intern(record.meterSerial);
+        row.previousReading = record.previousReading;
+        row.currentReading = record.currentReading;
+        row.amountPaisa = amountToPaisa(record.totalBill);
+        row.period = period;
+        rows.push_back(row);
+        lastPeriod = period;
+        position += line.length() + 1;
+    }
     
-    for (int i = 0; i < password.length(); i++) {
-        if (password[i] >= 'A' && password[i] <= 'Z') {
-            hasCapital = true;
+    bool ok = !(complete && sealOpenPeriod && !rows.empty()) ||
+              writeSegment(rows, symbols, start, position - start, false);
+    lock_guard<mutex> guard(lock);
+    load();
+    return ok && complete;
+}
+
+// Map a segment or archive and read its symbol table as views into the mapping.
+// rows is left at the first row.
+bool LedgerSegments::openSegment(const Segment& segment, MappedFile& file, const char*& rows,
+                                 vector<string_view>& symbols) {
+    const SegmentHeader& header = segment.header;
+    uint64_t rowOffset = sizeof(SegmentHeader) + header.bloomWords * sizeof(uint64_t);
+    
+    symbols.clear();
+    if (!file.open(segment.fileName) || rowOffset > file.size() || header.rowBytes > file.size() - rowOffset ||
+        (!header.archived && header.rowBytes != header.recordCount * sizeof(CompactRecord))) {
+        return false;
+    }
+    
+    rows = file.data() + rowOffset;
+    const char* cursor = rows + header.rowBytes;
+    const char* limit = file.data() + file.size();
+    for (uint64_t i = 0; i < header.symbolCount; i++) {
+        uint32_t length;
+        if (limit - cursor < 4) {
+            return false;
         }
-        if (password[i] == '!' || password[i] == '@' || password[i] == '#' || 
-            password[i] == '$' || password[i] == '%' || password[i] == '&' || 
-            password[i] == '*') {
-            hasSpecial = true;
+        memcpy(&length, cursor, 4);
+        cursor += 4;
+        if ((uint64_t)(limit - cursor) < length) {
+            return false;
+        }
+        symbols.push_back(string_view(cursor, length));
+        cursor += length;
+    }
+    return true;
+}
+
+// Decode the next varint row of an archive
+bool decodeArchiveRow(const char*& cursor, const char* limit, CompactRecord& row) {
+    uint64_t user, serial, period, values[3];
+    if (!getVarint(cursor, limit, user) || !getVarint(cursor, limit, serial) ||
+        !getVarint(cursor, limit, period) || user > UINT32_MAX || serial > UINT32_MAX) {
+        return false;
+    }
+    for (int v = 0; v < 3; v++) {
+        if (!getVarint(cursor, limit, values[v])) {
+            return false;
         }
+        values[v] = (values[v] >> 1) ^ (0 - (values[v] & 1));
     }
+    row.userId = user;
+    row.serialId = serial;
+    row.period = period;
+    row.previousReading = (int32_t)values[0];
+    row.currentReading = (int32_t)(values[0] + values[1]);
+    row.amountPaisa = (int64_t)values[2];
+    return true;
+}
+
+// Rows and symbols of a segment or archive. A row whose ids fall outside the
+// symbol table fails the whole file.
+bool LedgerSegments::readRows(const Segment& segment, vector<CompactRecord>& rows, vector<string>& symbols) {
+    MappedFile file;
+    const char* cursor;
+    vector<string_view> names;
     
-    if (!hasCapital) {
-        cout << "\nPassword must contain at least one capital letter!\n";
+    if (!openSegment(segment, file, cursor, names)) {
         return false;
     }
+    const char* limit = cursor + segment.header.rowBytes;
+    rows.resize(segment.header.recordCount);
+    for (uint64_t i = 0; i < rows.size(); i++) {
+        if (segment.header.archived) {
+            if (!decodeArchiveRow(cursor, limit, rows[i])) {
+                return false;
+            }
+        } else {
+            memcpy(&rows[i], cursor + i * sizeof(CompactRecord), sizeof(CompactRecord));
+        }
+        if (rows[i].userId >= names.size() || rows[i].serialId >= names.size()) {
+            return false;
+        }
+    }
     
-    if (!hasSpecial) {
-        cout << "\nPassword must contain at least one special character (!@#$%&*)!\n";
+    symbols.assign(names.begin(), names.end());
+    return true;
+}
+
+// The last record of one meter in a segment, if it has one. Only the symbol table
+// is read into memory; the rows are scanned in place, newest first in a segment
+// and front to back in an archive, whose varints cannot be read backwards.
+bool LedgerSegments::findLatest(const Segment& segment, string_view username, string_view meterSerial,
+                                MeterState& state) {
+    MappedFile file;
+    const char* cursor;
+    vector<string_view> symbols;
+    uint32_t userId = UINT32_MAX, serialId = UINT32_MAX;
+    
+    if (!openSegment(segment, file, cursor, symbols)) {
         return false;
     }
+    for (uint32_t i = 0; i < symbols.size(); i++) {
+        if (symbols[i] == username) {
+            userId = i;
+        }
+        if (symbols[i] == meterSerial) {
+            serialId = i;
+        }
+    }
+    if (userId == UINT32_MAX || serialId == UINT32_MAX) {
+        return false;   // a bloom filter false positive
+    }
+    
+    CompactRecord row;
+    bool found = false;
+    memset(&row, 0, sizeof(row));
+    if (!segment.header.archived) {
+        for (uint64_t i = segment.header.recordCount; i-- > 0 && !found;) {
+            memcpy(&row, cursor + i * sizeof(CompactRecord), sizeof(CompactRecord));
+            found = row.userId == userId && row.serialId == serialId;
+        }
+    } else {
+        const char* limit = cursor + segment.header.rowBytes;
+        CompactRecord match = row;
+        for (uint64_t i = 0; i < segment.header.recordCount; i++) {
+            if (!decodeArchiveRow(cursor, limit, row)) {
+                return false;
+            }
+            if (row.userId == userId && row.serialId == serialId) {
+                match = row;
+                found = true;
+            }
+        }
+        row = match;
+    }
+    if (found) {
+        state.lastReading = row.currentReading;
+        state.lastPeriod = row.period;
+    }
+    return found;
+}
+
+// Newest segment first; opened counts the segments actually read
+bool LedgerSegments::latest(const string& username, const string& meterSerial, MeterState& state, size_t* opened) {
+    PF_TIMED(METRIC_SEGMENT_LOOKUP);
+    lock_guard<mutex> guard(lock);
+    if (!loaded) {
+        load();
+    }
     
-    return true;
+    string meterKey = LedgerIndex::key(username, meterSerial);
+    for (size_t i = segments.size(); i-- > 0;) {
+        if (!segments[i].meters.mightContain(meterKey)) {
+            continue;
+        }
+        if (opened != NULL) {
+            (*opened)++;
+        }
+        if (findLatest(segments[i], username, meterSerial, state)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// Simple encryption - shifts each character by 3
-string encryptPassword(string password) {
-    string encrypted = "";
-    for (int i = 0; i < password.length(); i++) {
-        encrypted += char(password[i] + 3);
+// Merge old segments into archives, one per year of the periods they start in,
+// leaving the newest keepRecent files as they are. Each archive is written before
+// the segments it replaces are removed.
+bool LedgerSegments::compact(size_t keepRecent) {
+    lock_guard<mutex> sealGuard(sealing);
+    lock_guard<mutex> guard(lock);
+    if (!loaded) {
+        load();
     }
-    return encrypted;
+    
+    size_t end = (segments.size() > keepRecent) ? segments.size() - keepRecent : 0;
+    size_t i = 0;
+    bool ok = true;
+    while (ok && i < end) {
+        if (segments[i].header.archived) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        uint32_t year = segments[i].header.minPeriod / 12;
+        while (j < end && !segments[j].header.archived && segments[j].header.minPeriod / 12 == year) {
+            j++;
+        }
+        if (j == segments.size() || segments[j].header.minPeriod / 12 == year) {
+            break;   // wait until a segment of the next year is sealed
+        }
+        
+        vector<CompactRecord> merged, rows;
+        vector<string> names;
+        SymbolTable symbols;
+        for (size_t k = i; ok && k < j; k++) {
+            ok = readRows(segments[k], rows, names);
+            for (size_t r = 0; ok && r < rows.size(); r++) {
+                rows[r].userId = symbols.intern(names[rows[r].userId]);
+                rows[r].serialId = symbols.intern(names[rows[r].serialId]);
+                merged.push_back(rows[r]);
+            }
+        }
+        uint64_t offset = segments[i].header.sourceOffset;
+        uint64_t bytes = segments[j - 1].header.sourceOffset + segments[j - 1].header.sourceBytes - offset;
+        ok = ok && writeSegment(merged, symbols, offset, bytes, true);
+        for (size_t k = i; ok && k < j; k++) {
+            remove(segments[k].fileName.c_str());
+        }
+        i = j;
+    }
+    load();
+    return ok;
 }
 
-// Simple decryption - shifts each character back by 3
-string decryptPassword(string encrypted) {
-    string decrypted = "";
-    for (int i = 0; i < encrypted.length(); i++) {
-        decrypted += char(encrypted[i] - 3);
+void LedgerSegments::list() {
+    lock_guard<mutex> guard(lock);
+    if (!loaded) {
+        load();
     }
-    return decrypted;
+    
+    cout << left << setw(30) << "File" << right << setw(12) << "Records" << setw(18) << "Months"
+         << setw(12) << "Ledger KB" << setw(10) << "File KB" << "\n";
+    for (size_t i = 0; i < segments.size(); i++) {
+        const SegmentHeader& header = segments[i].header;
+        string months = periodText(header.minPeriod) + " " + periodText(header.maxPeriod);
+        cout << left << setw(30) << segments[i].fileName << right << setw(12) << header.recordCount
+             << setw(18) << months << setw(12) << header.sourceBytes / 1024 << setw(10)
+             << fileSize(segments[i].fileName) / 1024 << "\n";
+    }
+    uint64_t sealed = segments.empty() ? 0 : segments.back().header.sourceOffset + segments.back().header.sourceBytes;
+    cout << segments.size() << " files; " << sealed << " of " << max(0LL, fileSize(textFile))
+         << " ledger bytes sealed\n";
 }
 
-// Get next month
-string getNextMonth(string currentMonth) {
-    string months[] = {"January", "February", "March", "April", "May", "June", 
-                       "July", "August", "September", "October", "November", "December"};
-    
-    for (int i = 0; i < 12; i++) {
-        if (currentMonth == months[i]) {
-            if (i == 11) {
-                return months[0]; // After December comes January
-            } else {
-                return months[i + 1];
-            }
+// Remove every segment and archive, once records.txt has been rewritten
+void LedgerSegments::clear() {
+    lock_guard<mutex> guard(lock);
+    DIR* dir = opendir(directory.c_str());
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            remove((directory + "/" + entry->d_name).c_str());
         }
     }
-    return "January"; // Default
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    segments.clear();
+    loaded = false;
 }
 
-// Get user details from file
-User getUserDetails(string username) {
-    User user;
-    ifstream inFile("users.txt");
-    
-    if (inFile.is_open()) {
-        string storedUsername, encryptedPassword;
-        while (inFile >> storedUsername) {
-            if (storedUsername == username) {
-                user.username = storedUsername;
-                inFile >> encryptedPassword;
-                inFile.ignore();
-                getline(inFile, user.fullName);
-                getline(inFile, user.streetNumber);
-                getline(inFile, user.residentialArea);
-                inFile >> user.numberOfMeters;
-                inFile.ignore();
-                getline(inFile, user.meter1Serial);
-                if (user.numberOfMeters == 2) {
-                    getline(inFile, user.meter2Serial);
-                }
+// Seal and compact every intervalSeconds on a background thread until destruction
+void LedgerSegments::startCompaction(int intervalSeconds, size_t periodRecords, size_t keepRecent) {
+    if (compactor.joinable()) {
+        return;
+    }
+    compactor = thread([this, intervalSeconds, periodRecords, keepRecent]() {
+        // Started before the servers block SIGINT and SIGTERM, which must not land here
+        sigset_t signals;
+        sigfillset(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, chrono::seconds(intervalSeconds));
+            if (stopping) {
                 break;
-            } else {
-                // Skip this user's data
-                string temp;
-                inFile >> temp;
-                inFile.ignore();
-                for (int i = 0; i < 5; i++) {
-                    getline(inFile, temp);
-                }
             }
+            guard.unlock();
+            seal(periodRecords, false);
+            compact(keepRecent);
+            guard.lock();
         }
-        inFile.close();
-    }
-    
-    return user;
+    });
 }
 
-// Get last meter reading for a specific meter
-int getLastMeterReading(string username, string meterSerial) {
-    ifstream inFile("records.txt");
+// Latest-reading lookups on a growing ledger: a full LedgerIndex load against a
+// lookup through sealed segments, with one monthly segment per period and yearly
+// archives past the newest twelve months
+void benchmarkSegments(size_t meters, int years) {
+    const string benchDir = "bench_segments";
+    const int checkpoints[] = {1, 2, 5, 10, 20, 50};
+    const size_t samples = min(meters, (size_t)1000);
+    
+    mkdir(benchDir.c_str(), 0755);
+    if (chdir(benchDir.c_str()) != 0) {
+        cout << "Unable to enter " << benchDir << "\n";
+        return;
+    }
+    remove("records.txt");
+    
+    cout << meters << " meters billed monthly\n";
+    cout << setw(6) << "years" << setw(11) << "records" << setw(7) << "files" << setw(10) << "text MB"
+         << setw(10) << "seg MB" << setw(14) << "full load ms" << setw(14) << "first ms" << setw(13)
+         << "us/lookup" << setw(13) << "opened/look" << setw(8) << "match\n";
+    
+    LedgerSegments sealer("records.txt", "segments");
+    vector<int> readings(meters, 0);
     BillingRecord record;
-    int lastReading = 0;
-    
-    if (inFile.is_open()) {
-        while (inFile >> record.username) {
-            inFile >> record.meterSerial;
-            inFile.ignore();
-            getline(inFile, record.month);
-            inFile >> record.previousReading >> record.currentReading 
-                   >> record.unitsConsumed >> record.totalBill;
-            inFile.ignore();
-            
-            if (record.username == username && record.meterSerial == meterSerial) {
-                lastReading = record.currentReading;
+    string out;
+    char name[32], serial[32];
+    size_t next = 0;
+    
+    for (int year = 1; year <= years; year++) {
+        ofstream outFile("records.txt", ios::app);
+        for (int month = 0; month < 12; month++) {
+            for (size_t meter = 0; meter < meters; meter++) {
+                snprintf(name, sizeof(name), "user%07zu", meter);
+                snprintf(serial, sizeof(serial), "M%zuA", meter);
+                record.username = name;
+                record.meterSerial = serial;
+                record.period = SAMPLE_FIRST_PERIOD + (year - 1) * 12 + month;
+                record.unitsConsumed = (int)((meter * 7 + (year * 12 + month) * 13) % 500);
+                record.previousReading = readings[meter];
+                record.currentReading = readings[meter] + record.unitsConsumed;
+                record.totalBill = calculateBill(record.unitsConsumed);
+                readings[meter] = record.currentReading;
+                formatBillingRecord(out, record);
+            }
+            outFile << out;
+            out.clear();
+        }
+        outFile.close();
+        sealer.seal(meters, true);
+        sealer.compact(12);
+        
+        if (next >= sizeof(checkpoints) / sizeof(checkpoints[0]) || year != checkpoints[next]) {
+            continue;
+        }
+        next++;
+        
+        // Cold full index: every record is read before the first answer
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        LedgerIndex full("records.txt");
+        full.latest("user0000000", "M0A");
+        double fullMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        // Cold segmented lookup, then distinct meters spread over the fleet
+        start = chrono::steady_clock::now();
+        LedgerSegments segments("records.txt", "segments");
+        LedgerIndex lazy("records.txt", &segments);
+        lazy.latest("user0000000", "M0A");
+        double firstMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        size_t opened = 0, matches = 0;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < samples; i++) {
+            size_t meter = i * (meters / samples);
+            MeterState state;
+            snprintf(name, sizeof(name), "user%07zu", meter);
+            snprintf(serial, sizeof(serial), "M%zuA", meter);
+            const MeterState* expected = full.latest(name, serial);
+            if (segments.latest(name, serial, state, &opened) && expected != NULL &&
+                expected->lastReading == state.lastReading && expected->lastPeriod == state.lastPeriod) {
+                matches++;
+            }
+        }
+        double lookupUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / samples;
+        
+        double segmentBytes = 0;
+        size_t files = 0;
+        DIR* dir = opendir("segments");
+        struct dirent* entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                segmentBytes += fileSize(string("segments/") + entry->d_name);
+                files++;
             }
         }
-        inFile.close();
+        if (dir != NULL) {
+            closedir(dir);
+        }
+        
+        cout << fixed << setw(6) << year << setw(11) << (size_t)year * 12 * meters << setw(7) << files
+             << setprecision(1) << setw(10) << fileSize("records.txt") / 1048576.0 << setw(10)
+             << segmentBytes / 1048576.0 << setw(14) << fullMs << setw(14) << firstMs << setw(13) << lookupUs
+             << setprecision(2) << setw(13) << (double)opened / samples << setw(8)
+             << (matches == samples ? "yes" : "NO") << "\n";
     }
     
-    return lastReading;
+    DIR* dir = opendir("segments");
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            remove((string("segments/") + entry->d_name).c_str());
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    rmdir("segments");
+    remove("records.txt");
+    if (chdir("..") == 0) {
+        rmdir(benchDir.c_str());
+    }
 }
 
-// Get last billing month for a specific meter
-string getLastBillingMonth(string username, string meterSerial) {
-    ifstream inFile("records.txt");
-    BillingRecord record;
-    string lastMonth = "";
-    
-    if (inFile.is_open()) {
-        while (inFile >> record.username) {
-            inFile >> record.meterSerial;
-            inFile.ignore();
-            getline(inFile, record.month);
-            inFile >> record.previousReading >> record.currentReading 
-                   >> record.unitsConsumed >> record.totalBill;
-            inFile.ignore();
-            
-            if (record.username == username && record.meterSerial == meterSerial) {
-                lastMonth = record.month;
+// Register users from a CSV file with the columns username, password, full name,
+// street, area, serial1 and optionally serial2; fields cannot contain commas. A
+// password already in the stored pbkdf2$ form is kept as it is. Names and serials
+// are checked against the filters first, so a new one usually costs no read of
+// users.txt. Accepted rows are hashed on the password pool and appended through
+// the log a batch at a time, with one fsync per batch.
+int importUsers(const string& csvFile, UserStore& store, WriteAheadLog& log) {
+    const size_t batchSize = 256;
+    const size_t maxProblems = 10;
+    ifstream inFile(csvFile.c_str());
+    
+    if (!inFile) {
+        cout << "Unable to open " << csvFile << "\n";
+        return 1;
+    }
+    
+    size_t rows = 0, imported = 0, invalid = 0, takenNames = 0, takenSerials = 0;
+    size_t filterChecks = 0, filterMisses = 0, falsePositives = 0;
+    double hashSeconds = 0;
+    bool indexWasLoaded = store.indexLoaded();
+    bool ok = true;
+    vector<User> batch;
+    unordered_set<string> batchKeys;   // names and serials of the batch, not in the store yet
+    
+    // Taken in this batch, or passed by the filter and confirmed by the index
+    function<bool(const string&, bool)> taken = [&](const string& key, bool serial) {
+        if (batchKeys.count((serial ? "S" : "N") + key) > 0) {
+            return true;
+        }
+        filterChecks++;
+        if (!(serial ? store.mightUseSerial(key) : store.mightExist(key))) {
+            filterMisses++;
+            return false;
+        }
+        bool found = serial ? !store.ownerOfSerial(key).empty() : store.find(key) != NULL;
+        if (!found) {
+            falsePositives++;
+        }
+        return found;
+    };
+    
+    function<bool()> flushBatch = [&]() {
+        vector<promise<PasswordResult> > results(batch.size());
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < batch.size(); i++) {
+            PasswordJob job = {batch[i].password, "", false};
+            if (batch[i].password.compare(0, 7, "pbkdf2$") == 0) {
+                PasswordResult kept = {true, false, batch[i].password};
+                results[i].set_value(kept);
+            } else if (!passwordHasher.submit(job, [&results, i](const PasswordResult& done) { results[i].set_value(done); })) {
+                PasswordResult local = {true, false, hashPassword(job.password, passwordIterations())};
+                results[i].set_value(local);
+            }
+        }
+        
+        // Every result is collected before anything can return, as the pool writes into results
+        ostringstream blocks;
+        bool hashed = true;
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].password = results[i].get_future().get().stored;
+            hashed = hashed && !batch[i].password.empty();
+            writeUserBlock(blocks, batch[i]);
+        }
+        if (!hashed) {
+            return false;
+        }
+        hashSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        string data = blocks.str();
+        if (!log.append(WAL_USERS, data.data(), data.length(), true)) {
+            return false;
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            store.add(batch[i]);
+        }
+        imported += batch.size();
+        batch.clear();
+        batchKeys.clear();
+        return true;
+    };
+    
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string line;
+    size_t lineNumber = 0;
+    while (ok && getline(inFile, line)) {
+        lineNumber++;
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        vector<string> fields = splitFields(line, ',');
+        if (line.empty() || (lineNumber == 1 && fields[0] == "username")) {
+            continue;
+        }
+        rows++;
+        
+        string problem;
+        User user;
+        if (fields.size() < 6 || fields.size() > 7) {
+            problem = "expected 6 or 7 fields";
+        } else {
+            user.username = fields[0];
+            user.password = fields[1];
+            user.fullName = fields[2];
+            user.streetNumber = fields[3];
+            user.residentialArea = fields[4];
+            user.numberOfMeters = fields.size() - 5;
+            user.meter1Serial = fields[5];
+            user.meter2Serial = (user.numberOfMeters == 2) ? fields[6] : "";
+            if (user.username.empty() || user.username.find(' ') != string::npos || user.meter1Serial.empty() ||
+                (user.numberOfMeters == 2 && user.meter2Serial.empty())) {
+                problem = "invalid username or serial";
+            } else if (user.password.compare(0, 7, "pbkdf2$") != 0) {
+                problem = passwordProblem(user.password);
+            }
+        }
+        if (!problem.empty()) {
+            if (invalid++ < maxProblems) {
+                cout << "Line " << lineNumber << ": " << problem << "\n";
             }
+            continue;
+        }
+        
+        if (taken(user.username, false)) {
+            takenNames++;
+            continue;
+        }
+        if (taken(user.meter1Serial, true) ||
+            (user.numberOfMeters == 2 && (user.meter2Serial == user.meter1Serial || taken(user.meter2Serial, true)))) {
+            takenSerials++;
+            continue;
+        }
+        
+        batchKeys.insert("N" + user.username);
+        batchKeys.insert("S" + user.meter1Serial);
+        if (user.numberOfMeters == 2) {
+            batchKeys.insert("S" + user.meter2Serial);
+        }
+        batch.push_back(user);
+        if (batch.size() >= batchSize) {
+            ok = flushBatch();
         }
-        inFile.close();
     }
+    if (ok && !batch.empty()) {
+        ok = flushBatch();
+    }
+    ok = ok && store.persistFilters();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
     
-    return lastMonth;
+    cout << fixed << setprecision(1);
+    cout << "Imported " << imported << " of " << rows << " rows in " << seconds << " s ("
+         << imported / max(seconds, 1e-9) << " users/s, " << hashSeconds << " s hashing passwords; "
+         << rows / max(seconds - hashSeconds, 1e-9) << " rows/s checked and written)\n";
+    cout << "Rejected: " << takenNames << " existing usernames, " << takenSerials << " registered serials, "
+         << invalid << " invalid rows\n";
+    cout << setprecision(3) << "Filter checks: " << filterChecks << ", " << filterMisses
+         << " answered without the user index, " << falsePositives << " false positives ("
+         << 100.0 * falsePositives / max((size_t)1, filterMisses + falsePositives) << "% of new keys)\n";
+    cout << "User index: " << (indexWasLoaded ? "already loaded" : (store.indexLoaded() ? "loaded on a filter hit" : "not loaded"))
+         << "\n";
+    if (!ok) {
+        cout << "Error: the import stopped early; rows up to the last full batch were saved\n";
+    }
+    return ok ? 0 : 1;
 }
 
-void registerUser() {
-    User newUser;
+// Bulk import into an existing user base: about 5% of the rows repeat an existing
+// username and 2% an existing serial. Passwords are hashed at the lowest accepted
+// cost so the rate shows the checking and writing, not PBKDF2.
+void benchmarkImport(size_t existingUsers, size_t rows) {
+    const string benchDir = "bench_import";
+    const string usersFile = benchDir + "/users.txt";
+    const string csvFile = benchDir + "/import.csv";
     
-    clearScreen();
-    cout << "\n========================================\n";
-    cout << "         USER REGISTRATION\n";
-    cout << "========================================\n\n";
+    mkdir(benchDir.c_str(), 0755);
+    remove(usersFile.c_str());
+    remove((benchDir + "/users.bloom").c_str());
+    remove((benchDir + "/users.idx").c_str());
+    setenv("PF_HASH_ITERATIONS", "1000", 1);
     
-    // Username input
-    cout << "Enter Username: ";
-    cin >> newUser.username;
-    cin.ignore();
+    ofstream outFile(usersFile.c_str());
+    for (size_t i = 0; i < existingUsers; i++) {
+        writeUserBlock(outFile, makeSyntheticUser(i));
+    }
+    outFile.close();
     
-    // Check if username already exists
-    if (checkUserExists(newUser.username)) {
-        cout << "\nUsername already exists! Please choose a different username.\n";
-        cout << "Press Enter to continue...";
-        cin.get();
-        return;
+    outFile.open(csvFile.c_str());
+    outFile << "username,password,fullName,street,area,serial1,serial2\n";
+    for (size_t i = 0; i < rows; i++) {
+        string name = "new" + to_string(i);
+        string serial = "N" + to_string(i);
+        if (i % 20 == 7) {
+            name = makeSyntheticUser((i * 7919) % existingUsers).username;
+        } else if (i % 50 == 3) {
+            serial = makeSyntheticUser((i * 104729) % existingUsers).meter1Serial;
+        }
+        outFile << name << ",Import@" << i << ",Imported " << i << "," << i % 500 + 1 << ",Area" << i % 40 << ","
+                << serial << "\n";
     }
+    outFile.close();
     
-    // Full Name input
-    cout << "Enter Full Name: ";
-    getline(cin, newUser.fullName);
+    {
+        // First run: no users.bloom yet, so the filters are built from a full load
+        UserStore cold(usersFile);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        cold.mightExist("nobody");
+        cout << fixed << setprecision(1) << "Built filters over " << existingUsers << " users in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+    }
     
-    // Password input with validation
-    while (true) {
-        cout << "\nPassword Requirements:\n";
-        cout << "- At least 8 characters long\n";
-        cout << "- At least one capital letter (A-Z)\n";
-        cout << "- At least one special character (!@#$%&*)\n\n";
-        cout << "Enter Password: ";
-        getline(cin, newUser.password);
-        
-        if (isPasswordValid(newUser.password)) {
-            break;
-        }
+    {
+        // A fresh process: filters come from users.bloom and the index stays unloaded
+        UserStore store(usersFile);
+        WriteAheadLog log(benchDir + "/wal.log", usersFile, benchDir + "/records.txt");
+        importUsers(csvFile, store, log);
     }
     
-    // Street Number
-    cout << "\nEnter Street Number: ";
-    getline(cin, newUser.streetNumber);
+    const char* files[] = {"users.txt", "users.bloom", "users.idx", "import.csv", "wal.log", "records.txt"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove((benchDir + "/" + files[i]).c_str());
+    }
+    rmdir(benchDir.c_str());
+}
+
+// The record-saving path of the servers on private files: lookupMeter() for the
+// meter's last reading, bill, and saveBillingRecord() through a private log and
+// indexes, flushing and reading back one history page every 1000 records.
+// Returns milliseconds.
+double runMetricsWorkload(const string& directory, size_t records) {
+    const size_t meters = 5000;
+    const string ledger = directory + "/records.txt";
+    const char* files[] = {"records.txt", "users.txt", "wal.log", "stats.idx"};
     
-    // Residential Area
-    cout << "Enter Residential Area Name: ";
-    getline(cin, newUser.residentialArea);
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove((directory + "/" + files[i]).c_str());
+    }
     
-    // Number of Meters
-    while (true) {
-        newUser.numberOfMeters = getValidInteger("\nHow many meters do you have? (Maximum 2): ");
+    double elapsed;
+    {
+        WriteAheadLog log(directory + "/wal.log", directory + "/users.txt", ledger);
+        LedgerWriter writer(log, WAL_RECORDS, 1 << 16, 100, DURABILITY_NONE);
+        LedgerIndex index(ledger);
+        UsageStats stats(ledger, directory + "/stats.idx");
+        HistoryIndex history(ledger);
+        shared_mutex lock;
+        HistoryFilter filter = {"", -1, -1};
+        BillingRecord record;
+        char name[32], serial[32];
+        size_t total = 0;
         
-        if (newUser.numberOfMeters >= 1 && newUser.numberOfMeters <= 2) {
-            break;
-        } else {
-            cout << "Invalid! Please enter 1 or 2 only.\n";
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < records; i++) {
+            size_t meter = i % meters;
+            snprintf(name, sizeof(name), "user%07zu", meter);
+            snprintf(serial, sizeof(serial), "M%zuA", meter);
+            record.username = name;
+            record.meterSerial = serial;
+            
+            const MeterState* state = lookupMeter(index, record.username, record.meterSerial);
+            record.period = (state != NULL) ? nextPeriod(state->lastPeriod) : SAMPLE_FIRST_PERIOD;
+            record.previousReading = (state != NULL) ? state->lastReading : 0;
+            record.unitsConsumed = (int)((i * 7919) % 500);
+            record.currentReading = record.previousReading + record.unitsConsumed;
+            record.totalBill = calculateBill(record.unitsConsumed);
+            
+            saveBillingRecord(record, writer, index, stats, lock);
+            if (i % 1000 == 999) {
+                writer.flush();
+                history.refresh();
+                history.page(record.username, filter, 0, 5, total);
+            }
         }
+        writer.close();
+        elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
     }
     
-    // Meter Serial Numbers
-    cout << "\nEnter Serial Number for Meter 1: ";
-    getline(cin, newUser.meter1Serial);
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove((directory + "/" + files[i]).c_str());
+    }
+    return elapsed;
+}
+
+// Cost of the instrumentation: the workload with recording switched off and on at
+// run time, alternating, best of seven runs each
+void benchmarkMetrics(size_t records) {
+    const string benchDir = "bench_metrics";
     
-    if (newUser.numberOfMeters == 2) {
-        cout << "Enter Serial Number for Meter 2: ";
-        getline(cin, newUser.meter2Serial);
+    mkdir(benchDir.c_str(), 0755);
+    cout << fixed << setprecision(1);
+#ifdef PF_METRICS
+    const int loops = 1000000;
+    double best[2] = {1e300, 1e300};
+    for (int round = 0; round < 7; round++) {
+        for (int enabled = 0; enabled < 2; enabled++) {
+            metricsEnabled = enabled == 1;
+            best[enabled] = min(best[enabled], runMetricsWorkload(benchDir, records));
+        }
     }
+    metricsEnabled = true;
     
-    // Encrypt password before saving
-    string encryptedPassword = encryptPassword(newUser.password);
+    // The difference of two runs is at the mercy of the machine's noise, so the cost
+    // is also worked out from the calls one run records and the price of each kind
+    MetricsSnapshot before, after;
+    metricsRegistry().snapshot(before);
+    double runMs = runMetricsWorkload(benchDir, records);
+    metricsRegistry().snapshot(after);
+    uint64_t calls = 0, timed = 0;
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        calls += after.calls[id] - before.calls[id];
+        timed += after.timed[id] - before.timed[id];
+    }
+    string snapshot;
+    formatMetrics(snapshot, true);
     
-    // Save user to file
-    ofstream outFile("users.txt", ios::app);
-    if (outFile.is_open()) {
-        outFile << newUser.username << " " << encryptedPassword << endl;
-        outFile << newUser.fullName << endl;
-        outFile << newUser.streetNumber << endl;
-        outFile << newUser.residentialArea << endl;
-        outFile << newUser.numberOfMeters << endl;
-        outFile << newUser.meter1Serial << endl;
-        if (newUser.numberOfMeters == 2) {
-            outFile << newUser.meter2Serial << endl;
+    double costNs[2];
+    for (int sampled = 0; sampled < 2; sampled++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < loops; i++) {
+            ScopedTimer timer(METRIC_SERVER_REQUEST, sampled ? 63 : 0);
         }
-        outFile.close();
-        
-        cout << "\n========================================\n";
-        cout << "Registration successful!\n";
-        cout << "Your password is encrypted and stored securely.\n";
-        cout << "========================================\n";
-        cout << "Press Enter to continue...";
-        cin.get();
-    } else {
-        cout << "\nError: Unable to open file!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
+        costNs[sampled] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / loops;
+    }
+    double estimate = (timed * costNs[0] + (calls - timed) * costNs[1]) / (runMs * 1e6) * 100.0;
+    
+    cout << records << " records saved: " << best[0] << " ms with recording off, " << best[1]
+         << " ms on (" << setprecision(2) << 100.0 * (best[1] - best[0]) / best[0] << "% measured)\n";
+    cout << calls << " calls recorded, " << timed << " timed; " << costNs[0] << " ns per timed call, "
+         << costNs[1] << " ns per sampled call: " << setprecision(3) << estimate << "% of a run\n";
+    cout << snapshot;
+#else
+    cout << "Built without -DPF_METRICS, so there is no instrumentation to measure.\n";
+    cout << records << " records saved in " << runMetricsWorkload(benchDir, records) << " ms\n";
+#endif
+    rmdir(benchDir.c_str());
+}
+
+#ifdef PF_METRICS
+// Never destroyed, so threads that finish while the program exits can still detach
+MetricsRegistry& metricsRegistry() {
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return *registry;
+}
+
+ThreadMetrics& threadMetrics() {
+    thread_local ThreadMetrics metrics;
+    return metrics;
+}
+
+// Only the owning thread writes its numbers, so a plain load and store is enough
+static inline void bumpMetric(atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void countMetric(CounterId id, uint64_t amount) {
+    if (metricsEnabled.load(memory_order_relaxed)) {
+        bumpMetric(threadMetrics().counters[id], amount);
+    }
+}
+
+ThreadMetrics::ThreadMetrics() {
+    metricsRegistry().attach(this);
+}
+
+ThreadMetrics::~ThreadMetrics() {
+    metricsRegistry().detach(this);
+}
+
+void MetricsSnapshot::add(const ThreadMetrics& metrics) {
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        calls[id] += metrics.calls[id].load(memory_order_relaxed);
+        timed[id] += metrics.timed[id].load(memory_order_relaxed);
+        nanos[id] += metrics.nanos[id].load(memory_order_relaxed);
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            buckets[id][b] += metrics.buckets[id][b].load(memory_order_relaxed);
+        }
+    }
+    for (int id = 0; id < COUNTER_COUNT; id++) {
+        counters[id] += metrics.counters[id].load(memory_order_relaxed);
+    }
+}
+
+MetricsRegistry::MetricsRegistry() {
+    memset(&retired, 0, sizeof(retired));
+}
+
+void MetricsRegistry::attach(ThreadMetrics* metrics) {
+    lock_guard<mutex> guard(lock);
+    threads.push_back(metrics);
+}
+
+// A finishing thread's numbers are folded into the retired totals
+void MetricsRegistry::detach(ThreadMetrics* metrics) {
+    lock_guard<mutex> guard(lock);
+    retired.add(*metrics);
+    threads.erase(remove(threads.begin(), threads.end(), metrics), threads.end());
+}
+
+void MetricsRegistry::snapshot(MetricsSnapshot& out) {
+    lock_guard<mutex> guard(lock);
+    out = retired;
+    for (size_t i = 0; i < threads.size(); i++) {
+        out.add(*threads[i]);
+    }
+}
+
+ScopedTimer::ScopedTimer(MetricId id, uint64_t sampleMask) : id(id), timing(false) {
+    if (!metricsEnabled.load(memory_order_relaxed)) {
+        return;
+    }
+    ThreadMetrics& metrics = threadMetrics();
+    uint64_t calls = metrics.calls[id].load(memory_order_relaxed) + 1;
+    metrics.calls[id].store(calls, memory_order_relaxed);
+    if ((calls & sampleMask) == 0) {
+        timing = true;
+        start = chrono::steady_clock::now();
     }
 }
 
-bool checkUserExists(string username) {
-    ifstream inFile("users.txt");
-    string storedUsername, storedPassword;
+ScopedTimer::~ScopedTimer() {
+    if (!timing) {
+        return;
+    }
+    uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    ThreadMetrics& metrics = threadMetrics();
+    bumpMetric(metrics.timed[id], 1);
+    bumpMetric(metrics.nanos[id], nanos);
+    bumpMetric(metrics.buckets[id][min(METRIC_BUCKETS - 1, (int)bit_width(nanos))], 1);
+}
+
+// Upper bound of the bucket holding the given fraction of the timed calls
+double metricPercentileUs(const uint64_t* buckets, uint64_t count, double fraction) {
+    uint64_t target = max((uint64_t)1, (uint64_t)(fraction * count + 0.999999));
+    uint64_t seen = 0;
+    
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= target) {
+            return (double)(1ULL << b) / 1000.0;
+        }
+    }
+    return (double)(1ULL << METRIC_BUCKETS) / 1000.0;
+}
+
+// Prometheus text, or JSON with a few percentiles. Operations never called are left
+// out. The histogram is exported at fixed bounds from about 1 us to 4 s.
+void formatMetrics(string& out, bool json) {
+    MetricsSnapshot snapshot;
+    char text[512];
     
-    if (inFile.is_open()) {
-        while (inFile >> storedUsername >> storedPassword) {
-            if (storedUsername == username) {
-                inFile.close();
-                return true;
+    metricsRegistry().snapshot(snapshot);
+    if (json) {
+        out += "{\"operations\": [";
+        bool first = true;
+        for (int id = 0; id < METRIC_COUNT; id++) {
+            if (snapshot.calls[id] == 0) {
+                continue;
             }
-            // Skip rest of user data
-            string temp;
-            inFile.ignore();
-            for (int i = 0; i < 5; i++) {
-                getline(inFile, temp);
+            uint64_t timed = snapshot.timed[id];
+            snprintf(text, sizeof(text),
+                     "%s\n  {\"name\": \"%s\", \"calls\": %llu, \"timed\": %llu, \"total_seconds\": %.6f, "
+                     "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+                     first ? "" : ",", METRIC_NAMES[id], (unsigned long long)snapshot.calls[id],
+                     (unsigned long long)timed, snapshot.nanos[id] / 1e9,
+                     timed > 0 ? snapshot.nanos[id] / 1000.0 / timed : 0.0,
+                     timed > 0 ? metricPercentileUs(snapshot.buckets[id], timed, 0.50) : 0.0,
+                     timed > 0 ? metricPercentileUs(snapshot.buckets[id], timed, 0.99) : 0.0);
+            out += text;
+            first = false;
+        }
+        out += "\n], \"counters\": {";
+        for (int id = 0; id < COUNTER_COUNT; id++) {
+            snprintf(text, sizeof(text), "%s\"%s\": %llu", id == 0 ? "" : ", ", COUNTER_NAMES[id],
+                     (unsigned long long)snapshot.counters[id]);
+            out += text;
+        }
+        out += "}}\n";
+        return;
+    }
+    
+    out += "# HELP pf_operation_calls_total Calls of each instrumented operation.\n";
+    out += "# TYPE pf_operation_calls_total counter\n";
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        if (snapshot.calls[id] > 0) {
+            snprintf(text, sizeof(text), "pf_operation_calls_total{operation=\"%s\"} %llu\n", METRIC_NAMES[id],
+                     (unsigned long long)snapshot.calls[id]);
+            out += text;
+        }
+    }
+    out += "# HELP pf_operation_seconds Latency of the timed calls; the cheapest operations are sampled.\n";
+    out += "# TYPE pf_operation_seconds histogram\n";
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        if (snapshot.calls[id] == 0) {
+            continue;
+        }
+        uint64_t below = 0;
+        int b = 0;
+        for (int bound = 10; bound <= 32; bound += 2) {
+            for (; b <= bound; b++) {
+                below += snapshot.buckets[id][b];
             }
+            snprintf(text, sizeof(text), "pf_operation_seconds_bucket{operation=\"%s\",le=\"%.10g\"} %llu\n",
+                     METRIC_NAMES[id], (double)(1ULL << bound) / 1e9, (unsigned long long)below);
+            out += text;
         }
-        inFile.close();
+        snprintf(text, sizeof(text),
+                 "pf_operation_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n"
+                 "pf_operation_seconds_sum{operation=\"%s\"} %.9f\n"
+                 "pf_operation_seconds_count{operation=\"%s\"} %llu\n",
+                 METRIC_NAMES[id], (unsigned long long)snapshot.timed[id], METRIC_NAMES[id],
+                 snapshot.nanos[id] / 1e9, METRIC_NAMES[id], (unsigned long long)snapshot.timed[id]);
+        out += text;
+    }
+    for (int id = 0; id < COUNTER_COUNT; id++) {
+        snprintf(text, sizeof(text), "# TYPE pf_%s_total counter\npf_%s_total %llu\n", COUNTER_NAMES[id],
+                 COUNTER_NAMES[id], (unsigned long long)snapshot.counters[id]);
+        out += text;
     }
-    return false;
 }
 
-void loginUser() {
-    User loginUser;
-    
-    clearScreen();
-    cout << "\n========================================\n";
-    cout << "            USER LOGIN\n";
-    cout << "========================================\n\n";
+MetricsExporter::MetricsExporter() : json(false), intervalSeconds(10), listenFd(-1), stopping(false) {
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+// Read the PF_METRICS_* settings and start the export thread if there is anywhere to export to
+void MetricsExporter::start() {
+    const char* enabled = getenv("PF_METRICS");
+    const char* file = getenv("PF_METRICS_FILE");
+    const char* socketName = getenv("PF_METRICS_SOCKET");
+    const char* format = getenv("PF_METRICS_FORMAT");
+    const char* interval = getenv("PF_METRICS_INTERVAL");
     
-    cout << "Enter Username: ";
-    cin >> loginUser.username;
-    cout << "Enter Password: ";
-    cin >> loginUser.password;
+    metricsEnabled = enabled == NULL || strcmp(enabled, "0") != 0;
+    fileName = (file != NULL) ? file : "";
+    socketPath = (socketName != NULL) ? socketName : "";
+    json = format != NULL && strcmp(format, "json") == 0;
+    if (interval != NULL && atoi(interval) > 0) {
+        intervalSeconds = atoi(interval);
+    }
+    if (!metricsEnabled) {
+        return;
+    }
     
-    if (validateLogin(loginUser.username, loginUser.password)) {
-        cout << "\nLogin successful! Welcome, " << loginUser.username << "!\n";
-        cout << "Press Enter to continue...";
-        cin.ignore();
-        cin.get();
-        mainMenu(loginUser.username);
-    } else {
-        cout << "\nInvalid username or password!\n";
-        cout << "Press Enter to continue...";
-        cin.ignore();
-        cin.get();
+    if (!socketPath.empty()) {
+        listenFd = listenOnUnixSocket(socketPath);
+        if (listenFd < 0) {
+            cout << "Unable to serve metrics on " << socketPath << "\n";
+        }
+    }
+    if (listenFd >= 0 || !fileName.empty()) {
+        worker = thread(&MetricsExporter::run, this);
+    }
+}
+
+// Stop the thread and write the file one last time; later calls do nothing
+void MetricsExporter::stop() {
+    if (stopping.exchange(true)) {
+        return;
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+        listenFd = -1;
+    }
+    if (metricsEnabled && !fileName.empty()) {
+        writeFile();
     }
 }
 
-bool validateLogin(string username, string password) {
-    ifstream inFile("users.txt");
-    string storedUsername, storedEncryptedPassword;
+// Answer socket connections as they come and rewrite the file every interval.
+// poll() skips a negative descriptor, so without a socket it only waits.
+void MetricsExporter::run() {
+    // Signals belong to the main thread or a server's signal thread, never this one
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
     
-    if (inFile.is_open()) {
-        while (inFile >> storedUsername >> storedEncryptedPassword) {
-            if (storedUsername == username) {
-                string storedPassword = decryptPassword(storedEncryptedPassword);
-                if (storedPassword == password) {
-                    inFile.close();
-                    return true;
-                }
-            }
-            // Skip rest of user data
-            string temp;
-            inFile.ignore();
-            for (int i = 0; i < 5; i++) {
-                getline(inFile, temp);
+    chrono::steady_clock::time_point nextWrite = chrono::steady_clock::now() + chrono::seconds(intervalSeconds);
+    
+    while (!stopping) {
+        struct pollfd ready = {listenFd, POLLIN, 0};
+        if (poll(&ready, 1, 200) > 0) {
+            int clientFd = accept(listenFd, NULL, NULL);
+            if (clientFd >= 0) {
+                string snapshot;
+                formatMetrics(snapshot, json);
+                writeFully(clientFd, snapshot.data(), snapshot.length(), -1);
+                close(clientFd);
             }
         }
-        inFile.close();
+        if (!fileName.empty() && chrono::steady_clock::now() >= nextWrite) {
+            writeFile();
+            nextWrite = chrono::steady_clock::now() + chrono::seconds(intervalSeconds);
+        }
     }
-    return false;
 }
 
-void mainMenu(string username) {
-    int choice;
+bool MetricsExporter::writeFile() {
+    string snapshot;
+    string tempFile = fileName + ".tmp";
     
-    while (true) {
-        clearScreen();
-        cout << "\n========================================\n";
-        cout << "         MAIN MENU - " << username << "\n";
-        cout << "========================================\n\n";
-        cout << "1. Enter Meter Reading\n";
-        cout << "2. View Billing History\n";
-        cout << "3. View Usage Statistics\n";
-        cout << "4. Logout\n";
-        cout << "\nEnter your choice: ";
-        choice = getValidInteger("");
-        
-        switch (choice) {
-            case 1:
-                enterMeterReading(username);
-                break;
-            case 2:
-                displayBillingHistory(username);
-                break;
-            case 3:
-                displayStatistics(username);
-                break;
-            case 4:
-                cout << "\nLogging out...\n";
-                return;
-            default:
-                cout << "\nInvalid choice! Please enter 1, 2, 3, or 4.\n";
-                cout << "Press Enter to continue...";
-                cin.get();
-        }
+    formatMetrics(snapshot, json);
+    ofstream outFile(tempFile.c_str(), ios::trunc);
+    outFile << snapshot;
+    outFile.close();
+    if (!outFile || rename(tempFile.c_str(), fileName.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
     }
+    return true;
 }
+#endif
 
-void enterMeterReading(string username) {
-    clearScreen();
-    
-    User user = getUserDetails(username);
+// splitmix64: a small, fast generator whose sequence depends only on the seed
+uint64_t splitMix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Write users.txt and records.txt for spec into directory, which must not hold
+// either file yet. User i is user%07d with the password Bench@1234, stored as a
+// PBKDF2 hash at the current cost with a salt taken from the seed; every user
+// shares it so the files are quick to write. Records go month by month from
+// January 2025 over all meters, as a real ledger grows, with 50-499 units per month.
+bool generateDataset(const string& directory, const DatasetSpec& spec) {
+    const string usersFile = directory + "/users.txt";
+    const string recordsFile = directory + "/records.txt";
+    const char* sidecars[] = {"users.bloom", "users.idx", "stats.idx", "records.bin", "records.col", "wal.log"};
     
-    cout << "\n========================================\n";
-    cout << "       MONTHLY METER READING\n";
-    cout << "========================================\n";
-    cout << "User: " << user.fullName << "\n";
-    cout << "Address: " << user.streetNumber << ", " << user.residentialArea << "\n";
-    cout << "========================================\n\n";
+    mkdir(directory.c_str(), 0755);
+    if (fileSize(usersFile) >= 0 || fileSize(recordsFile) >= 0) {
+        cout << "Not overwriting the users.txt or records.txt already in " << directory << "\n";
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+        remove((directory + "/" + sidecars[i]).c_str());
+    }
     
-    // Select which meter to enter reading for
-    int meterChoice;
-    string selectedMeter;
+    uint64_t state = spec.seed;
+    unsigned char salt[16], hash[32];
+    for (size_t i = 0; i < sizeof(salt); i++) {
+        salt[i] = (unsigned char)splitMix64(state);
+    }
+    unsigned iterations = passwordIterations();
+    pbkdf2Sha256("Bench@1234", salt, sizeof(salt), iterations, hash, sizeof(hash));
+    string stored = "pbkdf2$" + to_string(iterations) + "$" + toHex(salt, sizeof(salt)) + "$" + toHex(hash, sizeof(hash));
     
-    if (user.numberOfMeters == 1) {
-        cout << "Meter Serial: " << user.meter1Serial << "\n\n";
-        selectedMeter = user.meter1Serial;
-    } else {
-        cout << "Select Meter:\n";
-        cout << "1. Meter 1 (Serial: " << user.meter1Serial << ")\n";
-        cout << "2. Meter 2 (Serial: " << user.meter2Serial << ")\n\n";
-        meterChoice = getValidInteger("Enter choice (1 or 2): ");
-        
-        if (meterChoice == 1) {
-            selectedMeter = user.meter1Serial;
-        } else if (meterChoice == 2) {
-            selectedMeter = user.meter2Serial;
-        } else {
-            cout << "\nInvalid choice!\n";
-            cout << "Press Enter to continue...";
-            cin.get();
-            return;
+    ofstream usersOut(usersFile.c_str());
+    vector<string> names(spec.users);
+    vector<string> serials(spec.users * spec.metersPerUser);
+    char text[32];
+    for (size_t i = 0; i < spec.users; i++) {
+        User user = User();
+        snprintf(text, sizeof(text), "user%07zu", i);
+        names[i] = user.username = text;
+        user.password = stored;
+        user.fullName = "Customer " + to_string(i);
+        user.streetNumber = to_string(splitMix64(state) % 500 + 1);
+        user.residentialArea = "Area" + to_string(splitMix64(state) % 40);
+        user.numberOfMeters = spec.metersPerUser;
+        serials[i * spec.metersPerUser] = user.meter1Serial = "M" + to_string(i) + "A";
+        if (spec.metersPerUser == 2) {
+            serials[i * 2 + 1] = user.meter2Serial = "M" + to_string(i) + "B";
         }
+        writeUserBlock(usersOut, user);
     }
+    usersOut.close();
     
+    ofstream recordsOut(recordsFile.c_str());
+    vector<int> readings(serials.size(), 0);
     BillingRecord record;
-    record.username = username;
-    record.meterSerial = selectedMeter;
+    string out;
+    for (int month = 0; month < spec.months; month++) {
+        for (size_t meter = 0; meter < serials.size(); meter++) {
+            record.username = names[meter / spec.metersPerUser];
+            record.meterSerial = serials[meter];
+            record.period = SAMPLE_FIRST_PERIOD + month;
+            record.unitsConsumed = 50 + (int)(splitMix64(state) % 450);
+            record.previousReading = readings[meter];
+            record.currentReading = readings[meter] + record.unitsConsumed;
+            record.totalBill = calculateBill(record.unitsConsumed);
+            readings[meter] = record.currentReading;
+            formatBillingRecord(out, record);
+            if (out.length() >= (1 << 20)) {
+                recordsOut << out;
+                out.clear();
+            }
+        }
+    }
+    recordsOut << out;
+    recordsOut.close();
     
-    // Get or input month
-    string lastMonth = getLastBillingMonth(username, selectedMeter);
+    if (!usersOut || !recordsOut) {
+        cout << "Unable to write the data set in " << directory << "\n";
+        return false;
+    }
+    cout << "Wrote " << spec.users << " users with " << serials.size() << " meters and "
+         << serials.size() * spec.months << " records to " << directory << "\n";
+    return true;
+}
+
+// Generate a data set in bench_suite/ and time the operations behind the menus
+// against it: cold loads, register, login, last-reading lookup, history,
+// statistics and bill calculation. Users and meters are picked from a fixed seed
+// so every run does the same work. The results go to resultsFile as JSON with
+// one operation per line, for --bench-compare.
+int runBenchmarkSuite(const DatasetSpec& spec, const string& resultsFile) {
+    const string benchDir = "bench_suite";
+    const size_t passwordOps = 20;
+    const size_t lookupOps = 100000;
+    const size_t historyOps = 10000;
+    const size_t billOps = 10000000;
+    const char* files[] = {"users.txt", "records.txt", "users.bloom", "users.idx", "stats.idx", "wal.log"};
     
-    if (lastMonth.empty()) {
-        // First time billing for this meter
-        cout << "\nAvailable months:\n";
-        string months[] = {"January", "February", "March", "April", "May", "June", 
-                          "July", "August", "September", "October", "November", "December"};
-        for (int i = 0; i < 12; i++) {
-            cout << (i + 1) << ". " << months[i] << "\n";
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove((benchDir + "/" + files[i]).c_str());
+    }
+    if (!generateDataset(benchDir, spec)) {
+        return 1;
+    }
+    
+    vector<SuiteResult> results;
+    uint64_t state = spec.seed;
+    size_t meters = spec.users * spec.metersPerUser;
+    
+    // Run op(i) for i < count, timing batches of batch calls
+    function<void(const string&, size_t, size_t, const function<void(size_t)>&)> measure =
+        [&](const string& name, size_t count, size_t batch, const function<void(size_t)>& op) {
+            vector<double> batchUs;
+            for (size_t done = 0; done < count; done += batch) {
+                size_t end = min(count, done + batch);
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                for (size_t i = done; i < end; i++) {
+                    op(i);
+                }
+                batchUs.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() /
+                                  (end - done));
+            }
+            SuiteResult result;
+            result.name = name;
+            result.operations = count;
+            result.totalMs = 0;
+            for (size_t i = 0; i < batchUs.size(); i++) {
+                result.totalMs += batchUs[i] * min(batch, count - i * batch) / 1000.0;
+            }
+            result.meanUs = result.totalMs * 1000.0 / count;
+            sort(batchUs.begin(), batchUs.end());
+            result.p50Us = batchUs[(batchUs.size() - 1) / 2];
+            result.p99Us = batchUs[(batchUs.size() - 1) * 99 / 100];
+            results.push_back(result);
+        };
+    
+    {
+        WriteAheadLog log(benchDir + "/wal.log", benchDir + "/users.txt", benchDir + "/records.txt");
+        UserStore store(benchDir + "/users.txt");
+        LedgerIndex index(benchDir + "/records.txt");
+        HistoryIndex history(benchDir + "/records.txt");
+        UsageStats stats(benchDir + "/records.txt", benchDir + "/stats.idx");
+        HistoryFilter filter = {"", -1, -1};
+        vector<size_t> picks(lookupOps);
+        for (size_t i = 0; i < picks.size(); i++) {
+            picks[i] = splitMix64(state) % meters;
         }
-        int monthChoice = getValidInteger("\nSelect month (1-12): ");
-        if (monthChoice >= 1 && monthChoice <= 12) {
-            record.month = months[monthChoice - 1];
-        } else {
-            record.month = "January";
+        vector<string> names(spec.users);
+        vector<string> serials(meters);
+        char text[32];
+        for (size_t i = 0; i < meters; i++) {
+            snprintf(text, sizeof(text), "user%07zu", i / spec.metersPerUser);
+            names[i / spec.metersPerUser] = text;
+            serials[i] = "M" + to_string(i / spec.metersPerUser) + ((i % spec.metersPerUser == 0) ? "A" : "B");
         }
-    } else {
-        // Auto-generate next month
-        record.month = getNextMonth(lastMonth);
-        cout << "\nBilling Month (Auto-Generated): " << record.month << "\n";
+        
+        measure("load_users", 1, 1, [&](size_t) { store.size(); });
+        measure("load_ledger_index", 1, 1, [&](size_t) { index.size(); });
+        measure("load_history", 1, 1, [&](size_t) { history.refresh(); });
+        measure("load_statistics", 1, 1, [&](size_t) { stats.refresh(); });
+        
+        // What registerUser does once the form is filled in
+        measure("register", passwordOps, 1, [&](size_t i) {
+            User user = User();
+            user.username = "suite" + to_string(i);
+            user.fullName = "Suite User";
+            user.streetNumber = "1";
+            user.residentialArea = "Area0";
+            user.numberOfMeters = 1;
+            user.meter1Serial = "S" + to_string(i);
+            if (!store.exists(user.username) && !store.serialInUse(user.meter1Serial)) {
+                user.password = hashPassword("Bench@1234", passwordIterations());
+                ostringstream block;
+                writeUserBlock(block, user);
+                if (log.append(WAL_USERS, block.str().data(), block.str().length(), true)) {
+                    store.add(user);
+                }
+            }
+        });
+        measure("login", passwordOps, 1, [&](size_t i) {
+            const User* user = store.find(names[picks[i] / spec.metersPerUser]);
+            bool outdated;
+            if (user == NULL || !verifyPassword(user->password, "Bench@1234", outdated)) {
+                cout << "Warning: login failed in the suite\n";
+            }
+        });
+        measure("last_reading", lookupOps, 100, [&](size_t i) {
+            index.latest(names[picks[i] / spec.metersPerUser], serials[picks[i]]);
+        });
+        measure("history_page", historyOps, 10, [&](size_t i) {
+            size_t total = 0;
+            history.page(names[picks[i] / spec.metersPerUser], filter, 0, 5, total);
+        });
+        measure("statistics", lookupOps, 100, [&](size_t i) {
+            const string& name = names[picks[i] / spec.metersPerUser];
+            stats.forUser(name);
+            for (int m = 0; m < spec.metersPerUser; m++) {
+                stats.forMeter(name, serials[picks[i] / spec.metersPerUser * spec.metersPerUser + m]);
+            }
+        });
+        volatile double sink = 0;
+        measure("calculate_bill", billOps, 1000, [&](size_t i) { sink = sink + calculateBill((int)(i % 1000)); });
     }
     
-    // Auto-fetch previous reading
-    int lastReading = getLastMeterReading(username, selectedMeter);
+    ofstream outFile(resultsFile.c_str());
+    char line[512];
+    outFile << "{\n  \"suite\": \"pf-bench\",\n  \"format\": 1,\n";
+    outFile << "  \"dataset\": {\"users\": " << spec.users << ", \"meters_per_user\": " << spec.metersPerUser
+            << ", \"months\": " << spec.months << ", \"seed\": " << spec.seed << ", \"records\": "
+            << meters * spec.months << "},\n";
+    outFile << "  \"hash_iterations\": " << passwordIterations() << ",\n";
+#ifdef PF_METRICS
+    outFile << "  \"metrics_compiled\": true,\n";
+#else
+    outFile << "  \"metrics_compiled\": false,\n";
+#endif
+    outFile << "  \"results\": [\n";
+    cout << fixed << setprecision(3);
+    cout << left << setw(20) << "operation" << right << setw(10) << "ops" << setw(12) << "total ms"
+         << setw(12) << "mean us" << setw(12) << "p50 us" << setw(12) << "p99 us" << "\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const SuiteResult& r = results[i];
+        snprintf(line, sizeof(line),
+                 "    {\"name\": \"%s\", \"operations\": %zu, \"total_ms\": %.3f, \"mean_us\": %.4f, "
+                 "\"p50_us\": %.4f, \"p99_us\": %.4f}%s\n",
+                 r.name.c_str(), r.operations, r.totalMs, r.meanUs, r.p50Us, r.p99Us,
+                 (i + 1 < results.size()) ? "," : "");
+        outFile << line;
+        cout << left << setw(20) << r.name << right << setw(10) << r.operations << setw(12) << r.totalMs
+             << setw(12) << r.meanUs << setw(12) << r.p50Us << setw(12) << r.p99Us << "\n";
+    }
+    outFile << "  ]\n}\n";
+    outFile.close();
     
-    if (lastReading > 0) {
-        cout << "Previous Meter Reading (Auto-Fetched): " << lastReading << " units\n";
-        record.previousReading = lastReading;
-    } else {
-        cout << "No previous record found for this meter.\n";
-        record.previousReading = getValidInteger("Enter Previous Meter Reading: ");
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove((benchDir + "/" + files[i]).c_str());
+    }
+    rmdir(benchDir.c_str());
+    if (!outFile) {
+        cout << "Unable to write " << resultsFile << "\n";
+        return 1;
     }
+    cout << "Results written to " << resultsFile << "\n";
+    return 0;
+}
+
+// The results of a suite run, read back from the one-operation-per-line layout
+bool readSuiteResults(const string& fileName, vector<SuiteResult>& results) {
+    ifstream inFile(fileName.c_str());
+    string line;
     
-    // Get current reading with validation
-    while (true) {
-        record.currentReading = getValidInteger("Enter Current Meter Reading: ");
-        
-        if (record.currentReading < record.previousReading) {
-            cout << "\nError: Current reading (" << record.currentReading 
-                 << ") cannot be less than previous reading (" 
-                 << record.previousReading << ")!\n";
-            cout << "Please enter current reading again.\n\n";
-        } else {
-            break;
+    results.clear();
+    while (getline(inFile, line)) {
+        size_t name = line.find("\"name\": \"");
+        size_t mean = line.find("\"mean_us\": ");
+        size_t operations = line.find("\"operations\": ");
+        if (name == string::npos || mean == string::npos || operations == string::npos) {
+            continue;
         }
+        SuiteResult result = SuiteResult();
+        name += 9;
+        result.name = line.substr(name, line.find('"', name) - name);
+        result.meanUs = atof(line.c_str() + mean + 11);
+        result.operations = strtoull(line.c_str() + operations + 14, NULL, 10);
+        results.push_back(result);
     }
+    return !results.empty();
+}
+
+// Compare two suite runs operation by operation; exits 1 when any operation's mean
+// got more than thresholdPercent slower, so a script can stop on a regression
+int compareSuiteResults(const string& baseFile, const string& currentFile, double thresholdPercent) {
+    vector<SuiteResult> base, current;
     
-    // Calculate units consumed
-    record.unitsConsumed = record.currentReading - record.previousReading;
-    
-    // Calculate bill
-    record.totalBill = calculateBill(record.unitsConsumed);
+    if (!readSuiteResults(baseFile, base) || !readSuiteResults(currentFile, current)) {
+        cout << "Unable to read suite results from " << baseFile << " and " << currentFile << "\n";
+        return 1;
+    }
     
-    // Display bill details with calculation
-    clearScreen();
-    cout << "\n========================================\n";
-    cout << "         BILL SUMMARY\n";
-    cout << "========================================\n";
-    cout << "User           : " << user.fullName << "\n";
-    cout << "Meter Serial   : " << record.meterSerial << "\n";
-    cout << "Billing Month  : " << record.month << "\n";
-    cout << "========================================\n";
-    cout << fixed << setprecision(2);
-    cout << "Previous Reading : " << record.previousReading << " units\n";
-    cout << "Current Reading  : " << record.currentReading << " units\n";
-    cout << "Units Consumed   : " << record.unitsConsumed << " units\n";
-    cout << "========================================\n";
+    int slower = 0;
+    cout << fixed << setprecision(3);
+    cout << left << setw(20) << "operation" << right << setw(14) << "base us" << setw(14) << "current us"
+         << setw(10) << "change" << "\n";
+    for (size_t i = 0; i < current.size(); i++) {
+        const SuiteResult* before = NULL;
+        for (size_t j = 0; j < base.size(); j++) {
+            if (base[j].name == current[i].name) {
+                before = &base[j];
+            }
+        }
+        if (before == NULL || before->meanUs <= 0) {
+            cout << left << setw(20) << current[i].name << right << setw(14) << "-" << setw(14)
+                 << current[i].meanUs << setw(10) << "new" << "\n";
+            continue;
+        }
+        double change = 100.0 * (current[i].meanUs - before->meanUs) / before->meanUs;
+        bool regression = change > thresholdPercent;
+        slower += regression ? 1 : 0;
+        cout << left << setw(20) << current[i].name << right << setw(14) << before->meanUs << setw(14)
+             << current[i].meanUs << setw(9) << setprecision(1) << showpos << change << "%" << noshowpos
+             << setprecision(3) << (regression ? "  SLOWER" : "") << "\n";
+    }
+    cout << slower << " operations more than " << setprecision(0) << thresholdPercent << "% slower\n";
+    return slower > 0 ? 1 : 0;
+}
+
+// Register details.password (plain text) after the same checks as the console;
+// the password is hashed on the pool and the user appended through the log. The
+// checks are repeated under the stripes of the name and serials, taken in address
+// order so overlapping registrations cannot deadlock, before the user is saved.
+RegisterResult registerAccount(const User& details) {
+    RegisterResult result = {false, ""};
+    User user = details;
     
-    // Show calculation breakdown
-    cout << "\nBill Calculation:\n";
-    cout << "----------------------------------------\n";
+    if (user.username.empty() || user.username.find_first_of(" \t\r\n") != string::npos) {
+        result.error = "Username must be one word!";
+        return result;
+    }
+    result.error = passwordProblem(user.password);
+    if (!result.error.empty()) {
+        return result;
+    }
+    if (user.numberOfMeters < 1 || user.numberOfMeters > 2 || user.meter1Serial.empty() ||
+        (user.numberOfMeters == 2 && user.meter2Serial.empty())) {
+        result.error = "A user has 1 or 2 meters, each with a serial number!";
+        return result;
+    }
+    if (user.numberOfMeters == 1) {
+        user.meter2Serial = "";
+    }
+    result.error = registrationConflict(user);
+    if (!result.error.empty()) {
+        return result;
+    }
     
-    if (record.unitsConsumed <= 100) {
-        cout << record.unitsConsumed << " units x Rs. 5 = Rs. " << (record.unitsConsumed * 5.0) << "\n";
-    } else if (record.unitsConsumed <= 300) {
-        cout << "First 100 units x Rs. 5 = Rs. " << (100 * 5.0) << "\n";
-        cout << "Next " << (record.unitsConsumed - 100) << " units x Rs. 8 = Rs. " << ((record.unitsConsumed - 100) * 8.0) << "\n";
-    } else {
-        cout << "First 100 units x Rs. 5  = Rs. " << (100 * 5.0) << "\n";
-        cout << "Next 200 units x Rs. 8   = Rs. " << (200 * 8.0) << "\n";
-        cout << "Remaining " << (record.unitsConsumed - 300) << " units x Rs. 10 = Rs. " << ((record.unitsConsumed - 300) * 10.0) << "\n";
+    PasswordJob job = {user.password, "", false};
+    PasswordResult hashed = passwordHasher.run(job);
+    if (hashed.busy || hashed.stored.empty()) {
+        result.error = "Password hashing is busy, try again!";
+        return result;
     }
+    user.password = hashed.stored;
     
-    cout << "========================================\n";
-    cout << "TOTAL BILL AMOUNT: Rs. " << record.totalBill << "\n";
-    cout << "========================================\n";
+    vector<mutex*> stripes;
+    stripes.push_back(&userLocks.forKey(user.username));
+    stripes.push_back(&userLocks.forKey(user.meter1Serial));
+    if (user.numberOfMeters == 2) {
+        stripes.push_back(&userLocks.forKey(user.meter2Serial));
+    }
+    sort(stripes.begin(), stripes.end());
+    stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+    vector<unique_lock<mutex> > guards;
+    for (size_t i = 0; i < stripes.size(); i++) {
+        guards.push_back(unique_lock<mutex>(*stripes[i]));
+    }
+    result.error = registrationConflict(user);
+    if (!result.error.empty()) {
+        return result;
+    }
+    if (!saveUser(user)) {
+        result.error = "Unable to open file!";
+        return result;
+    }
+    unique_lock<shared_mutex> guard(usersLock);
+    userStore.add(user);
+    result.ok = true;
+    return result;
+}
+
+// Why user cannot be registered: a taken username, or a meter serial that already
+// belongs to someone (one meter belongs to one user). Empty if it can be.
+string registrationConflict(const User& user) {
+    shared_lock<shared_mutex> guard(usersLock);
+    if (userStore.exists(user.username)) {
+        return "Username already exists!";
+    }
+    string taken = takenSerial(user);
+    return taken.empty() ? "" : "Meter serial " + taken + " is already registered!";
+}
+
+// Check the password on the hashing pool; a password stored in an old form is
+// re-hashed and the user block appended again
+LoginResult loginAccount(const string& username, const string& password) {
+    PF_TIMED(METRIC_VALIDATE_LOGIN);
+    LoginResult result = {false, "Invalid username or password!", User()};
+    User user;
+    {
+        shared_lock<shared_mutex> guard(usersLock);
+        const User* found = userStore.find(username);
+        if (found == NULL) {
+            return result;
+        }
+        user = *found;
+    }
     
-    // Save record to file
-    saveBillingRecord(record);
+    PasswordJob job = {password, user.password, true};
+    PasswordResult checked = passwordHasher.run(job);
+    if (checked.busy) {
+        result.error = "Password hashing is busy, try again!";
+        return result;
+    }
+    if (!checked.ok) {
+        return result;
+    }
     
-    cout << "\nBilling record saved successfully!\n";
-    cout << "Press Enter to continue...";
-    cin.get();
+    if (!checked.stored.empty()) {
+        lock_guard<mutex> nameGuard(userLocks.forKey(username));
+        user.password = checked.stored;
+        if (saveUser(user)) {
+            // Every reader of the store holds usersLock, so it can be compacted here
+            unique_lock<shared_mutex> guard(usersLock);
+            userStore.add(user);
+            compactUsers();
+        }
+    }
+    result.ok = true;
+    result.error = "";
+    result.user = user;
+    result.user.password = "";
+    return result;
 }
 
-double calculateBill(int units) {
-    double bill = 0.0;
+// Bill and save a reading for one of the user's meters. The period and previous
+// reading follow the meter's last record; previousReading and firstPeriod are only
+// used for a meter's first bill, and default to 0 and the current period when -1.
+// The meter's stripe is held from the lookup to the save, so two readings of one
+// meter cannot both follow the same last record.
+SubmitResult submitReading(const string& username, const string& meterSerial, int currentReading,
+                           int previousReading, int firstPeriod) {
+    SubmitResult result = {false, "", BillingRecord()};
+    string area;
+    {
+        shared_lock<shared_mutex> guard(usersLock);
+        const User* user = userStore.find(username);
+        if (user == NULL) {
+            result.error = "Unknown user!";
+            return result;
+        }
+        if (meterSerial != user->meter1Serial && (user->numberOfMeters != 2 || meterSerial != user->meter2Serial)) {
+            result.error = "Meter " + meterSerial + " is not registered to " + username + "!";
+            return result;
+        }
+        area = user->residentialArea;
+    }
     
-    if (units <= 100) {
-        bill = units * 5.0;
-    } else if (units <= 300) {
-        bill = (100 * 5.0) + ((units - 100) * 8.0);
-    } else {
-        bill = (100 * 5.0) + (200 * 8.0) + ((units - 300) * 10.0);
+    BillingRecord& record = result.record;
+    record.username = username;
+    record.meterSerial = meterSerial;
+    record.currentReading = currentReading;
+    lock_guard<mutex> meterGuard(meterLocks.forKey(LedgerIndex::key(username, meterSerial)));
+    bool known = false;
+    {
+        shared_lock<shared_mutex> guard(indexLock);
+        const MeterState* state = lookupMeter(ledgerIndex, username, meterSerial);
+        if (state != NULL) {
+            known = true;
+            record.period = nextPeriod(state->lastPeriod);
+            record.previousReading = state->lastReading;
+        }
+    }
+    if (!known) {
+        record.period = (firstPeriod >= 0) ? firstPeriod : currentPeriod();
+        record.previousReading = max(0, previousReading);
+        if (!plausibleFirstYear(record.period / 12)) {
+            result.error = "First billing month " + periodName(record.period) + " is too far from today!";
+            return result;
+        }
+    }
+    if (record.currentReading < record.previousReading) {
+        result.error = "Current reading (" + to_string(record.currentReading) +
+                       ") cannot be less than previous reading (" + to_string(record.previousReading) + ")!";
+        return result;
     }
+    record.unitsConsumed = record.currentReading - record.previousReading;
+    record.totalBill = calculateBill(record.unitsConsumed, area);
     
-    return bill;
+    // The bill is only reported once it is on disk; flushes from several threads share one write
+    if (!saveBillingRecord(record) || !ledgerWriter.flush()) {
+        result.error = "Unable to save the billing record!";
+        return result;
+    }
+    result.ok = true;
+    return result;
 }
 
-void saveBillingRecord(BillingRecord record) {
-    ofstream outFile("records.txt", ios::app);
+// One page of the user's history, newest first
+HistoryResult billingHistory(const string& username, const HistoryFilter& filter, size_t page, size_t perPage) {
+    HistoryResult result = {true, "", 0, vector<HistoryRow>()};
     
-    if (outFile.is_open()) {
-        outFile << record.username << " "
-                << record.meterSerial << " "
-                << record.month << " "
-                << record.previousReading << " "
-                << record.currentReading << " "
-                << record.unitsConsumed << " "
-                << fixed << setprecision(2) << record.totalBill << endl;
-        outFile.close();
+    // History pages are read from the file, so buffered records must be on it
+    ledgerWriter.flush();
+    {
+        unique_lock<shared_mutex> guard(historyLock);
+        historyIndex.refresh();
     }
+    shared_lock<shared_mutex> guard(historyLock);
+    result.rows = historyIndex.page(username, filter, page, perPage, result.total);
+    return result;
 }
 
-void displayBillingHistory(string username) {
-    clearScreen();
-    cout << "\n========================================\n";
-    cout << "       BILLING HISTORY - " << username << "\n";
-    cout << "========================================\n\n";
+// Totals over all of the user's bills, and per meter
+StatsResult usageStatistics(const string& username) {
+    StatsResult result = {false, "", UsageAggregate(), vector<pair<string, UsageAggregate> >()};
+    User user;
+    {
+        shared_lock<shared_mutex> guard(usersLock);
+        const User* found = userStore.find(username);
+        if (found == NULL) {
+            result.error = "Unknown user!";
+            return result;
+        }
+        user = *found;
+    }
     
-    ifstream inFile("records.txt");
-    BillingRecord record;
-    bool recordFound = false;
-    int recordNumber = 1;
+    shared_lock<shared_mutex> guard(indexLock);
+    const UsageAggregate* total = usageStats.forUser(username);
+    if (total != NULL) {
+        result.total = *total;
+    }
+    for (int i = 0; i < user.numberOfMeters; i++) {
+        const string& serial = (i == 0) ? user.meter1Serial : user.meter2Serial;
+        const UsageAggregate* meter = usageStats.forMeter(username, serial);
+        result.meters.push_back(make_pair(serial, (meter != NULL) ? *meter : UsageAggregate()));
+    }
+    result.ok = true;
+    return result;
+}
+
+// One request of the servers or one line of --commands, answered through the
+// library calls; LOGOUT lets one script act as many users. Returns false after QUIT.
+bool runCommand(ServerSession& session, const vector<string>& fields, string& reply) {
+    PF_TIMED(METRIC_SERVER_REQUEST);
+    const string& command = fields[0];
     
-    if (inFile.is_open()) {
-        cout << fixed << setprecision(2);
-        
-        while (inFile >> record.username) {
-            inFile >> record.meterSerial;
-            inFile.ignore();
-            getline(inFile, record.month);
-            inFile >> record.previousReading >> record.currentReading 
-                   >> record.unitsConsumed >> record.totalBill;
-            inFile.ignore();
-            
-            if (record.username == username) {
-                recordFound = true;
-                
-                cout << "Record #" << recordNumber++ << "\n";
-                cout << "----------------------------------------\n";
-                cout << "Meter Serial     : " << record.meterSerial << "\n";
-                cout << "Month            : " << record.month << "\n";
-                cout << "Previous Reading : " << record.previousReading << " units\n";
-                cout << "Current Reading  : " << record.currentReading << " units\n";
-                cout << "Units Consumed   : " << record.unitsConsumed << " units\n";
-                cout << "Total Bill       : Rs. " << record.totalBill << "\n";
-                cout << "----------------------------------------\n\n";
-            }
+    if (command == "REGISTER") {
+        if (fields.size() < 7 || fields.size() > 8) {
+            reply += "ERR usage: REGISTER username password fullName street area serial1 [serial2]\n";
+            return true;
         }
-        inFile.close();
-        
-        if (!recordFound) {
-            cout << "No billing records found for this user.\n";
+        User user = User();
+        user.username = fields[1];
+        user.password = fields[2];
+        user.fullName = fields[3];
+        user.streetNumber = fields[4];
+        user.residentialArea = fields[5];
+        user.numberOfMeters = fields.size() - 6;
+        user.meter1Serial = fields[6];
+        user.meter2Serial = (user.numberOfMeters == 2) ? fields[7] : "";
+        RegisterResult result = registerAccount(user);
+        reply += result.ok ? "OK registered\n" : "ERR " + result.error + "\n";
+    } else if (command == "LOGIN") {
+        if (fields.size() != 3) {
+            reply += "ERR usage: LOGIN username password\n";
+            return true;
+        }
+        // A successful login gets a token for RESUME
+        LoginResult result = loginAccount(fields[1], fields[2]);
+        session.loggedIn = result.ok;
+        session.user = result.user;
+        reply += result.ok ? "OK " + result.user.fullName + "\t" + sessionCache.issue(result.user.username) + "\n" :
+                             "ERR " + result.error + "\n";
+    } else if (command == "RESUME") {
+        // Log in again with the token from an earlier LOGIN, without the password
+        string username;
+        if (fields.size() != 2 || !sessionCache.check(fields[1], username)) {
+            reply += "ERR invalid or expired token\n";
+            return true;
+        }
+        shared_lock<shared_mutex> guard(usersLock);
+        const User* user = userStore.find(username);
+        if (user == NULL) {
+            reply += "ERR invalid or expired token\n";
+            return true;
+        }
+        session.user = *user;
+        session.user.password = "";
+        session.loggedIn = true;
+        reply += "OK " + user->fullName + "\n";
+    } else if (command == "LOGOUT") {
+        session.loggedIn = false;
+        reply += "OK logged out\n";
+    } else if (command == "QUIT") {
+        reply += "OK bye\n";
+        return false;
+    } else if (command != "SUBMIT" && command != "HISTORY" && command != "STATS") {
+        reply += "ERR unknown command\n";
+    } else if (!session.loggedIn) {
+        reply += "ERR login required\n";
+    } else if (command == "SUBMIT") {
+        if (fields.size() != 3 && fields.size() != 5) {
+            reply += "ERR usage: SUBMIT serial currentReading [previousReading month]\n";
+            return true;
+        }
+        int previous = (fields.size() == 5) ? atoi(fields[3].c_str()) : -1;
+        int period = (fields.size() == 5) ? periodArgument(fields[4]) : -1;
+        SubmitResult result = submitReading(session.user.username, fields[1], atoi(fields[2].c_str()), previous, period);
+        if (!result.ok) {
+            reply += "ERR " + result.error + "\n";
+            return true;
+        }
+        const BillingRecord& record = result.record;
+        reply += "OK " + periodText(record.period) + " " + to_string(record.previousReading) + " " +
+                 to_string(record.currentReading) + " " + to_string(record.unitsConsumed) + " " +
+                 formatPaisa(amountToPaisa(record.totalBill)) + "\n";
+    } else if (command == "HISTORY") {
+        HistoryFilter filter = {"", -1, -1};
+        size_t page = (fields.size() > 1) ? max(1, atoi(fields[1].c_str())) - 1 : 0;
+        if (fields.size() > 2) {
+            filter.meterSerial = fields[2];
+        }
+        if (fields.size() > 4) {
+            filter.fromPeriod = periodArgument(fields[3]);
+            filter.toPeriod = periodArgument(fields[4]);
+        }
+        HistoryResult result = billingHistory(session.user.username, filter, page, 5);
+        reply += "OK " + to_string(result.rows.size()) + " " + to_string(result.total) + "\n";
+        for (size_t i = 0; i < result.rows.size(); i++) {
+            reply += to_string(result.rows[i].number) + " ";
+            formatBillingRecord(reply, result.rows[i].record);
         }
     } else {
-        cout << "Unable to open records file!\n";
+        StatsResult result = usageStatistics(session.user.username);
+        const UsageAggregate& stats = result.total;
+        reply += "OK " + to_string(stats.count) + " " + to_string(stats.totalUnits) + " " +
+                 formatPaisa(stats.totalPaisa) + " " + to_string(stats.minUnits) + " " +
+                 to_string(stats.maxUnits) + "\n";
     }
-    
-    cout << "\nPress Enter to continue...";
-    cin.get();
+    return true;
 }
 
-void displayStatistics(string username) {
-    clearScreen();
-    cout << "\n========================================\n";
-    cout << "   USAGE STATISTICS - " << username << "\n";
-    cout << "========================================\n\n";
+// --commands: run tab-separated command lines from inputFd, writing one reply per
+// command to outputFd. Blank lines and lines starting with # are skipped. Replies
+// are written once per chunk read, so thousands of commands cost a handful of
+// writes, yet a caller waiting on each reply still gets it. Returns how many
+// commands failed.
+int runCommands(int inputFd, int outputFd) {
+    ServerSession session;
+    session.fd = outputFd;
+    session.loggedIn = false;
     
-    ifstream inFile("records.txt");
-    BillingRecord record;
-    int totalRecords = 0;
-    int totalUnits = 0;
-    double totalAmount = 0.0;
-    int maxUnits = 0;
-    int minUnits = 999999;
-    
-    if (inFile.is_open()) {
-        while (inFile >> record.username) {
-            inFile >> record.meterSerial;
-            inFile.ignore();
-            getline(inFile, record.month);
-            inFile >> record.previousReading >> record.currentReading 
-                   >> record.unitsConsumed >> record.totalBill;
-            inFile.ignore();
-            
-            if (record.username == username) {
-                totalRecords++;
-                totalUnits += record.unitsConsumed;
-                totalAmount += record.totalBill;
-                
-                if (record.unitsConsumed > maxUnits) {
-                    maxUnits = record.unitsConsumed;
-                }
-                if (record.unitsConsumed < minUnits) {
-                    minUnits = record.unitsConsumed;
-                }
+    string pending;
+    string reply;
+    char chunk[65536];
+    bool open = true;
+    bool finished = false;
+    size_t commands = 0;
+    int failed = 0;
+    
+    while (open && !finished) {
+        ssize_t received = read(inputFd, chunk, sizeof(chunk));
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            finished = true;            // a last line without a newline still runs
+            pending += '\n';
+        } else {
+            pending.append(chunk, received);
+        }
+        
+        size_t start = 0;
+        size_t end;
+        reply.clear();
+        while (open && (end = pending.find('\n', start)) != string::npos) {
+            string line = pending.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line[line.length() - 1] == '\r') {
+                line.erase(line.length() - 1);
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
             }
+            size_t before = reply.length();
+            open = runCommand(session, splitFields(line, '\t'), reply);
+            commands++;
+            failed += (reply.compare(before, 3, "ERR") == 0) ? 1 : 0;
         }
-        inFile.close();
+        pending.erase(0, start);
         
-        if (totalRecords > 0) {
-            cout << fixed << setprecision(2);
-            cout << "Total Bills Generated : " << totalRecords << "\n";
-            cout << "Total Units Consumed  : " << totalUnits << " units\n";
-            cout << "Total Amount Paid     : Rs. " << totalAmount << "\n";
-            cout << "Average Units/Month   : " << (totalUnits / totalRecords) << " units\n";
-            cout << "Average Bill/Month    : Rs. " << (totalAmount / totalRecords) << "\n";
-            cout << "Highest Consumption   : " << maxUnits << " units\n";
-            cout << "Lowest Consumption    : " << minUnits << " units\n";
-            cout << "========================================\n";
-        } else {
-            cout << "No statistics available yet.\n";
+        if (!reply.empty() && !writeFully(outputFd, reply.data(), reply.length(), -1)) {
+            break;
         }
-    } else {
-        cout << "Unable to open records file!\n";
     }
     
-    cout << "\nPress Enter to continue...";
-    cin.get();
+    ledgerWriter.flush();
+    usageStats.persist();
+    cerr << commands << " commands, " << failed << " failed\n";
+    return failed;
 }
\ No newline at end of file